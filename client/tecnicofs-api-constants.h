@@ -3,7 +3,8 @@
 #define TECNICOFS_API_CONSTANTS_H
 
 #define MAX_FILE_NAME 100
-#define MAX_INPUT_SIZE 100
+#define MAX_PATH_SIZE 4096
+#define MAX_INPUT_SIZE (2 * MAX_PATH_SIZE + 8)
 
 
 typedef enum permission { NONE, WRITE, READ, RW } permission;
@@ -31,5 +32,11 @@ typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 #define TECNICOFS_ERROR_INVALID_MODE -10
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
+/* Directory is not empty */
+#define TECNICOFS_ERROR_DIR_NOT_EMPTY -12
+/* A path component is not a directory */
+#define TECNICOFS_ERROR_NOT_A_DIRECTORY -13
+/* Resource in use by another client, try again later */
+#define TECNICOFS_ERROR_BUSY -14
 
 #endif /* TECNICOFS_API_CONSTANTS_H */
@@ -5,108 +5,856 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include "tecnicofs-api-constants.h"
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-protocol.h"
 
-int sockfd, clilen, servlen;
+int sockfd = -1, clilen, servlen;
 struct sockaddr_un cli_addr, serv_addr;
+uint32_t next_request_id = 0;
+int transport = TFS_TRANSPORT_DGRAM;
+
+/* Bytes received from a stream socket that do not form a whole reply yet */
+char stream_buffer[sizeof(tfs_frame_len) + TFS_MAX_MESSAGE];
+int stream_length = 0;
+
+/* Batch being recorded by tfsBatchAdd */
+char batch_buffer[TFS_MAX_MESSAGE];
+int batch_length = -1, batch_count = 0;
+
+/*
+ * Completion table: the request with id "ticket" owns slot
+ * ticket % TFS_MAX_INFLIGHT until its result is collected.
+ */
+typedef enum slot_state { SLOT_FREE, SLOT_PENDING, SLOT_DONE } slot_state;
+
+typedef struct completion {
+    slot_state state;
+    uint32_t ticket;
+    int result;
+    int *results; /* for batches, one result per request */
+    int count; /* for batches, number of requests */
+    char *payload; /* for payload replies, where to copy the payload */
+    int payload_size; /* size of payload */
+} completion;
+
+completion completions[TFS_MAX_INFLIGHT];
+
+/* Tickets in the order they completed, for tfsWaitAny */
+uint32_t done_queue[TFS_MAX_INFLIGHT];
+int done_head = 0, done_tail = 0, pending_count = 0;
+
+
+/*
+ * Drops from the done queue the tickets already collected by tfsPoll or
+ * tfsWait. At most TFS_MAX_INFLIGHT tickets are uncollected, so this always
+ * makes room when the queue is full.
+ */
+static void done_queue_compact() {
+    int kept = 0;
+    for (int i = done_head; i != done_tail; i++) {
+        uint32_t id = done_queue[i % TFS_MAX_INFLIGHT];
+        completion *slot = &completions[id % TFS_MAX_INFLIGHT];
+        if (slot->state == SLOT_DONE && slot->ticket == id)
+            done_queue[(done_head + kept++) % TFS_MAX_INFLIGHT] = id;
+    }
+    done_tail = done_head + kept;
+}
 
 
 /*
- * Sends a request to a server socket. Prints the response to stdout.
- * Protocol:
- *  - sends: string representing a command
- *  - receives: SUCCESS or FAIL
+ * Stores the reply of a pending request in its slot. Replies that match
+ * no pending request (e.g. late ones) are discarded.
  * Input:
- *  - command: string representing the command
- * Returns: SUCCESS or FAIL 
+ *  - buffer: received bytes
+ *  - n: number of received bytes
  */
-int datagram_send(char *command) {
-    char *rec_buffer = malloc(sizeof(char)*SERVER_RESPONSE_SIZE);
-    int n = strlen(command);
+static void complete_reply(char *buffer, int n) {
+    tfs_reply_header reply, result;
+    completion *slot;
+
+    if (tfs_decode_reply(buffer, n, &reply) < 0)
+        return;
+    slot = &completions[reply.request_id % TFS_MAX_INFLIGHT];
+    if (slot->state != SLOT_PENDING || slot->ticket != reply.request_id)
+        return;
 
-    command[n] = '\0';
-    if (sendto(sockfd, command, n, 0, (struct sockaddr*)&serv_addr, servlen) != n) {
-        fprintf(stderr,"datagram_send: sendto error\n");
-        return -1;
+    slot->result = reply.status != 0 ? reply.status : reply.value;
+    if (slot->results != NULL) {
+        if (reply.value < 0 || reply.value > slot->count ||
+            reply.payload_len != reply.value * sizeof(tfs_reply_header)) {
+            slot->result = TECNICOFS_ERROR_CONNECTION_ERROR;
+            reply.value = 0;
+            reply.status = TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+        for (int i = 0; i < reply.value; i++) {
+            memcpy(&result, buffer + (i + 1) * sizeof(tfs_reply_header), sizeof(result));
+            slot->results[i] = result.status != 0 ? result.status : result.value;
+        }
+        /* requests after a malformed one were not executed */
+        for (int i = reply.value; i < slot->count; i++)
+            slot->results[i] = reply.status;
+        if (slot->result >= 0)
+            slot->result = slot->count;
+    } else if (slot->payload != NULL && reply.status == 0) {
+        int n = (int) reply.payload_len < slot->payload_size ? (int) reply.payload_len : slot->payload_size - 1;
+        memcpy(slot->payload, buffer + sizeof(tfs_reply_header), n);
+        slot->payload[n] = '\0';
+        slot->result = n;
     }
+    slot->state = SLOT_DONE;
+    pending_count--;
+    if (done_tail - done_head == TFS_MAX_INFLIGHT)
+        done_queue_compact();
+    done_queue[done_tail++ % TFS_MAX_INFLIGHT] = slot->ticket;
+}
+
+/*
+ * Receives replies from the server socket and completes their requests.
+ * Input:
+ *  - block: if set, waits until at least one message arrives
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int datagram_receive(int block) {
+    char rec_buffer[TFS_MAX_MESSAGE];
+    int n, flags = block ? 0 : MSG_DONTWAIT;
 
-    if ((n = recvfrom(sockfd, rec_buffer, SERVER_RESPONSE_SIZE, 0, 0, 0)) < 0) {
-        fprintf(stderr,"datagram_send: recvfrom error\n");
-        return -1;
+    while ((n = recv(sockfd, rec_buffer, sizeof(rec_buffer), flags)) >= 0) {
+        complete_reply(rec_buffer, n);
+        flags = MSG_DONTWAIT;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr,"datagram_receive: recv error\n");
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
-    rec_buffer[n] = '\0';
-    puts(rec_buffer);
     return 0;
 }
 
 /*
- * tfs functions use datagram_send to communicate with the server. 
+ * Receives replies from a stream socket and completes their requests.
+ * Input:
+ *  - block: if set, waits until at least one byte arrives
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int stream_receive(int block) {
+    int n, off, flags = block ? 0 : MSG_DONTWAIT;
+    long len;
+
+    while ((n = recv(sockfd, stream_buffer + stream_length,
+                     sizeof(stream_buffer) - stream_length, flags)) > 0) {
+        stream_length += n;
+        for (off = 0; (len = tfs_decode_frame(stream_buffer + off, stream_length - off)) >= 0; ) {
+            if (len > TFS_MAX_MESSAGE) {
+                fprintf(stderr,"stream_receive: invalid frame\n");
+                return TECNICOFS_ERROR_CONNECTION_ERROR;
+            }
+            if (stream_length - off < (int) (sizeof(tfs_frame_len) + len))
+                break;
+            complete_reply(stream_buffer + off + sizeof(tfs_frame_len), len);
+            off += sizeof(tfs_frame_len) + len;
+        }
+        memmove(stream_buffer, stream_buffer + off, stream_length - off);
+        stream_length -= off;
+        flags = MSG_DONTWAIT;
+    }
+    if (n == 0) {
+        /* the server closed the connection, pending requests never complete */
+        fprintf(stderr,"stream_receive: connection closed\n");
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr,"stream_receive: recv error\n");
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Receives replies with the transport of the session.
+ * Input:
+ *  - timeout: ms to wait for a message, -1 to wait until one arrives,
+ *    0 to only take what was already received
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int receive_replies(int timeout) {
+    struct pollfd pfd;
+    int n;
+
+    if (timeout > 0) {
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        if ((n = poll(&pfd, 1, timeout)) < 0 && errno != EINTR)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        if (n <= 0)
+            return 0;
+    }
+    return transport == TFS_TRANSPORT_STREAM ? stream_receive(timeout < 0) : datagram_receive(timeout < 0);
+}
+
+/*
+ * Sends a message to the server stream socket, preceded by its length,
+ * without waiting for its reply. While the socket is full, replies are
+ * received so the server is never stuck writing to this client.
+ * Input:
+ *  - request: encoded message
+ *  - length: size of the encoded message
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int stream_send(char *request, int length) {
+    char frame[sizeof(tfs_frame_len) + TFS_MAX_MESSAGE];
+    tfs_frame_len len = length;
+    int n, off = 0, total = sizeof(len) + length;
+    struct pollfd pfd;
+
+    memcpy(frame, &len, sizeof(len));
+    memcpy(frame + sizeof(len), request, length);
+    while (off < total) {
+        if ((n = send(sockfd, frame + off, total - off, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0) {
+            off += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr,"stream_send: send error\n");
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+        pfd.fd = sockfd;
+        pfd.events = POLLIN | POLLOUT;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        if ((pfd.revents & (POLLIN | POLLHUP)) && stream_receive(0) < 0)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Sends a message to the server socket without waiting for its reply.
+ * While the server's queue is full, replies are received so the server
+ * is never stuck sending to this client.
+ * Protocol (see tecnicofs-protocol.h):
+ *  - sends: a tfs_request_header followed by its paths, or a batch
+ *  - receives: a tfs_reply_header with the same request_id
+ * Input:
+ *  - request: encoded message
+ *  - length: size of the encoded message
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int datagram_send(char *request, int length) {
+    struct pollfd pfd;
+
+    while (send(sockfd, request, length, MSG_DONTWAIT) != length) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr,"datagram_send: send error\n");
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+        pfd.fd = sockfd;
+        pfd.events = POLLIN | POLLOUT;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        if ((pfd.revents & POLLIN) && datagram_receive(0) < 0)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Claims the first free slot from the next ticket on and sends a message
+ * with the ticket of that slot. Slots are probed so that a ticket never
+ * collected (e.g. one whose reply was lost) only holds its own slot.
+ * Input:
+ *  - request: buffer with the message, whose request id is filled here
+ *  - length: size of the message
+ *  - results: for batches, array for the results, else NULL
+ *  - count: for batches, number of requests
+ * Returns: the ticket, or a TECNICOFS_ERROR_* code (TECNICOFS_ERROR_BUSY
+ *  if TFS_MAX_INFLIGHT tickets are pending or waiting to be collected)
+ */
+static int submit(char *request, int length, int *results, int count) {
+    uint32_t ticket = next_request_id & INT32_MAX;
+    completion *slot;
+    int res, i;
+
+    for (i = 0; i < TFS_MAX_INFLIGHT; i++, ticket = (ticket + 1) & INT32_MAX) {
+        slot = &completions[ticket % TFS_MAX_INFLIGHT];
+        if (slot->state == SLOT_FREE)
+            break;
+    }
+    if (i == TFS_MAX_INFLIGHT)
+        return TECNICOFS_ERROR_BUSY;
+    /* request_id sits at the same offset in requests and batches */
+    memcpy(request + offsetof(tfs_request_header, request_id), &ticket, sizeof(ticket));
+    slot->state = SLOT_PENDING;
+    slot->ticket = ticket;
+    slot->results = results;
+    slot->count = count;
+    slot->payload = NULL;
+    pending_count++;
+    res = transport == TFS_TRANSPORT_STREAM ? stream_send(request, length) : datagram_send(request, length);
+    if (res < 0) {
+        slot->state = SLOT_FREE;
+        pending_count--;
+        return res;
+    }
+    next_request_id = ticket + 1;
+    return ticket;
+}
+
+/*
+ * Submits a request without waiting for its reply.
+ * Input:
+ *  - op: command letter ('c', 'd', 'l', 'm' or 'p')
+ *  - nodeType: 'f' or 'd' for 'c', else ignored
+ *  - path: first path
+ *  - path2: second path for 'm', else NULL
+ * Returns:
+ *  - ticket to pass to tfsPoll or tfsWait
+ *  - TECNICOFS_ERROR_BUSY: TFS_MAX_INFLIGHT tickets are pending or
+ *    waiting to be collected
+ *  - TECNICOFS_ERROR_OTHER: invalid request
+ *  - TECNICOFS_ERROR_NO_OPEN_SESSION, TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSubmit(char op, char nodeType, char *path, char *path2) {
+    char request[TFS_MAX_MESSAGE];
+    int n;
+
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    if ((n = tfs_encode_request(request, sizeof(request), op,
+                                op == TFS_OP_CREATE ? nodeType : 0, 0, path, path2)) < 0)
+        return TECNICOFS_ERROR_OTHER;
+    return submit(request, n, NULL, 0);
+}
+
+/*
+ * Collects the result of a completed ticket, freeing its slot.
+ */
+static int collect(completion *slot, int *result) {
+    *result = slot->result;
+    slot->state = SLOT_FREE;
+    return 1;
+}
+
+/*
+ * Checks, without blocking, if a ticket has completed.
+ * Input:
+ *  - ticket: returned by a submit call
+ *  - result: pointer to store what the blocking tfs call would return
+ * Returns: 1 if completed (the ticket is then released), 0 if pending,
+ *  or a TECNICOFS_ERROR_* code
+ */
+int tfsPoll(int ticket, int *result) {
+    completion *slot = &completions[(uint32_t) ticket % TFS_MAX_INFLIGHT];
+    int res;
+
+    if (ticket < 0 || slot->state == SLOT_FREE || slot->ticket != (uint32_t) ticket)
+        return TECNICOFS_ERROR_OTHER;
+    if (slot->state == SLOT_PENDING && (res = receive_replies(0)) < 0)
+        return res;
+    if (slot->state == SLOT_DONE)
+        return collect(slot, result);
+    return 0;
+}
+
+/*
+ * Waits until a ticket completes.
+ * Input:
+ *  - ticket: returned by a submit call
+ *  - result: pointer to store what the blocking tfs call would return
+ * Returns: 0, or a TECNICOFS_ERROR_* code
+ */
+int tfsWait(int ticket, int *result) {
+    completion *slot = &completions[(uint32_t) ticket % TFS_MAX_INFLIGHT];
+    int res;
+
+    if (ticket < 0 || slot->state == SLOT_FREE || slot->ticket != (uint32_t) ticket)
+        return TECNICOFS_ERROR_OTHER;
+    while (slot->state == SLOT_PENDING) {
+        if ((res = receive_replies(-1)) < 0)
+            return res;
+    }
+    collect(slot, result);
+    return 0;
+}
+
+/*
+ * Releases a ticket without collecting its result, e.g. one whose reply
+ * was lost. A reply that arrives later is discarded.
+ * Input:
+ *  - ticket: returned by a submit call
+ * Returns: 0, or TECNICOFS_ERROR_OTHER if the ticket is not in use
+ */
+int tfsCancel(int ticket) {
+    completion *slot = &completions[(uint32_t) ticket % TFS_MAX_INFLIGHT];
+
+    if (ticket < 0 || slot->state == SLOT_FREE || slot->ticket != (uint32_t) ticket)
+        return TECNICOFS_ERROR_OTHER;
+    if (slot->state == SLOT_PENDING)
+        pending_count--;
+    slot->state = SLOT_FREE;
+    return 0;
+}
+
+/*
+ * Collects the oldest completed ticket not collected yet.
+ * Input:
+ *  - ticket: pointer to store the ticket
+ *  - result: pointer to store its result
+ *  - timeout: ms to wait for a completion, -1 to wait until one arrives,
+ *    0 to not wait
+ * Returns: 1 if a ticket was collected, 0 if none completed (in time, or
+ *  nothing is pending), or a TECNICOFS_ERROR_* code
+ */
+int tfsWaitAny(int *ticket, int *result, int timeout) {
+    struct timespec now;
+    long deadline = 0;
+    int res;
+
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    if ((res = receive_replies(0)) < 0)
+        return res;
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        deadline = now.tv_sec * 1000L + now.tv_nsec / 1000000 + timeout;
+    }
+    while (1) {
+        while (done_head != done_tail) {
+            uint32_t id = done_queue[done_head++ % TFS_MAX_INFLIGHT];
+            completion *slot = &completions[id % TFS_MAX_INFLIGHT];
+            /* skip tickets already collected by tfsPoll or tfsWait, or cancelled */
+            if (slot->state == SLOT_DONE && slot->ticket == id) {
+                *ticket = id;
+                return collect(slot, result);
+            }
+        }
+        if (timeout == 0 || pending_count == 0)
+            return 0;
+        if (timeout > 0) {
+            /* replies of cancelled tickets wake up the wait too */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((timeout = deadline - (now.tv_sec * 1000L + now.tv_nsec / 1000000)) <= 0)
+                return 0;
+        }
+        if ((res = receive_replies(timeout)) < 0)
+            return res;
+    }
+}
+
+/*
+ * Submits a request and waits for its reply.
+ * Input:
+ *  - opcode: TFS_OP_*
+ *  - nodeType: 'f' or 'd' for TFS_OP_CREATE, else 0
+ *  - path: first path
+ *  - path2: second path, or NULL
+ * Returns: the value of the reply on success, else a TECNICOFS_ERROR_* code
+ */
+static int tfs_request_send(uint8_t opcode, char nodeType, char *path, char *path2) {
+    int ticket, result, res;
+
+    if ((ticket = tfsSubmit(opcode, nodeType, path, path2)) < 0)
+        return ticket;
+    if ((res = tfsWait(ticket, &result)) < 0)
+        return res;
+    return result;
+}
+
+/*
+ * tfs functions submit a request and wait for its reply.
  * Each function corresponds to a possible operation on tecnicofs.
- * Each function returns 0 in case of success, -1 otherwise.
+ * Each function returns 0 in case of success (tfsLookup returns the
+ * i-number found), otherwise a TECNICOFS_ERROR_* code.
  */
 
 int tfsCreate(char *filename, char nodeType) {
-  char *command = malloc(sizeof(char)*MAX_INPUT_SIZE);
-  sprintf(command, "c %s %c", filename, nodeType);
-  if (datagram_send(command) < 0) return -1;
-  return 0;
+  return tfs_request_send(TFS_OP_CREATE, nodeType, filename, NULL);
 }
 
 int tfsDelete(char *path) {
-  char *command = malloc(sizeof(char)*MAX_INPUT_SIZE);
-  sprintf(command, "d %s", path);
-  if (datagram_send(command) < 0) return -1;
-  return 0;
+  return tfs_request_send(TFS_OP_DELETE, 0, path, NULL);
 }
 
 int tfsMove(char *from, char *to) {
-  char *command = malloc(sizeof(char)*MAX_INPUT_SIZE);
-  sprintf(command, "m %s %s", from, to);
-  if (datagram_send(command) < 0) return -1;
-  return 0;
+  return tfs_request_send(TFS_OP_MOVE, 0, from, to);
 }
 
 int tfsLookup(char *path) {
-  char *command = malloc(sizeof(char)*MAX_INPUT_SIZE);
-  sprintf(command, "l %s", path);
-  if (datagram_send(command) < 0) return -1;
-  return 0;
+  return tfs_request_send(TFS_OP_LOOKUP, 0, path, NULL);
 }
 
 int tfsPrint(char *path){
-    char *command = malloc(sizeof(char)*MAX_INPUT_SIZE);
-    sprintf(command, "p %s", path);
-    if (datagram_send(command) < 0) return -1;
+    return tfs_request_send(TFS_OP_PRINT, 0, path, NULL);
+}
+
+/*
+ * Sends a request answered with a text payload and waits for it.
+ * Input:
+ *  - opcode: TFS_OP_STATS or TFS_OP_LOCKS
+ *  - path: path of the request
+ *  - buffer: where to store the text, '\0' terminated
+ *  - size: size of the buffer
+ * Returns: length of the text stored, or a TECNICOFS_ERROR_* code
+ */
+static int text_request_send(uint8_t opcode, char *path, char *buffer, int size) {
+    char request[sizeof(tfs_request_header) + MAX_FILE_NAME];
+    int ticket, result, res, n;
+
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    if (size <= 0 ||
+        (n = tfs_encode_request(request, sizeof(request), opcode, 0, 0, path, NULL)) < 0)
+        return TECNICOFS_ERROR_OTHER;
+    if ((ticket = submit(request, n, NULL, 0)) < 0)
+        return ticket;
+    completions[ticket % TFS_MAX_INFLIGHT].payload = buffer;
+    completions[ticket % TFS_MAX_INFLIGHT].payload_size = size;
+    if ((res = tfsWait(ticket, &result)) < 0)
+        return res;
+    return result;
+}
+
+/*
+ * Asks the server for its counters.
+ * Input:
+ *  - buffer: where to store the "name value" lines, '\0' terminated
+ *  - size: size of the buffer
+ * Returns: length of the text stored, or a TECNICOFS_ERROR_* code
+ */
+int tfsStats(char *buffer, int size) {
+    return text_request_send(TFS_OP_STATS, "", buffer, size);
+}
+
+/*
+ * Asks the server for its most contended i-nodes, see TFS_OP_LOCKS.
+ * Input:
+ *  - top: number of i-nodes, up to TFS_MAX_LOCK_REPORT
+ *  - buffer: where to store the report, '\0' terminated
+ *  - size: size of the buffer
+ * Returns: length of the text stored, or a TECNICOFS_ERROR_* code (the
+ *  server was not started with lock profiling)
+ */
+int tfsLockStats(int top, char *buffer, int size) {
+    char count[16];
+
+    sprintf(count, "%d", top);
+    return text_request_send(TFS_OP_LOCKS, count, buffer, size);
+}
+
+/*
+ * Asks the server for a chunk of a dump, received in the background.
+ * Input:
+ *  - cursor: chunk asked for, or NULL to open a dump
+ *  - flags: 0 or TFS_DUMP_CLOSE
+ *  - buffer: where to receive the chunk, TFS_MAX_MESSAGE + 1 bytes
+ * Returns: the ticket, or a TECNICOFS_ERROR_* code
+ */
+static int dump_submit(tfs_dump_cursor *cursor, int flags, char *buffer) {
+    char request[sizeof(tfs_request_header) + sizeof(tfs_dump_cursor)];
+    int ticket;
+
+    if ((ticket = submit(request, tfs_encode_dump_request(request, 0, cursor, flags), NULL, 0)) < 0)
+        return ticket;
+    completions[ticket % TFS_MAX_INFLIGHT].payload = buffer;
+    completions[ticket % TFS_MAX_INFLIGHT].payload_size = TFS_MAX_MESSAGE + 1;
+    return ticket;
+}
+
+/*
+ * Waits for the chunk asked for, makes it the one being read and asks for
+ * the next one.
+ * Input:
+ *  - dump: the dump
+ * Returns: 0 or a TECNICOFS_ERROR_* code
+ */
+static int dump_receive(tfs_dump *dump) {
+    tfs_dump_chunk chunk;
+    tfs_dump_cursor cursor;
+    int res, result;
+
+    res = tfsWait(dump->ticket, &result);
+    dump->ticket = -1;
+    if (res < 0)
+        return res;
+    if (result < 0)
+        return result;
+    if (result < (int) sizeof(chunk))
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    dump->current = !dump->current;
+    memcpy(&chunk, dump->chunks[dump->current], sizeof(chunk));
+    if (dump->next_seq != 0 && (chunk.session != dump->session || chunk.seq != dump->next_seq))
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    dump->session = chunk.session;
+    dump->next_seq = chunk.seq + 1;
+    dump->last = chunk.last;
+    dump->pos = sizeof(chunk);
+    dump->length = result;
+    dump->left = chunk.count;
+    if (!dump->last) {
+        cursor.session = dump->session;
+        cursor.seq = dump->next_seq;
+        if ((dump->ticket = dump_submit(&cursor, 0, dump->chunks[!dump->current])) < 0) {
+            res = dump->ticket;
+            dump->ticket = -1;
+            return res;
+        }
+    }
     return 0;
 }
 
+/*
+ * Opens a dump of the whole tree, as it was when the server got the
+ * request, to be read with tfsDumpNext and released with tfsDumpClose.
+ * Only one dump is open on the server at a time.
+ * Input:
+ *  - dump: the dump
+ * Returns: 0 or a TECNICOFS_ERROR_* code (TECNICOFS_ERROR_BUSY if another
+ *  client is reading a dump)
+ */
+int tfsDumpOpen(tfs_dump *dump) {
+    int res;
+
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    memset(dump, 0, sizeof(*dump));
+    dump->ticket = -1;
+    dump->path_size = MAX_PATH_SIZE;
+    dump->ends_size = 64;
+    dump->chunks[0] = malloc(TFS_MAX_MESSAGE + 1);
+    dump->chunks[1] = malloc(TFS_MAX_MESSAGE + 1);
+    dump->path = malloc(dump->path_size);
+    dump->ends = malloc(sizeof(int) * dump->ends_size);
+    if (dump->chunks[0] == NULL || dump->chunks[1] == NULL || dump->path == NULL || dump->ends == NULL) {
+        tfsDumpClose(dump);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    /* the first chunk is received in chunks[0] */
+    dump->current = 1;
+    if ((dump->ticket = dump_submit(NULL, 0, dump->chunks[0])) < 0) {
+        res = dump->ticket;
+        dump->ticket = -1;
+        tfsDumpClose(dump);
+        return res;
+    }
+    if ((res = dump_receive(dump)) < 0) {
+        tfsDumpClose(dump);
+        return res;
+    }
+    return 0;
+}
+
+/*
+ * Reads the next node of a dump. Every directory comes right before its
+ * subtree, starting with the root, whose path is "".
+ * Input:
+ *  - dump: the dump
+ *  - path: pointer to store the path of the node, valid until the next call
+ *  - nodeType: pointer to store 'f' or 'd'
+ *  - depth: pointer to store its depth (0 for the root)
+ * Returns: 1 if a node was read, 0 at the end, or a TECNICOFS_ERROR_* code
+ */
+int tfsDumpNext(tfs_dump *dump, char **path, char *nodeType, int *depth) {
+    tfs_dump_record record;
+    int n, res, start;
+
+    while (dump->left == 0) {
+        if (dump->last)
+            return 0;
+        if ((res = dump_receive(dump)) < 0)
+            return res;
+    }
+    n = tfs_decode_dump_record(dump->chunks[dump->current] + dump->pos, dump->length - dump->pos, &record);
+    if (n < 0 || (int) record.depth > dump->depth)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    /* the parent path ends where the node at the previous depth began */
+    start = record.depth > 0 ? dump->ends[record.depth - 1] : 0;
+    while (start + 1 + record.name_len + 1 > dump->path_size) {
+        char *grown = realloc(dump->path, dump->path_size * 2);
+        if (grown == NULL)
+            return TECNICOFS_ERROR_OTHER;
+        dump->path = grown;
+        dump->path_size *= 2;
+    }
+    if ((int) record.depth >= dump->ends_size) {
+        int *grown = realloc(dump->ends, sizeof(int) * dump->ends_size * 2);
+        if (grown == NULL)
+            return TECNICOFS_ERROR_OTHER;
+        dump->ends = grown;
+        dump->ends_size *= 2;
+    }
+    if (record.depth > 0)
+        dump->path[start++] = '/';
+    memcpy(dump->path + start, dump->chunks[dump->current] + dump->pos + sizeof(record), record.name_len);
+    dump->path[start + record.name_len] = '\0';
+    dump->ends[record.depth] = start + record.name_len;
+    dump->depth = record.node_type == 'd' ? record.depth + 1 : record.depth;
+    dump->pos += n;
+    dump->left--;
+
+    *path = dump->path;
+    *nodeType = record.node_type;
+    *depth = record.depth;
+    return 1;
+}
+
+/*
+ * Releases a dump, telling the server if it was not read to the end.
+ * Input:
+ *  - dump: the dump
+ * Returns: 0 or a TECNICOFS_ERROR_* code
+ */
+int tfsDumpClose(tfs_dump *dump) {
+    tfs_dump_cursor cursor;
+    int res = 0, result;
+
+    if (dump->ticket >= 0) {
+        /* the next chunk was already asked for */
+        if (tfsWait(dump->ticket, &result) == 0 && result >= (int) sizeof(tfs_dump_chunk)) {
+            tfs_dump_chunk chunk;
+            memcpy(&chunk, dump->chunks[!dump->current], sizeof(chunk));
+            dump->last = chunk.last;
+            dump->next_seq = chunk.seq + 1;
+        } else {
+            dump->last = 1;
+        }
+        dump->ticket = -1;
+    }
+    if (!dump->last && dump->next_seq != 0) {
+        cursor.session = dump->session;
+        cursor.seq = dump->next_seq;
+        if ((dump->ticket = dump_submit(&cursor, TFS_DUMP_CLOSE, dump->chunks[0])) >= 0)
+            res = tfsWait(dump->ticket, &result) < 0 ? TECNICOFS_ERROR_CONNECTION_ERROR : 0;
+        else
+            res = dump->ticket;
+        dump->ticket = -1;
+    }
+    free(dump->chunks[0]);
+    free(dump->chunks[1]);
+    free(dump->path);
+    free(dump->ends);
+    memset(dump, 0, sizeof(*dump));
+    dump->ticket = -1;
+    return res;
+}
+
+/*
+ * Starts recording a batch of requests, discarding any batch not submitted.
+ * Returns: 0 or TECNICOFS_ERROR_NO_OPEN_SESSION
+ */
+int tfsBatchBegin() {
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    batch_length = sizeof(tfs_batch_header);
+    batch_count = 0;
+    return 0;
+}
+
+/*
+ * Adds a request to the batch being recorded. Nothing is sent until
+ * tfsBatchSubmit.
+ * Input:
+ *  - op: command letter ('c', 'd', 'l', 'm' or 'p')
+ *  - nodeType: 'f' or 'd' for 'c', else ignored
+ *  - path: first path
+ *  - path2: second path for 'm', else NULL
+ * Returns:
+ *  - index of the request in the batch
+ *  - TECNICOFS_ERROR_OTHER: no batch begun, or the batch is full and
+ *    must be submitted first
+ */
+int tfsBatchAdd(char op, char nodeType, char *path, char *path2) {
+    int n;
+
+    if (batch_length < 0 || batch_count == TFS_MAX_BATCH)
+        return TECNICOFS_ERROR_OTHER;
+    if ((n = tfs_encode_request(batch_buffer + batch_length, sizeof(batch_buffer) - batch_length,
+                                op, op == TFS_OP_CREATE ? nodeType : 0,
+                                batch_count, path, path2)) < 0)
+        return TECNICOFS_ERROR_OTHER;
+    batch_length += n;
+    return batch_count++;
+}
+
+/*
+ * Sends the recorded batch in a single message without waiting for it.
+ * Input:
+ *  - results: array with room for one result per request, filled when
+ *    the ticket completes; results[i] gets what the single tfs call
+ *    would return for request i
+ * Returns: a ticket, whose result is the number of requests, or a
+ *  TECNICOFS_ERROR_* code
+ */
+int tfsBatchSubmitAsync(int results[]) {
+    int n;
+
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    if (batch_length < 0)
+        return TECNICOFS_ERROR_OTHER;
+    n = batch_length;
+    batch_length = -1;
+    tfs_encode_batch(batch_buffer, 0, batch_count);
+    return submit(batch_buffer, n, results, batch_count);
+}
+
+/*
+ * Sends the recorded batch in a single message and waits for its reply.
+ * Input:
+ *  - results: as for tfsBatchSubmitAsync
+ * Returns: number of results stored, or a TECNICOFS_ERROR_* code
+ */
+int tfsBatchSubmit(int results[]) {
+    int ticket, result, res;
+
+    if ((ticket = tfsBatchSubmitAsync(results)) < 0)
+        return ticket;
+    if ((res = tfsWait(ticket, &result)) < 0)
+        return res;
+    return result;
+}
+
 /*
  * Creates and initializes the client's socket and server's address
  * Input:
  *  - sockPath: path for the server's address
+ *  - type: TFS_TRANSPORT_DGRAM or TFS_TRANSPORT_STREAM, as the server
+ *    was started with
  * Returns:
  *  - 0: Success
- *  - -1: Fail
+ *  - TECNICOFS_ERROR_OPEN_SESSION: already mounted
+ *  - TECNICOFS_ERROR_CONNECTION_ERROR: Fail
  */
-int tfsMount(char * sockPath) {
+int tfsMountTransport(char * sockPath, int type) {
   char str_pid[20], cl_path[MAX_FILE_NAME];
-  sprintf(str_pid, "%d", getpid());
-  sprintf(cl_path, "/tmp/client-");
-  strcat(cl_path, str_pid);
+  if (sockfd >= 0)
+      return TECNICOFS_ERROR_OPEN_SESSION;
+  if (type != TFS_TRANSPORT_DGRAM && type != TFS_TRANSPORT_STREAM)
+      return TECNICOFS_ERROR_OTHER;
 
-  /* Client socket and address */
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
+  /* Client socket and address, only datagrams need one */
+  if ((sockfd = socket(AF_UNIX, type == TFS_TRANSPORT_STREAM ? SOCK_STREAM : SOCK_DGRAM, 0) ) < 0) {
       fprintf(stderr,"tfsMount: client socket error\n");
-      return -1;
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
   }
   bzero((char*) &cli_addr, sizeof(cli_addr));
-  cli_addr.sun_family = AF_UNIX;
-  strcpy(cli_addr.sun_path, cl_path);
-  clilen = sizeof(cli_addr.sun_family) + strlen(cli_addr.sun_path);
-  if (bind(sockfd, (struct sockaddr*) &cli_addr, clilen) < 0) {
-      fprintf(stderr,"tfsMount: client bind error\n");
-      return -1;
+  if (type == TFS_TRANSPORT_DGRAM) {
+      sprintf(str_pid, "%d", getpid());
+      sprintf(cl_path, "/tmp/client-");
+      strcat(cl_path, str_pid);
+      cli_addr.sun_family = AF_UNIX;
+      strcpy(cli_addr.sun_path, cl_path);
+      clilen = sizeof(cli_addr.sun_family) + strlen(cli_addr.sun_path);
+      unlink(cl_path);
+      if (bind(sockfd, (struct sockaddr*) &cli_addr, clilen) < 0) {
+          fprintf(stderr,"tfsMount: client bind error\n");
+          close(sockfd);
+          sockfd = -1;
+          return TECNICOFS_ERROR_CONNECTION_ERROR;
+      }
   }
 
   /* Server address */
@@ -114,23 +862,47 @@ int tfsMount(char * sockPath) {
   serv_addr.sun_family = AF_UNIX;
   strcpy(serv_addr.sun_path, sockPath);
   servlen = sizeof(serv_addr.sun_family) + strlen(serv_addr.sun_path);
+  /* connected, so a full server queue can be polled for */
+  if (connect(sockfd, (struct sockaddr*) &serv_addr, servlen) < 0) {
+      fprintf(stderr,"tfsMount: connect error\n");
+      close(sockfd);
+      sockfd = -1;
+      if (type == TFS_TRANSPORT_DGRAM)
+          unlink(cl_path);
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+  transport = type;
+  stream_length = 0;
+  memset(completions, 0, sizeof(completions));
+  done_head = done_tail = pending_count = 0;
   return 0;
 }
 
+/*
+ * Mounts the server's datagram socket, see tfsMountTransport.
+ */
+int tfsMount(char * sockPath) {
+  return tfsMountTransport(sockPath, TFS_TRANSPORT_DGRAM);
+}
+
 /*
  * Close client socket and unlink its path.
  * Returns:
  *  - 0: Success
- *  - -1: Fail
+ *  - TECNICOFS_ERROR_NO_OPEN_SESSION: not mounted
+ *  - TECNICOFS_ERROR_CONNECTION_ERROR: Fail
  */
 int tfsUnmount() {
+    if (sockfd < 0)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
     if (close(sockfd) != 0) {
         fprintf(stderr,"tfsUnmount: close error\n");
-        return -1;
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
-    if (unlink(cli_addr.sun_path) != 0) {
+    sockfd = -1;
+    if (transport == TFS_TRANSPORT_DGRAM && unlink(cli_addr.sun_path) != 0) {
         fprintf(stderr,"tfsUnmount: unlink error\n");
-        return -1;
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
     return 0;
 }
@@ -4,15 +4,54 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "tecnicofs-api-constants.h"
+#include "tecnicofs-protocol.h"
 
-#define SERVER_RESPONSE_SIZE 3
+/* Most tickets submitted and not collected at any time */
+#define TFS_MAX_INFLIGHT 256
 
-int datagram_send(char *command);
+/* Socket types for tfsMountTransport */
+#define TFS_TRANSPORT_DGRAM 0
+#define TFS_TRANSPORT_STREAM 1
+
+/*
+ * Tree dump being read with tfsDumpNext. While one chunk is read, the
+ * next one is already being received.
+ */
+typedef struct tfs_dump {
+    char *chunks[2]; /* chunk being read, and the next one */
+    int current; /* index of the chunk being read */
+    int ticket; /* of the next chunk, or -1 if none was asked for */
+    uint32_t session;
+    uint32_t next_seq; /* number of the next chunk to ask for */
+    int last; /* set once the final chunk was received */
+    int pos, length, left; /* read position, size and records left */
+    char *path; /* path of the last node read */
+    int path_size;
+    int *ends; /* length of the path of each ancestor of the next node */
+    int ends_size, depth;
+} tfs_dump;
+
+int datagram_send(char *request, int length);
+int tfsSubmit(char op, char nodeType, char *path, char *path2);
+int tfsPoll(int ticket, int *result);
+int tfsWait(int ticket, int *result);
+int tfsCancel(int ticket);
+int tfsWaitAny(int *ticket, int *result, int timeout);
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsPrint(char *path);
 int tfsMove(char *from, char *to);
+int tfsStats(char *buffer, int size);
+int tfsLockStats(int top, char *buffer, int size);
+int tfsDumpOpen(tfs_dump *dump);
+int tfsDumpNext(tfs_dump *dump, char **path, char *nodeType, int *depth);
+int tfsDumpClose(tfs_dump *dump);
+int tfsBatchBegin();
+int tfsBatchAdd(char op, char nodeType, char *path, char *path2);
+int tfsBatchSubmitAsync(int results[]);
+int tfsBatchSubmit(int results[]);
+int tfsMountTransport(char* serverName, int type);
 int tfsMount(char* serverName);
 int tfsUnmount();
 
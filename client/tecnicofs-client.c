@@ -1,25 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include "tecnicofs-client-api.h"
-#include "../tecnicofs-api-constants.h"
+#include "tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* serverName;
+int transportType = TFS_TRANSPORT_DGRAM;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-t dgram|stream] inputfile server_socket_name\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't' && strcmp(optarg, "dgram") == 0)
+            transportType = TFS_TRANSPORT_DGRAM;
+        else if (opt == 't' && strcmp(optarg, "stream") == 0)
+            transportType = TFS_TRANSPORT_STREAM;
+        else
+            displayUsage(argv[0]);
+    }
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile== NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -58,14 +71,14 @@ void *processInput() {
                         if (!res)
                           printf("Created file: %s\n", arg1);
                         else
-                          printf("Unable to create file: %s\n", arg1);
+                          printf("Unable to create file: %s (error %d)\n", arg1, res);
                         break;
                     case 'd':
                         res = tfsCreate(arg1, 'd');
                         if (!res)
                           printf("Created directory: %s\n", arg1);
                         else
-                          printf("Unable to create directory: %s\n", arg1);
+                          printf("Unable to create directory: %s (error %d)\n", arg1, res);
                         break;
                     default:
                         fprintf(stderr, "Error: invalid node type\n");
@@ -87,7 +100,7 @@ void *processInput() {
                 if (!res)
                   printf("Deleted: %s\n", arg1);
                 else
-                  printf("Unable to delete: %s\n", arg1);
+                  printf("Unable to delete: %s (error %d)\n", arg1, res);
                 break;
             case 'm':
                 if(numTokens != 3)
@@ -96,7 +109,7 @@ void *processInput() {
                 if (!res)
                   printf("Moved: %s to %s\n", arg1, arg2);
                 else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
+                  printf("Unable to move: %s to %s (error %d)\n", arg1, arg2, res);
                 break;
             case 'p':
                 if(numTokens != 2)
@@ -105,8 +118,43 @@ void *processInput() {
                 if (!res)
                     printf("Tecnicofs printed to: %s\n", arg1);
                 else
-                    printf("Unable to print to: %s\n", arg1);
+                    printf("Unable to print to: %s (error %d)\n", arg1, res);
+                break;
+            case 's': {
+                char stats[TFS_MAX_MESSAGE];
+                res = tfsStats(stats, sizeof(stats));
+                if (res >= 0)
+                    printf("Stats:\n%s", stats);
+                else
+                    printf("Unable to get stats (error %d)\n", res);
                 break;
+            }
+            case 'k': {
+                char report[TFS_MAX_MESSAGE];
+                if (numTokens > 2)
+                    errorParse();
+                res = tfsLockStats(numTokens == 2 ? atoi(arg1) : 10, report, sizeof(report));
+                if (res >= 0)
+                    printf("Lock contention:\n%s", report);
+                else
+                    printf("Unable to get lock contention (error %d)\n", res);
+                break;
+            }
+            case 't': {
+                tfs_dump dump;
+                char *path, nodeType;
+                int depth;
+                res = tfsDumpOpen(&dump);
+                if (res == 0) {
+                    printf("Tree:\n");
+                    while ((res = tfsDumpNext(&dump, &path, &nodeType, &depth)) == 1)
+                        printf("%s\n", path);
+                    tfsDumpClose(&dump);
+                }
+                if (res < 0)
+                    printf("Unable to dump the tree (error %d)\n", res);
+                break;
+            }
             case '#':
                 break;
             default: { /* error */
@@ -121,7 +169,7 @@ void *processInput() {
 int main(int argc, char* argv[]) {
     parseArgs(argc, argv);
 
-    if (tfsMount(serverName) == 0)
+    if (tfsMountTransport(serverName, transportType) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Load generator: N client processes (the client API keeps one session
+ * per process) send a random mix of operations to the server and record
+ * the latency of each one. Prints a CSV line with the throughput and the
+ * latency percentiles of the run.
+ *
+ *  - closed loop: every client keeps `window` requests in flight, sending
+ *    a new one as soon as one completes
+ *  - open loop (-r): clients send at a fixed total rate, whether or not
+ *    the server keeps up; latency counts from when a request was due, so
+ *    a server falling behind is not hidden by the generator waiting for it
+ *
+ * The server drops datagram replies a client does not read fast enough.
+ * When none of a client's requests complete for LOAD_REPLY_TIMEOUT
+ * seconds, the requests in flight are counted as lost and cancelled.
+ */
+
+/* Sub-buckets per power of two of the histogram, about 3% of error */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+/* Directories the keys are spread over */
+#define LOAD_DIRS 16
+/* Longest sleep of an open loop client with requests in flight, in ns */
+#define LOAD_POLL_NS 10000
+/* Seconds without a reply after which the requests in flight are lost */
+#define LOAD_REPLY_TIMEOUT 5
+#define LOAD_PRINT_PATH "/tmp/tecnicofs-load-print.txt"
+
+/* Operations of the mix, in the order of their weights */
+static const char mix_ops[] = {TFS_OP_CREATE, TFS_OP_LOOKUP, TFS_OP_DELETE, TFS_OP_MOVE, TFS_OP_PRINT};
+#define MIX_OPS (sizeof(mix_ops))
+
+/*
+ * Results of a client, in memory shared with the parent.
+ */
+typedef struct load_stats {
+    uint64_t ops, failed, lost;
+    uint64_t start, end; /* CLOCK_MONOTONIC, in ns, end of the last reply */
+    uint64_t max;
+    uint64_t hist[HIST_BUCKETS];
+} load_stats;
+
+char* serverName;
+int transportType = TFS_TRANSPORT_DGRAM;
+int numberClients = 1;
+int window = 1;
+long totalOps = 0;
+double duration = 5;
+double rate = 0; /* requests per second of all clients, 0 for closed loop */
+int numberKeys = 1024;
+int weights[MIX_OPS] = {40, 40, 10, 10, 0};
+int weightSum;
+int serverThreads = 0;
+int printHeader = 0;
+unsigned int seed = 1;
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-t dgram|stream] [-c clients] [-w window] [-n ops | -d seconds] "
+           "[-r ops/s] [-m c=40,l=40,d=10,m=10,p=0] [-k keys] [-s seed] [-T serverThreads] [-H] "
+           "server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Parses an operation mix, as "c=40,l=40,d=10,m=10,p=0". Operations not
+ * given get weight 0.
+ * Returns: 0 if valid, else -1
+ */
+static int parseMix(char *mix) {
+    char *item, *save;
+    int i;
+
+    memset(weights, 0, sizeof(weights));
+    for (item = strtok_r(mix, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long weight;
+        for (i = 0; i < MIX_OPS && mix_ops[i] != item[0]; i++);
+        if (i == MIX_OPS || item[1] != '=')
+            return -1;
+        weight = strtol(item + 2, &end, 10);
+        if (*end || end == item + 2 || weight < 0 || weight > 1000000)
+            return -1;
+        weights[i] = weight;
+    }
+    return 0;
+}
+
+static void parseArgs (long argc, char* const argv[]) {
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:c:w:n:d:r:m:k:s:T:H")) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "dgram") == 0)
+                    transportType = TFS_TRANSPORT_DGRAM;
+                else if (strcmp(optarg, "stream") == 0)
+                    transportType = TFS_TRANSPORT_STREAM;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'c':
+                numberClients = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'n':
+                totalOps = atol(optarg);
+                if (totalOps <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                if (duration <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                if (rate <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'm':
+                if (parseMix(optarg) != 0) {
+                    fprintf(stderr, "Error: invalid operation mix\n");
+                    displayUsage(argv[0]);
+                }
+                break;
+            case 'k':
+                numberKeys = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                serverThreads = atoi(optarg);
+                break;
+            case 'H':
+                printHeader = 1;
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Invalid format:\n");
+        displayUsage(argv[0]);
+    }
+    serverName = argv[optind];
+
+    for (weightSum = 0, i = 0; i < MIX_OPS; i++)
+        weightSum += weights[i];
+    if (numberClients < 1 || window < 1 || window > TFS_MAX_INFLIGHT || numberKeys < 1 || weightSum == 0) {
+        fprintf(stderr, "Error: invalid clients, window, keys or operation mix\n");
+        displayUsage(argv[0]);
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Bucket of a latency: values below HIST_SUB have their own bucket, and
+ * every power of two above is split in HIST_SUB buckets.
+ */
+static int hist_bucket(uint64_t value) {
+    int e;
+
+    if (value < HIST_SUB)
+        return value;
+    e = 63 - __builtin_clzll(value);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Middle of the range of values of a bucket.
+ */
+static double hist_value(int bucket) {
+    int e = bucket / HIST_SUB + HIST_SUB_BITS - 1, m = bucket % HIST_SUB;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    return (double) ((uint64_t) (HIST_SUB + m) << (e - HIST_SUB_BITS)) +
+           (double) ((uint64_t) 1 << (e - HIST_SUB_BITS)) / 2;
+}
+
+/*
+ * Latency, in ns, below which a fraction q of the operations completed.
+ */
+static double hist_percentile(const load_stats *stats, double q) {
+    uint64_t target = (uint64_t) (q * stats->ops), seen = 0;
+    int i;
+
+    if (stats->ops == 0)
+        return 0;
+    if (target >= stats->ops)
+        target = stats->ops - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += stats->hist[i];
+        if (seen > target)
+            break;
+    }
+    return i < HIST_BUCKETS && hist_value(i) < stats->max ? hist_value(i) : stats->max;
+}
+
+static void record(load_stats *stats, uint64_t now, uint64_t latency, int result) {
+    stats->end = now;
+    stats->ops++;
+    if (result < 0)
+        stats->failed++;
+    stats->hist[hist_bucket(latency)]++;
+    if (latency > stats->max)
+        stats->max = latency;
+}
+
+static void keyPath(char *path, int key) {
+    sprintf(path, "/load%d/f%d", key % LOAD_DIRS, key);
+}
+
+/*
+ * Submits a random operation of the mix.
+ * Returns: the ticket, or a TECNICOFS_ERROR_* code
+ */
+static int submitRandom(unsigned int *state) {
+    char path[MAX_INPUT_SIZE], path2[MAX_INPUT_SIZE];
+    int pick = rand_r(state) % weightSum, i;
+
+    for (i = 0; pick >= weights[i]; i++)
+        pick -= weights[i];
+    keyPath(path, rand_r(state) % numberKeys);
+    switch (mix_ops[i]) {
+        case TFS_OP_MOVE:
+            keyPath(path2, rand_r(state) % numberKeys);
+            return tfsSubmit(TFS_OP_MOVE, 0, path, path2);
+        case TFS_OP_PRINT:
+            return tfsSubmit(TFS_OP_PRINT, 0, LOAD_PRINT_PATH, NULL);
+        default:
+            return tfsSubmit(mix_ops[i], 'f', path, NULL);
+    }
+}
+
+/*
+ * Collects every completed request, waiting up to LOAD_REPLY_TIMEOUT
+ * seconds for one if block is set. If none completes in that time, the
+ * requests in flight are lost: they are cancelled to free their slots.
+ * Input:
+ *  - due: time each ticket counts from, by slot
+ *  - live: ticket in flight in each slot, or -1
+ *  - inflight: number of tickets in flight
+ * Returns: number collected, or a TECNICOFS_ERROR_* code
+ */
+static int collectReplies(load_stats *stats, uint64_t *due, int *live, int *inflight, int block) {
+    int ticket, result, res, count = 0, i;
+
+    while ((res = tfsWaitAny(&ticket, &result, block && count == 0 ? LOAD_REPLY_TIMEOUT * 1000 : 0)) == 1) {
+        uint64_t now = now_ns();
+        record(stats, now, now - due[ticket % TFS_MAX_INFLIGHT], result);
+        live[ticket % TFS_MAX_INFLIGHT] = -1;
+        (*inflight)--;
+        count++;
+    }
+    if (res == 0 && block && count == 0) {
+        for (i = 0; i < TFS_MAX_INFLIGHT; i++) {
+            if (live[i] >= 0) {
+                tfsCancel(live[i]);
+                live[i] = -1;
+                stats->lost++;
+            }
+        }
+        *inflight = 0;
+    }
+    return res < 0 ? res : count;
+}
+
+/*
+ * Runs one client, after the parent releases every client at once.
+ * Input:
+ *  - index: of the client
+ *  - ops: requests to send, or -1 to send them for `duration` seconds
+ *  - start_fd: read end of a pipe closed by the parent to start
+ *  - stats: where to store the results
+ * Returns: 0, or -1 on a connection error
+ */
+static int runClient(int index, long ops, int start_fd, load_stats *stats) {
+    uint64_t due[TFS_MAX_INFLIGHT], interval = 0, next, stop;
+    unsigned int state = seed * 7919 + index;
+    int live[TFS_MAX_INFLIGHT], inflight = 0;
+    int ticket, res, limit = rate > 0 ? TFS_MAX_INFLIGHT : window;
+    long sent = 0;
+    char c;
+
+    if (tfsMountTransport(serverName, transportType) != 0) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        return -1;
+    }
+    if (read(start_fd, &c, 1) < 0)
+        return -1;
+    close(start_fd);
+
+    memset(live, -1, sizeof(live));
+    stats->start = stats->end = next = now_ns();
+    stop = stats->start + (uint64_t) (duration * 1e9);
+    if (rate > 0) {
+        interval = (uint64_t) (1e9 * numberClients / rate);
+        /* spread the clients' schedules over one interval */
+        next += interval * index / numberClients;
+    }
+    while (1) {
+        uint64_t now = now_ns();
+        int more = ops >= 0 ? sent < ops : (rate > 0 ? next : now) < stop;
+
+        while (more && inflight < limit && (rate == 0 || next <= now)) {
+            if ((ticket = submitRandom(&state)) < 0) {
+                tfsUnmount();
+                return -1;
+            }
+            /* open loop requests count from when they were due */
+            due[ticket % TFS_MAX_INFLIGHT] = rate > 0 ? next : now;
+            live[ticket % TFS_MAX_INFLIGHT] = ticket;
+            next += interval;
+            inflight++;
+            sent++;
+            more = ops >= 0 ? sent < ops : (rate > 0 ? next : now) < stop;
+        }
+        if (!more && inflight == 0)
+            break;
+        if (rate == 0 || !more || inflight == limit) {
+            res = collectReplies(stats, due, live, &inflight, 1);
+        } else if ((res = collectReplies(stats, due, live, &inflight, 0)) == 0) {
+            now = now_ns();
+            if (next > now)
+                sleep_ns(inflight > 0 && next - now > LOAD_POLL_NS ? LOAD_POLL_NS : next - now);
+        }
+        if (res < 0) {
+            tfsUnmount();
+            return -1;
+        }
+    }
+    tfsUnmount();
+    return 0;
+}
+
+/*
+ * Creates the directories the keys are spread over.
+ */
+static void prepareTree() {
+    char path[MAX_INPUT_SIZE];
+    int i;
+
+    if (tfsMountTransport(serverName, transportType) != 0) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < LOAD_DIRS; i++) {
+        sprintf(path, "/load%d", i);
+        tfsCreate(path, 'd');
+    }
+    tfsUnmount();
+}
+
+int main(int argc, char* argv[]) {
+    load_stats *stats, total;
+    uint64_t start = UINT64_MAX, end = 0;
+    int start_pipe[2], i, j, status, failed = 0;
+    double seconds;
+
+    parseArgs(argc, argv);
+    prepareTree();
+
+    stats = mmap(NULL, sizeof(load_stats) * numberClients, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED || pipe(start_pipe) != 0) {
+        perror("tecnicofs-load");
+        exit(EXIT_FAILURE);
+    }
+    memset(stats, 0, sizeof(load_stats) * numberClients);
+    fflush(stdout);
+    for (i = 0; i < numberClients; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("tecnicofs-load: fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            long ops = totalOps ? totalOps / numberClients + (i < totalOps % numberClients) : -1;
+            close(start_pipe[1]);
+            _exit(runClient(i, ops, start_pipe[0], &stats[i]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    /* every client reads EOF at once */
+    close(start_pipe[0]);
+    close(start_pipe[1]);
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed = 1;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: a client failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < numberClients; i++) {
+        total.ops += stats[i].ops;
+        total.failed += stats[i].failed;
+        total.lost += stats[i].lost;
+        if (stats[i].max > total.max)
+            total.max = stats[i].max;
+        for (j = 0; j < HIST_BUCKETS; j++)
+            total.hist[j] += stats[i].hist[j];
+        if (stats[i].ops == 0)
+            continue;
+        if (stats[i].start < start)
+            start = stats[i].start;
+        if (stats[i].end > end)
+            end = stats[i].end;
+    }
+    seconds = end > start ? (end - start) / 1e9 : 0;
+
+    if (printHeader)
+        printf("server_threads,clients,mode,rate,window,ops,failed,lost,seconds,throughput,p50_us,p99_us,p999_us,max_us\n");
+    printf("%d,%d,%s,%.0f,%d,%lu,%lu,%lu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+           serverThreads, numberClients, rate > 0 ? "open" : "closed", rate,
+           rate > 0 ? 0 : window, (unsigned long) total.ops, (unsigned long) total.failed,
+           (unsigned long) total.lost, seconds, seconds > 0 ? total.ops / seconds : 0,
+           hist_percentile(&total, 0.5) / 1e3, hist_percentile(&total, 0.99) / 1e3,
+           hist_percentile(&total, 0.999) / 1e3, total.max / 1e3);
+    munmap(stats, sizeof(load_stats) * numberClients);
+    exit(EXIT_SUCCESS);
+}
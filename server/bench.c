@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "fs/operations.h"
+
+/*
+ * Microbenchmarks of the file system primitives, called directly by one
+ * thread, without sockets or a thread pool. Build it with the busy loops
+ * off, so the results are the real costs:
+ *   make clean && make DELAY=0 tecnicofs-bench
+ *
+ * Lookups, path parsing and moves run on trees of every depth and fan-out of
+ * the sweep: a chain of `depth` directories, each with `fanout - 1`
+ * sibling directories next to the next one of the chain.
+ *
+ * Prints CSV: benchmark,depth,fanout,iterations,ns_per_op
+ */
+
+/* Component of the chain, and prefix of the siblings */
+#define BENCH_CHAIN "d"
+#define BENCH_SIBLING "s"
+/* Growth of depth and fan-out between runs of the sweep */
+#define BENCH_STEP 4
+
+long iterations = 100000;
+int maxDepth = 16;
+int maxFanout = 1024;
+
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-n iterations] [-d maxDepth] [-f maxFanout]\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs (int argc, char* const argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:f:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            case 'd':
+                maxDepth = atoi(optarg);
+                break;
+            case 'f':
+                maxFanout = atoi(optarg);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if (optind != argc || iterations < 1 || maxDepth < 1 || maxFanout < 1)
+        displayUsage(argv[0]);
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *benchmark, int depth, int fanout, long count, double start) {
+    printf("%s,%d,%d,%ld,%.1f\n", benchmark, depth, fanout, count, (now_ns() - start) / count);
+}
+
+/*
+ * Unlocks the i-nodes an operation left locked.
+ */
+static void unlockAll(int inodeWaitList[], int *len) {
+    while (*len > 0)
+        unlock(inodeWaitList[--*len]);
+}
+
+static void mustCreate(char *path, type nodeType) {
+    int inodeWaitList[MAX_LOCKED], len = 0;
+    Path parsed;
+
+    if (path_parse(&parsed, path, strlen(path)) == FAIL) {
+        fprintf(stderr, "Error: cannot create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fs_mutation_begin(0);
+    if (create(&parsed, nodeType, inodeWaitList, &len) != SUCCESS) {
+        fprintf(stderr, "Error: cannot create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fs_mutation_end();
+    unlockAll(inodeWaitList, &len);
+    path_release(&parsed);
+}
+
+/*
+ * Builds the tree of a run of the sweep, under its own directory.
+ * Input:
+ *  - path: buffer to store the path of the deepest directory of the chain
+ *  - depth, fanout: shape of the tree
+ */
+static void buildTree(char *path, int depth, int fanout) {
+    char sibling[MAX_PATH_SIZE];
+
+    sprintf(path, "/t%dx%d", depth, fanout);
+    mustCreate(path, T_DIRECTORY);
+    for (int level = 1; level < depth; level++) {
+        for (int i = 1; i < fanout; i++) {
+            sprintf(sibling, "%s/" BENCH_SIBLING "%d", path, i);
+            mustCreate(sibling, T_DIRECTORY);
+        }
+        strcat(path, "/" BENCH_CHAIN);
+        mustCreate(path, T_DIRECTORY);
+    }
+}
+
+/*
+ * inode_create and inode_delete of n i-nodes of a type, timed apart.
+ */
+static void benchInodes(type nodeType, const char *create_name, const char *delete_name) {
+    int *inumbers = malloc(sizeof(int) * iterations);
+    double start;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        inumbers[i] = inode_create(nodeType);
+    report(create_name, 0, 0, iterations, start);
+    start = now_ns();
+    for (long i = iterations - 1; i >= 0; i--)
+        inode_delete(inumbers[i]);
+    report(delete_name, 0, 0, iterations, start);
+    free(inumbers);
+}
+
+/*
+ * dir_add_entry filling a directory with fanout entries, emptied by
+ * dir_reset_entry between rounds, and lookup_sub_node of its entries.
+ */
+static void benchDirectory(int fanout) {
+    int dir = inode_create(T_DIRECTORY), *children = malloc(sizeof(int) * fanout);
+    char (*texts)[MAX_FILE_NAME] = malloc(MAX_FILE_NAME * (size_t) fanout);
+    DirName *names = malloc(sizeof(DirName) * fanout), missing;
+    long rounds = (iterations + fanout - 1) / fanout, count = 0;
+    union Data data;
+    double start, added = 0, reset = 0;
+    int found = 0;
+
+    for (int i = 0; i < fanout; i++) {
+        children[i] = inode_create(T_FILE);
+        sprintf(texts[i], "entry%d", i);
+        dir_name(&names[i], texts[i]);
+    }
+    dir_name(&missing, "missing");
+    for (long round = 0; round < rounds; round++) {
+        start = now_ns();
+        for (int i = 0; i < fanout; i++)
+            dir_add_entry(dir, children[i], &names[i]);
+        added += now_ns() - start;
+        start = now_ns();
+        for (int i = 0; i < fanout; i++)
+            dir_reset_entry(dir, children[i], &names[i]);
+        reset += now_ns() - start;
+    }
+    printf("dir_add_entry,0,%d,%ld,%.1f\n", fanout, rounds * fanout, added / (rounds * fanout));
+    printf("dir_reset_entry,0,%d,%ld,%.1f\n", fanout, rounds * fanout, reset / (rounds * fanout));
+
+    for (int i = 0; i < fanout; i++)
+        dir_add_entry(dir, children[i], &names[i]);
+    inode_get(dir, NULL, &data);
+    start = now_ns();
+    for (count = 0; count < iterations; count++)
+        found += lookup_sub_node(&names[count % fanout], data.directory) != FAIL;
+    report("lookup_sub_node_hit", 0, fanout, count, start);
+    start = now_ns();
+    for (count = 0; count < iterations; count++)
+        found += lookup_sub_node(&missing, data.directory) != FAIL;
+    report("lookup_sub_node_miss", 0, fanout, count, start);
+    if (found != iterations)
+        fprintf(stderr, "Warning: lookup_sub_node found %d of %ld entries\n", found, iterations);
+
+    for (int i = 0; i < fanout; i++) {
+        dir_reset_entry(dir, children[i], &names[i]);
+        inode_delete(children[i]);
+    }
+    inode_delete(dir);
+    free(names);
+    free(texts);
+    free(children);
+}
+
+/*
+ * lookup, lookup_optimistic, path_parse and move on a tree of the given
+ * shape. Like the server, lookups and moves parse their paths every time.
+ */
+static void benchTree(int depth, int fanout) {
+    int inodeWaitList[MAX_LOCKED], len = 0, failed = 0;
+    char path[MAX_PATH_SIZE];
+    char from[MAX_PATH_SIZE + 2], to[MAX_PATH_SIZE + 2]; /* path and "/a" */
+    Path parsed, parsed2;
+    double start;
+    long i;
+    int path_len;
+
+    buildTree(path, depth, fanout);
+    path_len = strlen(path);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        path_parse(&parsed, path, path_len);
+        failed += lookup(&parsed, parsed.count, inodeWaitList, &len, LREAD) == FAIL;
+        unlockAll(inodeWaitList, &len);
+        path_release(&parsed);
+    }
+    report("lookup", depth, fanout, i, start);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        path_parse(&parsed, path, path_len);
+        failed += lookup_optimistic(&parsed, inodeWaitList, &len) == FAIL;
+        unlockAll(inodeWaitList, &len);
+        path_release(&parsed);
+    }
+    report("lookup_optimistic", depth, fanout, i, start);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        path_parse(&parsed, path, path_len);
+        path_release(&parsed);
+    }
+    report("path_parse", depth, fanout, i, start);
+
+    /* a file moved back and forth in the deepest directory */
+    sprintf(from, "%s/a", path);
+    sprintf(to, "%s/b", path);
+    mustCreate(from, T_FILE);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        char *source = i & 1 ? to : from, *target = i & 1 ? from : to;
+        path_parse(&parsed, source, strlen(source));
+        path_parse(&parsed2, target, strlen(target));
+        fs_mutation_begin(1);
+        failed += move(&parsed, &parsed2, inodeWaitList, &len) != SUCCESS;
+        fs_mutation_end();
+        unlockAll(inodeWaitList, &len);
+        path_release(&parsed);
+        path_release(&parsed2);
+    }
+    report("move_same_parent", depth, fanout, i, start);
+
+    /* and between the deepest directory and the root of the tree */
+    sprintf(to, "/t%dx%d/b", depth, fanout);
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        char *source = i & 1 ? to : from, *target = i & 1 ? from : to;
+        path_parse(&parsed, source, strlen(source));
+        path_parse(&parsed2, target, strlen(target));
+        fs_mutation_begin(1);
+        failed += move(&parsed, &parsed2, inodeWaitList, &len) != SUCCESS;
+        fs_mutation_end();
+        unlockAll(inodeWaitList, &len);
+        path_release(&parsed);
+        path_release(&parsed2);
+    }
+    report("move_across_parents", depth, fanout, i, start);
+
+    if (failed)
+        fprintf(stderr, "Warning: %d operations failed on tree %dx%d\n", failed, depth, fanout);
+}
+
+int main(int argc, char* argv[]) {
+    parseArgs(argc, argv);
+    if (DELAY != 0)
+        fprintf(stderr, "Warning: built with DELAY %d, build with make DELAY=0 to time real costs\n", DELAY);
+
+    init_fs();
+    printf("benchmark,depth,fanout,iterations,ns_per_op\n");
+    benchInodes(T_FILE, "inode_create_file", "inode_delete_file");
+    benchInodes(T_DIRECTORY, "inode_create_directory", "inode_delete_directory");
+    for (int fanout = 1; fanout <= maxFanout; fanout *= BENCH_STEP)
+        benchDirectory(fanout);
+    for (int depth = 1; depth <= maxDepth; depth *= BENCH_STEP) {
+        for (int fanout = 1; fanout <= maxFanout; fanout *= BENCH_STEP)
+            benchTree(depth, fanout);
+    }
+    destroy_fs();
+    exit(EXIT_SUCCESS);
+}
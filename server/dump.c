@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "fs/operations.h"
+#include "server.h"
+
+/*
+ * Dump being read by a client. The snapshot it walks stays taken between
+ * chunks, so only one dump is open at a time and printFS fails while it
+ * is; if the client stops asking for chunks, the snapshot lease runs out
+ * and the next dump or printFS takes its place.
+ */
+typedef struct dump_session {
+    int open;
+    uint32_t id;
+    uint32_t seq; /* next chunk expected */
+    SnapshotCursor cursor;
+    /* node read from the cursor that did not fit in the last chunk */
+    int pending;
+    type pending_type;
+    int pending_depth;
+    const char *pending_name;
+} dump_session;
+
+static dump_session session;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Dumps opened, numbering them so a stale session id never matches */
+static uint32_t sessions_opened = 0;
+
+/*
+ * Frees the session, with session_lock held.
+ * Input:
+ *  - s: the session
+ *  - end: if set, also releases its snapshot
+ */
+static void dumpClose(dump_session *s, int end) {
+    if (end)
+        inode_snapshot_end(s->cursor.id);
+    inode_snapshot_cursor_release(&s->cursor);
+    s->open = 0;
+}
+
+/*
+ * Fills a reply payload with the next nodes of a dump, with its snapshot
+ * in use.
+ * Input:
+ *  - s: the session
+ *  - buf: payload buffer
+ *  - size: size of the buffer
+ *  - last: pointer to store if the dump is over
+ * Returns: bytes written, or FAIL if out of memory
+ */
+static int dumpFill(dump_session *s, char *buf, int size, int *last) {
+    tfs_dump_chunk chunk;
+    int length = sizeof(chunk), n, res;
+
+    chunk.session = s->id;
+    chunk.seq = s->seq;
+    chunk.count = 0;
+    chunk.pad = 0;
+    *last = 0;
+    while (chunk.count < UINT16_MAX) {
+        if (!s->pending) {
+            res = inode_snapshot_next(&s->cursor, &s->pending_type, &s->pending_depth, &s->pending_name);
+            if (res == FAIL)
+                return FAIL;
+            if (res == 0) {
+                *last = 1;
+                break;
+            }
+            s->pending = 1;
+        }
+        n = tfs_encode_dump_record(buf + length, size - length, s->pending_type == T_DIRECTORY ? 'd' : 'f',
+                                   s->pending_depth, s->pending_name);
+        if (n < 0)
+            break;
+        length += n;
+        chunk.count++;
+        s->pending = 0;
+    }
+    chunk.last = *last;
+    memcpy(buf, &chunk, sizeof(chunk));
+    return length;
+}
+
+/*
+ * Opens a dump of the tree and fills its first chunk.
+ * Input:
+ *  - buf: payload buffer
+ *  - size: size of the buffer
+ *  - length: pointer to store the bytes written
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */
+static int dumpOpen(char *buf, int size, int *length) {
+    dump_session *s = &session;
+    unsigned long snapshot;
+    int last;
+
+    pthread_mutex_lock(&session_lock);
+    /* a session whose lease ran out no longer holds the snapshot */
+    if (s->open && !inode_snapshot_taken(s->cursor.id))
+        dumpClose(s, 0);
+    if (s->open || (snapshot = snapshot_fs(0)) == 0) {
+        pthread_mutex_unlock(&session_lock);
+        return TECNICOFS_ERROR_BUSY;
+    }
+    s->id = ++sessions_opened;
+    s->open = 1;
+    s->seq = 0;
+    s->pending = 0;
+    inode_snapshot_cursor_init(&s->cursor, snapshot);
+    if ((*length = dumpFill(s, buf, size, &last)) == FAIL) {
+        dumpClose(s, 1);
+        pthread_mutex_unlock(&session_lock);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    s->seq++;
+    if (last)
+        dumpClose(s, 1);
+    else
+        inode_snapshot_unuse(snapshot);
+    pthread_mutex_unlock(&session_lock);
+    return SUCCESS;
+}
+
+/*
+ * Fills the next chunk of a dump, or closes it.
+ * Input:
+ *  - cursor: the chunk asked for
+ *  - close: if set, closes the dump instead
+ *  - buf: payload buffer
+ *  - size: size of the buffer
+ *  - length: pointer to store the bytes written
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */
+static int dumpNext(tfs_dump_cursor *cursor, int close, char *buf, int size, int *length) {
+    dump_session *s = &session;
+    int last, res = SUCCESS;
+
+    *length = 0;
+    pthread_mutex_lock(&session_lock);
+    if (!s->open || s->id != cursor->session || s->seq != cursor->seq) {
+        pthread_mutex_unlock(&session_lock);
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    }
+    if (inode_snapshot_use(s->cursor.id) == FAIL) {
+        /* the lease ran out, another snapshot may have been taken */
+        dumpClose(s, 0);
+        res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    } else if (close) {
+        dumpClose(s, 1);
+    } else if ((*length = dumpFill(s, buf, size, &last)) == FAIL) {
+        *length = 0;
+        dumpClose(s, 1);
+        res = TECNICOFS_ERROR_OTHER;
+    } else {
+        s->seq++;
+        if (last)
+            dumpClose(s, 1);
+        else
+            inode_snapshot_unuse(s->cursor.id);
+    }
+    pthread_mutex_unlock(&session_lock);
+    return res;
+}
+
+/*
+ * Executes a TFS_OP_DUMP request.
+ * Input:
+ *  - request: the request
+ *  - response: buffer for the reply
+ * Returns: length of the reply
+ */
+int applyDump(tfs_request *request, char *response) {
+    int hlen = sizeof(tfs_reply_header), n = 0, res;
+    tfs_dump_cursor cursor;
+
+    if (request->header.path_len == 0) {
+        res = dumpOpen(response + hlen, TFS_MAX_MESSAGE - hlen, &n);
+    } else if (request->header.path_len == sizeof(cursor)) {
+        memcpy(&cursor, request->path, sizeof(cursor));
+        res = dumpNext(&cursor, request->header.flags & TFS_DUMP_CLOSE,
+                       response + hlen, TFS_MAX_MESSAGE - hlen, &n);
+    } else {
+        res = TECNICOFS_ERROR_OTHER;
+    }
+    if (res != SUCCESS)
+        n = 0;
+    return tfs_encode_reply(response, &request->header, res, 0, n) + n;
+}
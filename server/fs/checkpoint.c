@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "operations.h"
+
+/* Image the i-node table was loaded from, never unmapped */
+static char *image_base = NULL;
+static size_t image_size = 0;
+
+/*
+ * Mutations in progress are counted in mutations_active, so checkpoint_cut
+ * can wait for them; new ones wait while cut_pending is set. This is not
+ * an epoch: a mutation may block (on rename_lock) while a snapshot
+ * is being taken, which waits for the epoch readers.
+ */
+static int cut_pending = 0;
+static int mutations_active = 0;
+static pthread_mutex_t cut_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cut_done = PTHREAD_COND_INITIALIZER;
+/* Signaled when the last mutation ends while cut_pending is set */
+static pthread_cond_t cut_idle = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Directory of the tree being written whose entries are still being added.
+ */
+typedef struct open_dir {
+	Directory *dir;
+	int inumber;
+} OpenDir;
+
+/*
+ * Node of the tree being written, until its i-node is.
+ */
+typedef struct writer_node {
+	uint64_t dir; /* offset of its flattened directory, 0 for files */
+	int parent; /* i-number in the image of its parent, FREE_INODE for the root */
+	unsigned int name_hash;
+} WriterNode;
+
+/*
+ * Checkpoint image being written. Nodes are numbered in the order the
+ * snapshot is walked, so the image holds no free i-node below inode_used.
+ */
+typedef struct image_writer {
+	FILE *fp;
+	uint64_t offset; /* bytes written */
+	WriterNode *nodes; /* every i-node numbered */
+	int count, capacity; /* i-nodes numbered and allocated in nodes */
+	OpenDir *open; /* directories entered, the innermost last */
+	int depth, open_capacity;
+} ImageWriter;
+
+
+/*
+ * Maps a checkpoint image and uses its i-node table. Nothing is read but
+ * the header: the pages of the tree are loaded when first used, and the
+ * file is mapped privately so changes never reach it.
+ * Input:
+ *  - path: the image
+ *  - lsn: pointer to store the log offset of the first mutation not in it
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_load(const char *path, unsigned long *lsn) {
+	checkpoint_header header;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("checkpoint: open");
+		return FAIL;
+	}
+	if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.inode_size != sizeof(inode_t) || header.entry_size != sizeof(DirEntry) ||
+	    header.segment_size != INODE_SEGMENT_SIZE || header.size != (uint64_t) st.st_size ||
+	    header.inode_count == 0 || header.inode_count % INODE_SEGMENT_SIZE != 0 ||
+	    header.inode_count > (uint64_t) MAX_INODE_SEGMENTS * INODE_SEGMENT_SIZE ||
+	    header.inode_used == 0 || header.inode_used > header.inode_count ||
+	    header.inode_offset % CHECKPOINT_ALIGN != 0 ||
+	    header.inode_offset + header.inode_count * sizeof(inode_t) > header.size) {
+		fprintf(stderr, "checkpoint: %s is not an image of this build\n", path);
+		close(fd);
+		return FAIL;
+	}
+	base = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("checkpoint: mmap");
+		return FAIL;
+	}
+	image_base = base;
+	image_size = header.size;
+	inode_table_adopt((inode_t *) (image_base + header.inode_offset),
+	                  header.inode_count, header.inode_used);
+	*lsn = header.lsn;
+	return SUCCESS;
+}
+
+/*
+ * Checks if memory belongs to the loaded image, and must not be freed.
+ * Input:
+ *  - ptr: the memory
+ * Returns: 1 if it does, else 0
+ */
+int checkpoint_contains(const void *ptr) {
+	return image_base != NULL && (const char *) ptr >= image_base &&
+	       (const char *) ptr < image_base + image_size;
+}
+
+/*
+ * Starts a mutation (create, delete or move, with its log record), waiting
+ * while a checkpoint_cut is in progress.
+ */
+void checkpoint_mutation_begin() {
+	__atomic_add_fetch(&mutations_active, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&cut_pending, __ATOMIC_SEQ_CST)) {
+		checkpoint_mutation_end();
+		pthread_mutex_lock(&cut_lock);
+		while (cut_pending)
+			pthread_cond_wait(&cut_done, &cut_lock);
+		pthread_mutex_unlock(&cut_lock);
+		__atomic_add_fetch(&mutations_active, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Ends a mutation started by checkpoint_mutation_begin.
+ */
+void checkpoint_mutation_end() {
+	/* either this sees cut_pending, or checkpoint_cut sees no mutation */
+	if (__atomic_sub_fetch(&mutations_active, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&cut_pending, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&cut_lock);
+		pthread_cond_broadcast(&cut_idle);
+		pthread_mutex_unlock(&cut_lock);
+	}
+}
+
+/*
+ * Takes a snapshot between mutations, with none in progress, and reads
+ * the log position at that point: the mutations logged before it are in
+ * the snapshot, the ones logged after are not. The snapshot is reserved
+ * first, so mutations are only held back for the cut itself.
+ * Input:
+ *  - position: returns the log position, or NULL without a log
+ *  - lsn: pointer to store the position (0 without a log)
+ * Returns: id of the snapshot, or 0 if a dump holds it
+ */
+unsigned long checkpoint_cut(unsigned long (*position)(), unsigned long *lsn) {
+	unsigned long snapshot;
+
+	if (inode_snapshot_reserve(1) == FAIL)
+		return 0;
+	pthread_mutex_lock(&cut_lock);
+	__atomic_store_n(&cut_pending, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&mutations_active, __ATOMIC_SEQ_CST) != 0)
+		pthread_cond_wait(&cut_idle, &cut_lock);
+	pthread_mutex_unlock(&cut_lock);
+
+	/* no mutation is in progress, so rename_lock is not needed */
+	snapshot = inode_snapshot_begin();
+	*lsn = position != NULL ? position() : 0;
+
+	pthread_mutex_lock(&cut_lock);
+	__atomic_store_n(&cut_pending, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&cut_done);
+	pthread_mutex_unlock(&cut_lock);
+	return snapshot;
+}
+
+/*
+ * Appends bytes to an image.
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_put(ImageWriter *w, const void *data, size_t len) {
+	if (len > 0 && fwrite(data, len, 1, w->fp) != 1)
+		return FAIL;
+	w->offset += len;
+	return SUCCESS;
+}
+
+/*
+ * Appends zeros to an image up to a multiple of CHECKPOINT_ALIGN.
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_align(ImageWriter *w) {
+	static const char zeros[CHECKPOINT_ALIGN];
+	return writer_put(w, zeros, (CHECKPOINT_ALIGN - w->offset % CHECKPOINT_ALIGN) % CHECKPOINT_ALIGN);
+}
+
+/*
+ * Writes the innermost open directory, now that it has all its entries.
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_close_dir(ImageWriter *w) {
+	OpenDir *open = &w->open[--w->depth];
+	size_t len = directory_flat_size(open->dir);
+	void *flat = malloc(len);
+	int res = FAIL;
+
+	if (flat != NULL) {
+		directory_flatten(open->dir, flat);
+		w->nodes[open->inumber].dir = w->offset;
+		res = writer_put(w, flat, len);
+		free(flat);
+	}
+	directory_destroy(open->dir);
+	return res;
+}
+
+/*
+ * Numbers the next node of the walk and adds it to its parent.
+ * Input:
+ *  - w: the image
+ *  - nType: type of the node
+ *  - depth: its depth, 0 for the root
+ *  - name: its name
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_add(ImageWriter *w, type nType, int depth, const char *name) {
+	int inumber = w->count;
+
+	/* the subtrees walked before it are complete */
+	while (w->depth > depth) {
+		if (writer_close_dir(w) == FAIL)
+			return FAIL;
+	}
+	if (w->count == w->capacity) {
+		int capacity = w->capacity > 0 ? w->capacity * 2 : INODE_SEGMENT_SIZE;
+		WriterNode *nodes = realloc(w->nodes, sizeof(WriterNode) * capacity);
+		if (nodes == NULL)
+			return FAIL;
+		w->nodes = nodes;
+		w->capacity = capacity;
+	}
+	w->nodes[inumber].dir = 0;
+	w->nodes[inumber].parent = FREE_INODE;
+	w->count++;
+	if (depth > 0) {
+		DirName entry;
+		dir_name(&entry, name);
+		if (directory_insert(w->open[depth - 1].dir, &entry, inumber) == FAIL)
+			return FAIL;
+		w->nodes[inumber].parent = w->open[depth - 1].inumber;
+		w->nodes[inumber].name_hash = entry.hash;
+	}
+	if (nType != T_DIRECTORY)
+		return SUCCESS;
+	if (w->depth == w->open_capacity) {
+		int capacity = w->open_capacity > 0 ? w->open_capacity * 2 : 16;
+		OpenDir *open = realloc(w->open, sizeof(OpenDir) * capacity);
+		if (open == NULL)
+			return FAIL;
+		w->open = open;
+		w->open_capacity = capacity;
+	}
+	if ((w->open[w->depth].dir = directory_create()) == NULL)
+		return FAIL;
+	w->open[w->depth].inumber = inumber;
+	w->depth++;
+	return SUCCESS;
+}
+
+/*
+ * Writes the i-node table of an image, segment by segment.
+ * Input:
+ *  - w: the image, with every directory written
+ *  - header: header to fill with the table's position and size
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_inodes(ImageWriter *w, checkpoint_header *header) {
+	int count = (w->count + INODE_SEGMENT_MASK) & ~INODE_SEGMENT_MASK;
+	int res = SUCCESS;
+	inode_t *slots;
+
+	if (posix_memalign((void **) &slots, __alignof__(inode_t), sizeof(inode_t) * INODE_SEGMENT_SIZE) != 0)
+		return FAIL;
+	if (writer_align(w) == FAIL) {
+		free(slots);
+		return FAIL;
+	}
+	header->inode_offset = w->offset;
+	header->inode_count = count;
+	header->inode_used = w->count;
+	for (int first = 0; first < count && res == SUCCESS; first += INODE_SEGMENT_SIZE) {
+		memset(slots, 0, sizeof(inode_t) * INODE_SEGMENT_SIZE);
+		for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+			int inumber = first + i;
+			inode_t *inode = &slots[i];
+
+			inode->lock = (pthread_rwlock_t) PTHREAD_RWLOCK_INITIALIZER;
+			inode->snap_type = T_NONE;
+			inode->snap_next = FREE_INODE;
+			inode->parent = FREE_INODE;
+			if (inumber >= w->count) {
+				inode->nodeType = T_NONE;
+				inode->nextFree = inumber + 1 < count ? inumber + 1 : FREE_INODE;
+				continue;
+			}
+			inode->parent = w->nodes[inumber].parent;
+			inode->name_hash = w->nodes[inumber].name_hash;
+			inode->nextFree = FREE_INODE;
+			if (w->nodes[inumber].dir != 0) {
+				/* where the field will be, relative to where its directory will be */
+				uint64_t field = header->inode_offset + sizeof(inode_t) * inumber + offsetof(inode_t, data);
+				inode->nodeType = T_DIRECTORY;
+				inode->data = (relptr) (w->nodes[inumber].dir - field);
+			} else {
+				inode->nodeType = T_FILE;
+			}
+		}
+		res = writer_put(w, slots, sizeof(inode_t) * INODE_SEGMENT_SIZE);
+	}
+	free(slots);
+	return res;
+}
+
+/*
+ * Walks a snapshot into a new image.
+ * Input:
+ *  - w: the image, positioned after its header
+ *  - snapshot: id of the snapshot, in use by the caller
+ *  - header: header to fill
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_tree(ImageWriter *w, unsigned long snapshot, checkpoint_header *header) {
+	SnapshotCursor cursor;
+	const char *name;
+	type nType;
+	int depth, res;
+
+	inode_snapshot_cursor_init(&cursor, snapshot);
+	while ((res = inode_snapshot_next(&cursor, &nType, &depth, &name)) == 1) {
+		if (writer_add(w, nType, depth, name) == FAIL) {
+			res = FAIL;
+			break;
+		}
+	}
+	inode_snapshot_cursor_release(&cursor);
+	while (res == 0 && w->depth > 0) {
+		if (writer_close_dir(w) == FAIL)
+			res = FAIL;
+	}
+	if (res == FAIL || writer_inodes(w, header) == FAIL)
+		return FAIL;
+	return SUCCESS;
+}
+
+/*
+ * Writes a snapshot of the tree as a checkpoint image, replacing the one
+ * at path only once the new one is complete and on disk. Ends the snapshot.
+ * Input:
+ *  - path: the image
+ *  - snapshot: id of the snapshot, from checkpoint_cut
+ *  - lsn: log position of the snapshot, from checkpoint_cut
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_write(const char *path, unsigned long snapshot, unsigned long lsn) {
+	ImageWriter w;
+	checkpoint_header header;
+	char tmp[PATH_MAX], dir[PATH_MAX];
+	int res = FAIL, fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp) ||
+	    (w.fp = fopen(tmp, "w")) == NULL) {
+		inode_snapshot_end(snapshot);
+		return FAIL;
+	}
+	w.offset = 0;
+	w.nodes = NULL;
+	w.count = w.capacity = 0;
+	w.open = NULL;
+	w.depth = w.open_capacity = 0;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.inode_size = sizeof(inode_t);
+	header.entry_size = sizeof(DirEntry);
+	header.segment_size = INODE_SEGMENT_SIZE;
+	header.lsn = lsn;
+
+	/* the header is written last, over this page */
+	if (writer_align(&w) == SUCCESS && writer_put(&w, &header, sizeof(header)) == SUCCESS &&
+	    writer_align(&w) == SUCCESS && writer_tree(&w, snapshot, &header) == SUCCESS) {
+		header.size = w.offset;
+		if (fseek(w.fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, w.fp) == 1 &&
+		    fflush(w.fp) == 0 && fsync(fileno(w.fp)) == 0)
+			res = SUCCESS;
+	}
+	while (w.depth > 0) {
+		w.depth--;
+		directory_destroy(w.open[w.depth].dir);
+	}
+	free(w.open);
+	free(w.nodes);
+	if (fclose(w.fp) != 0)
+		res = FAIL;
+	/* an i-node that could not be saved makes the walk inconsistent */
+	if (inode_snapshot_end(snapshot) == FAIL)
+		res = FAIL;
+	if (res == SUCCESS && rename(tmp, path) < 0)
+		res = FAIL;
+	if (res == FAIL) {
+		unlink(tmp);
+		return FAIL;
+	}
+	/* the rename itself must reach the disk */
+	strcpy(dir, path);
+	if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,41 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC "TFSCKPT2"
+/* Alignment of the directories and of the i-node table in an image */
+#define CHECKPOINT_ALIGN 4096
+/* Seconds between checkpoints, by default */
+#define CHECKPOINT_INTERVAL 60
+/* Seconds before a checkpoint skipped because a dump held the snapshot is retried */
+#define CHECKPOINT_RETRY 1
+
+/*
+ * Start of a checkpoint image. It is followed, from CHECKPOINT_ALIGN, by
+ * the flattened directories and then by the i-node table, laid out as it
+ * is used in memory. Every pointer in them is self-relative (relptr), so
+ * the file is mapped at any address and used as is, without parsing.
+ */
+typedef struct checkpoint_header {
+	char magic[8]; /* CHECKPOINT_MAGIC */
+	/* layout of the build that wrote it, which must match to load it */
+	uint32_t inode_size;
+	uint32_t entry_size;
+	uint32_t segment_size;
+	uint32_t pad;
+	uint64_t lsn; /* log offset of the first mutation not in the image */
+	uint64_t inode_offset;
+	uint64_t inode_count; /* a multiple of INODE_SEGMENT_SIZE */
+	uint64_t inode_used; /* i-nodes of the tree, the first ones; the rest are free */
+	uint64_t size; /* of the file */
+} checkpoint_header;
+
+int checkpoint_load(const char *path, unsigned long *lsn);
+int checkpoint_contains(const void *ptr);
+void checkpoint_mutation_begin();
+void checkpoint_mutation_end();
+unsigned long checkpoint_cut(unsigned long (*position)(), unsigned long *lsn);
+int checkpoint_write(const char *path, unsigned long snapshot, unsigned long lsn);
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <pthread.h>
+#include "state.h"
+#include "pool.h"
+#include "dcache.h"
+
+/*
+ * Set-associative path cache. Each bucket is protected by its own mutex,
+ * so threads resolving different paths rarely contend.
+ */
+typedef struct dcache_bucket {
+	pthread_mutex_t lock;
+	int next_victim;
+	DCacheEntry ways[DCACHE_WAYS];
+} DCacheBucket;
+
+static DCacheBucket dcache[DCACHE_BUCKETS];
+
+/* Incremented by every move before and after it changes the tree, so it
+ * is odd while a move is in progress. Starts above 0, the sequence of the
+ * i-nodes never moved, so they are older than every cached entry. */
+static unsigned long rename_seq = 2;
+
+/*
+ * Initializes the cache with every entry empty.
+ */
+void dcache_init() {
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        pthread_mutex_init(&dcache[i].lock, NULL);
+        dcache[i].next_victim = 0;
+        for (int w = 0; w < DCACHE_WAYS; w++) {
+            dcache[i].ways[w].len = FAIL;
+            dcache[i].ways[w].path = NULL;
+        }
+    }
+}
+
+/*
+ * Releases the keys and the bucket locks.
+ */
+void dcache_destroy() {
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        for (int w = 0; w < DCACHE_WAYS; w++) {
+            pool_free(dcache[i].ways[w].path);
+            dcache[i].ways[w].path = NULL;
+        }
+        pthread_mutex_destroy(&dcache[i].lock);
+    }
+}
+
+/*
+ * Finds the way of a bucket holding a key.
+ * Returns: index of the way, or FAIL
+ */
+static int find_way(DCacheBucket *bucket, const char *key, int len, unsigned int hash) {
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        DCacheEntry *e = &bucket->ways[w];
+        if (e->len == len && e->hash == hash && memcmp(e->path, key, len) == 0)
+            return w;
+    }
+    return FAIL;
+}
+
+/*
+ * Copies the cached entry of a key, if any. The caller must still
+ * validate it against the i-node it refers to.
+ * Input:
+ *  - key, len, hash: key of a path and its hash (see Path)
+ *  - entry: where to copy the entry
+ * Returns: 1 if found, else 0
+ */
+int dcache_get(const char *key, int len, unsigned int hash, DCacheEntry *entry) {
+    DCacheBucket *bucket = &dcache[hash & (DCACHE_BUCKETS - 1)];
+    int w, found = 0;
+
+    pthread_mutex_lock(&bucket->lock);
+    if ((w = find_way(bucket, key, len, hash)) != FAIL) {
+        *entry = bucket->ways[w];
+        /* may be freed as soon as the bucket is unlocked */
+        entry->path = NULL;
+        found = 1;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return found;
+}
+
+/*
+ * Inserts or replaces the entry of a key. Keys of any length are cached,
+ * in a copy allocated when the entry is inserted.
+ * Input:
+ *  - key, len, hash: key of a path and its hash (see Path)
+ *  - entry: the entry, its hash, len and path are ignored
+ */
+void dcache_put(const char *key, int len, unsigned int hash, DCacheEntry *entry) {
+    DCacheBucket *bucket = &dcache[hash & (DCACHE_BUCKETS - 1)];
+    char *path;
+    int w;
+
+    pthread_mutex_lock(&bucket->lock);
+    if ((w = find_way(bucket, key, len, hash)) != FAIL) {
+        path = bucket->ways[w].path;
+    } else {
+        w = bucket->next_victim;
+        bucket->next_victim = (w + 1) % DCACHE_WAYS;
+        /* the victim keeps its key if there is no memory for a new one */
+        if ((path = pool_alloc(len)) == NULL) {
+            pthread_mutex_unlock(&bucket->lock);
+            return;
+        }
+        memcpy(path, key, len);
+        pool_free(bucket->ways[w].path);
+    }
+    bucket->ways[w] = *entry;
+    bucket->ways[w].hash = hash;
+    bucket->ways[w].len = len;
+    bucket->ways[w].path = path;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Drops the entry of a key, if any.
+ * Input:
+ *  - key, len, hash: key of a path and its hash (see Path)
+ */
+void dcache_invalidate(const char *key, int len, unsigned int hash) {
+    DCacheBucket *bucket = &dcache[hash & (DCACHE_BUCKETS - 1)];
+    int w;
+
+    pthread_mutex_lock(&bucket->lock);
+    if ((w = find_way(bucket, key, len, hash)) != FAIL) {
+        bucket->ways[w].len = FAIL;
+        pool_free(bucket->ways[w].path);
+        bucket->ways[w].path = NULL;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Returns: the current rename sequence number
+ */
+unsigned long dcache_rename_seq() {
+    return __atomic_load_n(&rename_seq, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Starts a move. Must be called by it after it has locked the nodes it
+ * changes and before it changes them, and the moved i-node must then be
+ * stamped with the new sequence (see inode_set_moved), which invalidates
+ * the cached paths through it.
+ */
+void dcache_rename_begin() {
+    __atomic_add_fetch(&rename_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Ends a move started with dcache_rename_begin, once the tree is changed.
+ */
+void dcache_rename_end() {
+    __atomic_add_fetch(&rename_seq, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,41 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <pthread.h>
+
+/* Number of buckets of the cache, must be a power of 2 */
+#define DCACHE_BUCKETS 4096
+/* Entries per bucket, the oldest is evicted first */
+#define DCACHE_WAYS 4
+
+/*
+ * Cached result of resolving a path.
+ * A positive entry maps the path to the i-node "inumber".
+ * A negative entry records that the path did not exist below the i-node
+ * "inumber" (the deepest existing ancestor), whose directory had "version".
+ * Either is only valid while the i-node keeps "generation" and none of
+ * the "depth" i-nodes from it up to the root was moved since "rename_seq"
+ * (see inode_get_moved).
+ */
+typedef struct dcache_entry {
+	unsigned int hash;
+	int len;
+	char *path; /* key, owned by the cache; NULL in the copies it hands out */
+	int negative;
+	int inumber;
+	int depth;
+	unsigned int generation;
+	unsigned int version;
+	unsigned long rename_seq;
+} DCacheEntry;
+
+void dcache_init();
+void dcache_destroy();
+int dcache_get(const char *key, int len, unsigned int hash, DCacheEntry *entry);
+void dcache_put(const char *key, int len, unsigned int hash, DCacheEntry *entry);
+void dcache_invalidate(const char *key, int len, unsigned int hash);
+unsigned long dcache_rename_seq();
+void dcache_rename_begin();
+void dcache_rename_end();
+
+#endif /* DCACHE_H */
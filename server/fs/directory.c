@@ -0,0 +1,441 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include "state.h"
+#include "directory.h"
+#include "epoch.h"
+#include "checkpoint.h"
+#include "pool.h"
+
+/*
+ * A slot array carries its own size, so a reader without locks never
+ * pairs the entries of one array with the capacity of another. The names
+ * of its entries follow the slots, appended to an arena of names_size
+ * bytes; the names of removed entries are only dropped when the entries
+ * move to a new array (see directory_resize).
+ */
+typedef struct dirTable {
+    int capacity;
+    unsigned int names_size; /* bytes of the arena */
+    unsigned int names_used; /* bytes of the arena handed out */
+    unsigned int names_live; /* bytes of names of entries still present */
+    DirEntry entries[];
+} DirTable;
+
+#define TABLE_OF(slots) ((DirTable *) ((char *) (slots) - offsetof(DirTable, entries)))
+/* Offset of the arena from the first slot */
+#define NAMES_OFFSET(capacity) (sizeof(DirEntry) * (capacity))
+/* Size of a flattened directory, 8-byte aligned so they can be packed */
+#define FLAT_SIZE(capacity, names) \
+    ((sizeof(Directory) + sizeof(DirTable) + NAMES_OFFSET(capacity) + (names) + 7) & ~(size_t) 7)
+
+/*
+ * Frees a directory or slot array, unless it lives in the checkpoint
+ * image it was loaded from.
+ */
+static void dir_free(void *ptr) {
+    if (!checkpoint_contains(ptr))
+        pool_free(ptr);
+}
+
+/*
+ * Hashes an entry name (FNV-1a).
+ * Input:
+ *  - name: name of the entry
+ * Returns: hash of the name
+ */
+unsigned int dir_hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Fills the name of an entry from a string.
+ * Input:
+ *  - name: the name to fill
+ *  - text: the name, '\0' terminated
+ */
+void dir_name(DirName *name, const char *text) {
+    name->name = text;
+    name->len = strlen(text);
+    name->hash = dir_hash_name(text);
+}
+
+/*
+ * Allocates an empty slot array.
+ * Input:
+ *  - capacity: number of slots
+ *  - names_size: bytes of its arena of names, at least
+ * Returns: the slot array, or NULL if out of memory
+ */
+static DirEntry *entries_alloc(int capacity, size_t names_size) {
+    size_t size = pool_usable_size(sizeof(DirTable) + NAMES_OFFSET(capacity) + names_size);
+    DirTable *table = pool_alloc(size);
+    if (table == NULL)
+        return NULL;
+    table->capacity = capacity;
+    /* the room the pool block has to spare goes to the arena */
+    table->names_size = size - sizeof(DirTable) - NAMES_OFFSET(capacity);
+    table->names_used = 0;
+    table->names_live = 0;
+    for (int i = 0; i < capacity; i++)
+        table->entries[i].inumber = FREE_INODE;
+    return table->entries;
+}
+
+/*
+ * Stores the name of a slot in the arena of its array, which must have
+ * room for it.
+ * Input:
+ *  - entries: the slot array
+ *  - i: the slot
+ *  - name: the name, of len bytes
+ *  - len: length of the name
+ */
+static void name_store(DirEntry *entries, int i, const char *name, unsigned int len) {
+    DirTable *table = TABLE_OF(entries);
+    char *stored = (char *) entries + NAMES_OFFSET(table->capacity) + table->names_used;
+
+    entries[i].name = stored - (char *) entries;
+    entries[i].name_len = len;
+    memcpy(stored, name, len);
+    stored[len] = '\0';
+    table->names_used += len + 1;
+    table->names_live += len + 1;
+}
+
+/*
+ * Creates an empty directory.
+ * Returns: the directory, or NULL if out of memory
+ */
+Directory *directory_create() {
+    Directory *dir = pool_alloc(sizeof(Directory));
+    DirEntry *entries;
+    if (dir == NULL)
+        return NULL;
+    if ((entries = entries_alloc(DIR_INITIAL_CAPACITY, DIR_INITIAL_CAPACITY * DIR_NAME_BYTES)) == NULL) {
+        pool_free(dir);
+        return NULL;
+    }
+    relptr_store(&dir->entries, entries, __ATOMIC_RELAXED);
+    dir->capacity = DIR_INITIAL_CAPACITY;
+    dir->count = 0;
+    dir->version = 0;
+    return dir;
+}
+
+/*
+ * Releases a directory and its entries.
+ * Input:
+ *  - dir: the directory
+ */
+void directory_destroy(Directory *dir) {
+    if (dir == NULL)
+        return;
+    dir_free(TABLE_OF(DIR_ENTRIES(dir)));
+    dir_free(dir);
+}
+
+/*
+ * Copies a directory. May be called without its lock inside an epoch read
+ * section, in which case the copy must be validated like any lock-free read.
+ * Input:
+ *  - dir: the directory
+ * Returns: the copy, or NULL if out of memory
+ */
+Directory *directory_copy(Directory *dir) {
+    DirEntry *entries = relptr_load(&dir->entries, __ATOMIC_ACQUIRE);
+    DirTable *table = TABLE_OF(entries);
+    int capacity = table->capacity;
+    Directory *copy = pool_alloc(sizeof(Directory));
+    DirEntry *copied;
+
+    if (copy == NULL)
+        return NULL;
+    if ((copied = entries_alloc(capacity, table->names_size)) == NULL) {
+        pool_free(copy);
+        return NULL;
+    }
+    /* the whole arena, as names_used may be changing */
+    memcpy(copied, entries, NAMES_OFFSET(capacity) + table->names_size);
+    TABLE_OF(copied)->names_used = table->names_used;
+    TABLE_OF(copied)->names_live = table->names_live;
+    relptr_store(&copy->entries, copied, __ATOMIC_RELAXED);
+    copy->capacity = capacity;
+    copy->count = dir->count;
+    copy->version = dir->version;
+    return copy;
+}
+
+/*
+ * Releases a directory and its entries once no lock-free reader can be
+ * walking them.
+ * Input:
+ *  - dir: the directory, already unreachable for new readers
+ */
+void directory_retire(Directory *dir) {
+    if (dir == NULL)
+        return;
+    epoch_retire(TABLE_OF(DIR_ENTRIES(dir)), dir_free);
+    epoch_retire(dir, dir_free);
+}
+
+/*
+ * Returns: bytes taken by the names of the entries of a directory
+ */
+static size_t names_of(Directory *dir) {
+    DirEntry *entries = DIR_ENTRIES(dir);
+    size_t names = 0;
+
+    for (int i = 0; i < dir->capacity; i++) {
+        if (entries[i].inumber != FREE_INODE)
+            names += entries[i].name_len + 1;
+    }
+    return names;
+}
+
+/*
+ * Returns: bytes directory_flatten needs for a directory
+ */
+size_t directory_flat_size(Directory *dir) {
+    return FLAT_SIZE(dir->capacity, names_of(dir));
+}
+
+/*
+ * Copies a directory and its entries into one block, which stays valid
+ * wherever it is later mapped, e.g. in a checkpoint image.
+ * Input:
+ *  - dir: the directory
+ *  - dest: directory_flat_size(dir) bytes, 8-byte aligned
+ */
+void directory_flatten(Directory *dir, void *dest) {
+    DirEntry *entries = DIR_ENTRIES(dir);
+    size_t names = names_of(dir);
+    Directory *flat = dest;
+    DirTable *table = (DirTable *) (flat + 1);
+
+    memset(dest, 0, FLAT_SIZE(dir->capacity, names));
+    table->capacity = dir->capacity;
+    /* only the names of the entries, the first insert will move them */
+    table->names_size = names;
+    for (int i = 0; i < dir->capacity; i++) {
+        if (entries[i].inumber != FREE_INODE) {
+            table->entries[i] = entries[i];
+            name_store(table->entries, i, DIR_ENTRY_NAME(entries, i), entries[i].name_len);
+        } else {
+            table->entries[i].inumber = FREE_INODE;
+        }
+    }
+    relptr_store(&flat->entries, table->entries, __ATOMIC_RELAXED);
+    flat->capacity = dir->capacity;
+    flat->count = dir->count;
+    flat->version = 0;
+}
+
+/*
+ * Finds the slot of an entry, or the free slot where it would be inserted.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ * Returns: index of the slot
+ */
+static int find_slot(Directory *dir, const DirName *name) {
+    DirEntry *entries = DIR_ENTRIES(dir);
+    int mask = dir->capacity - 1;
+    int i = name->hash & mask;
+    while (entries[i].inumber != FREE_INODE) {
+        if (entries[i].hash == name->hash && entries[i].name_len == name->len &&
+            memcmp(DIR_ENTRY_NAME(entries, i), name->name, name->len) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+ * Moves every entry to a new slot array, packing their names. The arena
+ * is left at least half free, so names are moved O(1) times per insert.
+ * Input:
+ *  - dir: the directory
+ *  - capacity: new number of slots, a power of 2 larger than count
+ *  - extra: bytes of names about to be added
+ * Returns: SUCCESS or FAIL
+ */
+static int directory_resize(Directory *dir, int capacity, size_t extra) {
+    DirEntry *old = DIR_ENTRIES(dir);
+    int old_capacity = dir->capacity;
+    size_t names = 2 * (TABLE_OF(old)->names_live + extra);
+    DirEntry *entries;
+
+    if (names < (size_t) capacity * DIR_NAME_BYTES)
+        names = (size_t) capacity * DIR_NAME_BYTES;
+    if (names > UINT_MAX - NAMES_OFFSET(capacity) || (entries = entries_alloc(capacity, names)) == NULL)
+        return FAIL;
+    relptr_store(&dir->entries, entries, __ATOMIC_RELEASE);
+    dir->capacity = capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].inumber != FREE_INODE) {
+            DirName name = {DIR_ENTRY_NAME(old, i), old[i].name_len, old[i].hash};
+            int j = find_slot(dir, &name);
+            entries[j] = old[i];
+            name_store(entries, j, name.name, name.len);
+        }
+    }
+    /* lock-free readers may still be probing the old array */
+    epoch_retire(TABLE_OF(old), dir_free);
+    return SUCCESS;
+}
+
+/*
+ * Looks for an entry by name.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ * Returns:
+ *  - inumber: i-number of the entry
+ *  - FAIL: if not found
+ */
+int directory_lookup(Directory *dir, const DirName *name) {
+    int i = find_slot(dir, name);
+    DirEntry *entries = DIR_ENTRIES(dir);
+    if (entries[i].inumber == FREE_INODE)
+        return FAIL;
+    return entries[i].inumber;
+}
+
+/*
+ * Looks for an entry by name without holding the lock of the directory,
+ * inside an epoch read section. Entries may change meanwhile, so the
+ * result must be validated by the caller (see inode_read_retry); the
+ * probe is bounded so a torn read cannot make it loop forever.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ * Returns:
+ *  - inumber: i-number of the entry
+ *  - FAIL: if not found
+ */
+int directory_lookup_optimistic(Directory *dir, const DirName *name) {
+    DirEntry *entries = relptr_load(&dir->entries, __ATOMIC_ACQUIRE);
+    DirTable *table = TABLE_OF(entries);
+    int mask = table->capacity - 1;
+    size_t len = name->len, end = NAMES_OFFSET(table->capacity) + table->names_size;
+
+    for (int n = 0, i = name->hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        int inumber = __atomic_load_n(&entries[i].inumber, __ATOMIC_RELAXED);
+        size_t offset = entries[i].name;
+        if (inumber == FREE_INODE)
+            return FAIL;
+        /* a torn slot may point anywhere, names are only read inside the array */
+        if (entries[i].hash == name->hash && entries[i].name_len == len && offset + len <= end &&
+            memcmp((char *) entries + offset, name->name, len) == 0)
+            return inumber;
+    }
+    return FAIL;
+}
+
+/*
+ * Finds the name of an entry from its i-number and the hash of its name,
+ * like directory_lookup_optimistic, whose rules it follows.
+ * Input:
+ *  - dir: the directory
+ *  - hash: dir_hash_name of the name
+ *  - inumber: i-number of the entry
+ *  - name: pointer to store where the name is, not '\0' terminated
+ * Returns:
+ *  - len: length of the name
+ *  - FAIL: if not found
+ */
+int directory_name_optimistic(Directory *dir, unsigned int hash, int inumber, const char **name) {
+    DirEntry *entries = relptr_load(&dir->entries, __ATOMIC_ACQUIRE);
+    DirTable *table = TABLE_OF(entries);
+    int mask = table->capacity - 1;
+    size_t end = NAMES_OFFSET(table->capacity) + table->names_size;
+
+    for (int n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        int found = __atomic_load_n(&entries[i].inumber, __ATOMIC_RELAXED);
+        size_t offset = entries[i].name, len = entries[i].name_len;
+        if (found == FREE_INODE)
+            return FAIL;
+        if (found == inumber && entries[i].hash == hash && len > 0 && offset + len <= end) {
+            *name = (char *) entries + offset;
+            return len;
+        }
+    }
+    return FAIL;
+}
+
+/*
+ * Adds an entry, growing the table when it becomes 3/4 full.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ *  - inumber: i-number of the entry
+ * Returns: SUCCESS or FAIL (name already present or out of memory)
+ */
+int directory_insert(Directory *dir, const DirName *name, int inumber) {
+    size_t len = name->len;
+    DirTable *table = TABLE_OF(DIR_ENTRIES(dir));
+    DirEntry *entries;
+    int i;
+
+    if ((dir->count + 1) * 4 > dir->capacity * 3) {
+        if (directory_resize(dir, dir->capacity * 2, len + 1) == FAIL)
+            return FAIL;
+    } else if (table->names_used + len + 1 > table->names_size) {
+        if (directory_resize(dir, dir->capacity, len + 1) == FAIL)
+            return FAIL;
+    }
+
+    i = find_slot(dir, name);
+    entries = DIR_ENTRIES(dir);
+    if (entries[i].inumber != FREE_INODE)
+        return FAIL;
+    name_store(entries, i, name->name, len);
+    entries[i].hash = name->hash;
+    entries[i].inumber = inumber;
+    dir->count++;
+    dir->version++;
+    return SUCCESS;
+}
+
+/*
+ * Removes an entry, shifting back the entries of its probe sequence so
+ * lookups never need tombstones. Shrinks the table when it becomes 1/8 full.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ *  - inumber: expected i-number of the entry
+ * Returns: SUCCESS or FAIL
+ */
+int directory_remove(Directory *dir, const DirName *name, int inumber) {
+    DirEntry *entries = DIR_ENTRIES(dir);
+    int mask = dir->capacity - 1;
+    int i = find_slot(dir, name);
+
+    if (entries[i].inumber == FREE_INODE || entries[i].inumber != inumber)
+        return FAIL;
+    /* the name stays in the arena until the entries move */
+    TABLE_OF(entries)->names_live -= entries[i].name_len + 1;
+
+    for (int j = (i + 1) & mask; entries[j].inumber != FREE_INODE; j = (j + 1) & mask) {
+        int home = entries[j].hash & mask;
+        /* entry j may fill the hole at i if i lies between its home and j */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            entries[i] = entries[j];
+            i = j;
+        }
+    }
+    entries[i].inumber = FREE_INODE;
+    dir->count--;
+    dir->version++;
+
+    if (dir->capacity > DIR_INITIAL_CAPACITY && dir->count * 8 < dir->capacity)
+        directory_resize(dir, dir->capacity / 2, 0);
+    return SUCCESS;
+}
@@ -0,0 +1,99 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../tecnicofs-api-constants.h"
+
+/* Initial number of slots of a directory, must be a power of 2 */
+#define DIR_INITIAL_CAPACITY 8
+/*
+ * Bytes of names a slot array reserves for each of its slots. With the
+ * pool block header, an empty directory's array is then 256 bytes, a
+ * size class of its own (see pool.h).
+ */
+#define DIR_NAME_BYTES 12
+
+/*
+ * Pointer stored as the distance from the field holding it to its target,
+ * 0 for NULL. Structures linked only through them stay valid wherever
+ * they are mapped, see checkpoint.c.
+ */
+typedef intptr_t relptr;
+
+/*
+ * Reads a self-relative pointer.
+ * Input:
+ *  - field: the pointer
+ *  - order: memory order of the load (__ATOMIC_*)
+ * Returns: the target
+ */
+static inline void *relptr_load(relptr *field, int order) {
+	relptr offset = __atomic_load_n(field, order);
+	return offset == 0 ? NULL : (char *) field + offset;
+}
+
+/*
+ * Writes a self-relative pointer.
+ * Input:
+ *  - field: the pointer
+ *  - target: where it points to, or NULL
+ *  - order: memory order of the store (__ATOMIC_*)
+ */
+static inline void relptr_store(relptr *field, const void *target, int order) {
+	__atomic_store_n(field, target == NULL ? 0 : (const char *) target - (char *) field, order);
+}
+
+/*
+ * Contains the hash of the name of the entry, where the name is and the
+ * respective i-number. Names of any length are kept, '\0' terminated,
+ * in an arena that follows the slots of the same array.
+ */
+typedef struct dirEntry {
+	unsigned int hash;
+	int inumber;
+	unsigned int name; /* offset of the name from the first slot, see DIR_ENTRY_NAME */
+	unsigned int name_len; /* without the '\0' */
+} DirEntry;
+
+/*
+ * Name of an entry, with its length and dir_hash_name, so they are
+ * computed once per request (see path_parse). The name need not be
+ * '\0' terminated.
+ */
+typedef struct dirName {
+	const char *name;
+	unsigned int len;
+	unsigned int hash;
+} DirName;
+
+/*
+ * Open-addressing hash table of directory entries (linear probing).
+ * Free slots have inumber == FREE_INODE.
+ */
+typedef struct directory {
+	relptr entries; /* DirEntry[capacity], see DIR_ENTRIES */
+	int capacity; /* number of slots, always a power of 2 */
+	int count; /* number of used slots */
+	unsigned int version; /* incremented on every insert and remove */
+} Directory;
+
+#define DIR_ENTRIES(dir) ((DirEntry *) relptr_load(&(dir)->entries, __ATOMIC_RELAXED))
+/* Name of slot i of a slot array */
+#define DIR_ENTRY_NAME(entries, i) ((const char *) (entries) + (entries)[i].name)
+
+unsigned int dir_hash_name(const char *name);
+void dir_name(DirName *name, const char *text);
+Directory *directory_create();
+Directory *directory_copy(Directory *dir);
+void directory_destroy(Directory *dir);
+void directory_retire(Directory *dir);
+size_t directory_flat_size(Directory *dir);
+void directory_flatten(Directory *dir, void *dest);
+int directory_lookup(Directory *dir, const DirName *name);
+int directory_lookup_optimistic(Directory *dir, const DirName *name);
+int directory_name_optimistic(Directory *dir, unsigned int hash, int inumber, const char **name);
+int directory_insert(Directory *dir, const DirName *name, int inumber);
+int directory_remove(Directory *dir, const DirName *name, int inumber);
+
+#endif /* DIRECTORY_H */
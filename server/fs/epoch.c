@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "epoch.h"
+
+/*
+ * Object waiting for the readers that may still see it.
+ */
+typedef struct retired {
+	void *ptr;
+	void (*release)(void *);
+	unsigned long epoch; /* global epoch when it was retired */
+} Retired;
+
+/*
+ * One per thread, never freed. "state" is (epoch << 1) | 1 while the
+ * thread is inside a read section, else 0.
+ */
+typedef struct epoch_record {
+	unsigned long state;
+	int nesting;
+	Retired *retired;
+	int count, capacity;
+	struct epoch_record *next;
+} EpochRecord;
+
+static unsigned long global_epoch = 0;
+static EpochRecord *records = NULL;
+static __thread EpochRecord *self = NULL;
+
+/*
+ * Returns: the record of the calling thread, registering it on first use
+ */
+static EpochRecord *epoch_self() {
+	EpochRecord *rec;
+
+	if (self != NULL)
+		return self;
+	if ((rec = calloc(1, sizeof(EpochRecord))) == NULL) {
+		fprintf(stderr, "epoch: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	rec->next = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return self = rec;
+}
+
+/*
+ * Starts a read section. Sections may nest.
+ */
+void epoch_enter() {
+	EpochRecord *rec = epoch_self();
+
+	if (rec->nesting++ == 0) {
+		unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+		/* published before any pointer of the section is read */
+		__atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Ends a read section.
+ */
+void epoch_exit() {
+	EpochRecord *rec = self;
+
+	if (--rec->nesting == 0)
+		__atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves the global epoch forward if every thread inside a read section
+ * has already seen the current one.
+ * Returns: the global epoch after the attempt
+ */
+static unsigned long epoch_try_advance() {
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+	for (EpochRecord *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+		unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+		if ((state & 1) && (state >> 1) != epoch)
+			return epoch;
+	}
+	if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+	                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return epoch + 1;
+	return epoch;
+}
+
+/*
+ * Releases the objects of a record retired two epochs ago or earlier:
+ * no reader can have started before they were unlinked and still run.
+ */
+static void epoch_reclaim(EpochRecord *rec, unsigned long epoch) {
+	int kept = 0;
+
+	for (int i = 0; i < rec->count; i++) {
+		if (rec->retired[i].epoch + 2 <= epoch)
+			rec->retired[i].release(rec->retired[i].ptr);
+		else
+			rec->retired[kept++] = rec->retired[i];
+	}
+	rec->count = kept;
+}
+
+/*
+ * Releases an object once no read section can still reach it. The
+ * object must already be unreachable for new readers.
+ * Input:
+ *  - ptr: the object
+ *  - release: function that frees it, e.g. free
+ */
+void epoch_retire(void *ptr, void (*release)(void *)) {
+	EpochRecord *rec = epoch_self();
+
+	if (rec->count == rec->capacity) {
+		int capacity = rec->capacity > 0 ? rec->capacity * 2 : EPOCH_RETIRE_BATCH;
+		Retired *retired = realloc(rec->retired, sizeof(Retired) * capacity);
+		if (retired == NULL) {
+			/* better to wait for the readers than to leak, unless one of
+			 * them is this thread */
+			if (rec->nesting == 0) {
+				epoch_synchronize();
+				release(ptr);
+			}
+			return;
+		}
+		rec->retired = retired;
+		rec->capacity = capacity;
+	}
+	rec->retired[rec->count].ptr = ptr;
+	rec->retired[rec->count].release = release;
+	rec->retired[rec->count].epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	rec->count++;
+	if (rec->count >= EPOCH_RETIRE_BATCH)
+		epoch_reclaim(rec, epoch_try_advance());
+}
+
+/*
+ * Waits until every read section active when called has ended.
+ * Must not be called inside a read section.
+ */
+void epoch_synchronize() {
+	unsigned long target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+
+	while (epoch_try_advance() < target)
+		sched_yield();
+}
@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation. Readers that follow pointers without locks
+ * run between epoch_enter and epoch_exit; memory they may still reach is
+ * given to epoch_retire instead of free, and is released once every
+ * reader active at that time has left.
+ */
+
+/* Retired objects a thread keeps before it tries to release them */
+#define EPOCH_RETIRE_BATCH 64
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*release)(void *));
+void epoch_synchronize();
+
+#endif /* EPOCH_H */
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "state.h"
+#include "log.h"
+
+/*
+ * Lines of one thread, written by it and read by the flusher. Lines
+ * [tail, head) are waiting, each slot holds a line with its newline.
+ * One per thread, never freed.
+ */
+typedef struct log_ring {
+	char lines[LOG_RING_LINES][LOG_LINE_SIZE];
+	unsigned long head; /* written by the owner */
+	unsigned long tail; /* written by the flusher */
+	unsigned long dropped; /* lines that found the ring full */
+	struct log_ring *next;
+} LogRing;
+
+log_level log_threshold = LOG_TRACE;
+
+static LogRing *rings = NULL;
+static __thread LogRing *self = NULL;
+/* set while the flusher runs, lines are printed right away otherwise */
+static int log_async = 0;
+static int log_stopping = 0;
+/* held while draining, by the flusher or log_flush */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_stopped = PTHREAD_COND_INITIALIZER;
+static pthread_t log_tid;
+
+static const char *log_level_names[] = {"none", "error", "failure", "trace"};
+
+
+/*
+ * Returns: the ring of the calling thread, registering it on first use,
+ *  or NULL if out of memory
+ */
+static LogRing *log_self() {
+	LogRing *ring;
+
+	if (self != NULL)
+		return self;
+	if ((ring = calloc(1, sizeof(LogRing))) == NULL)
+		return NULL;
+	ring->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return self = ring;
+}
+
+/*
+ * Logs a line, use log_printf to check its level first. A full ring
+ * drops the line instead of waiting for the flusher.
+ * Input:
+ *  - format, ...: as printf, with the trailing newline
+ */
+void log_write(const char *format, ...) {
+	unsigned long head;
+	LogRing *ring;
+	va_list ap;
+	char *line;
+
+	va_start(ap, format);
+	if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) || (ring = log_self()) == NULL) {
+		vprintf(format, ap);
+		va_end(ap);
+		return;
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_LINES) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
+	}
+	line = ring->lines[head % LOG_RING_LINES];
+	if (vsnprintf(line, LOG_LINE_SIZE, format, ap) >= LOG_LINE_SIZE)
+		strcpy(line + LOG_LINE_SIZE - 5, "...\n");
+	va_end(ap);
+	/* the line is complete before the flusher can see it */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes the lines of every ring to stdout. Called with log_lock held.
+ */
+static void log_drain() {
+	for (LogRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), dropped;
+
+		for (unsigned long tail = ring->tail; tail != head; tail++)
+			fputs(ring->lines[tail % LOG_RING_LINES], stdout);
+		/* the slots can be reused once written */
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+		if ((dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED)) > 0)
+			printf("[LOG] %lu lines dropped\n", dropped);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Writes every buffered line now.
+ */
+void log_flush() {
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Drains the rings every LOG_FLUSH_INTERVAL_MS until log_stop.
+ */
+static void *log_flush_thread() {
+	struct timespec deadline;
+
+	pthread_mutex_lock(&log_lock);
+	while (!log_stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (!log_stopping && pthread_cond_timedwait(&log_stopped, &log_lock, &deadline) != ETIMEDOUT);
+		log_drain();
+	}
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+/*
+ * Parses the name of a level: none, error, failure or trace.
+ * Input:
+ *  - name: the name
+ *  - level: pointer to store the level
+ * Returns: SUCCESS or FAIL
+ */
+int log_parse_level(const char *name, log_level *level) {
+	for (int i = LOG_NONE; i <= LOG_TRACE; i++) {
+		if (strcmp(name, log_level_names[i]) == 0) {
+			*level = i;
+			return SUCCESS;
+		}
+	}
+	return FAIL;
+}
+
+/*
+ * Starts the flusher thread, lines are buffered from now on.
+ * Returns: SUCCESS or FAIL
+ */
+int log_start() {
+	if (log_threshold == LOG_NONE)
+		return SUCCESS;
+	fflush(stdout);
+	if (pthread_create(&log_tid, NULL, log_flush_thread, NULL) != 0)
+		return FAIL;
+	__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	return SUCCESS;
+}
+
+/*
+ * Stops the flusher thread after it writes the buffered lines. Lines
+ * logged after this are printed right away.
+ */
+void log_stop() {
+	if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&log_lock);
+	log_stopping = 1;
+	pthread_cond_signal(&log_stopped);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(log_tid, NULL);
+	/* lines a thread was writing when log_async was cleared */
+	log_flush();
+}
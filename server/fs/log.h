@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Log of the server. Once log_start is called, every thread formats its
+ * lines into a ring buffer of its own, without locks, and a flusher
+ * thread writes them to stdout every LOG_FLUSH_INTERVAL_MS. Before that,
+ * and in programs that never call it, lines are printed right away.
+ */
+
+/* Lines a thread can buffer between flushes; more are dropped and counted */
+#define LOG_RING_LINES 512
+/* Longest line, longer ones are truncated */
+#define LOG_LINE_SIZE 512
+#define LOG_FLUSH_INTERVAL_MS 10
+
+/*
+ * Most verbose level printed:
+ *  - LOG_NONE: nothing
+ *  - LOG_ERROR: errors of the server itself, like a failed lock
+ *  - LOG_FAILURE: requests that failed, like creating an existing file
+ *  - LOG_TRACE: every request executed
+ */
+typedef enum log_level {LOG_NONE, LOG_ERROR, LOG_FAILURE, LOG_TRACE} log_level;
+
+extern log_level log_threshold;
+
+/* lines above the threshold cost a comparison, their arguments are not evaluated */
+#define log_printf(level, ...) \
+	do { \
+		if ((level) <= log_threshold) \
+			log_write(__VA_ARGS__); \
+	} while (0)
+
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+int log_parse_level(const char *name, log_level *level);
+int log_start();
+void log_flush();
+void log_stop();
+
+#endif /* LOG_H */
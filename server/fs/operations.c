@@ -1,9 +1,23 @@
+#define _GNU_SOURCE /* PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP */
 #include "operations.h"
+#include "dcache.h"
+#include "epoch.h"
+#include "checkpoint.h"
+#include "log.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 
+/*
+ * Held shared by creates and deletes and exclusive by moves, from the
+ * walk of their paths until they are logged (see fs_mutation_begin), and
+ * exclusive by the snapshots that must not see a move half done. While it
+ * is held, which directory is an ancestor of which cannot change. Writers
+ * are preferred, or a steady stream of creates would starve the moves.
+ */
+static pthread_rwlock_t rename_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
 /*
  * Add an i-number to an array representing the i-nodes to be unlocked after 
  * the execution of a command.
@@ -30,65 +44,61 @@ void unlockLast(int inodeWaitList[], int *len) {
 }
 
 /*
- * Depending on "try", either locks or trylocks.
+ * Locks an i-node and adds it to the array of locked i-nodes.
  * Input:
  *  - inumber: identifier of the i-node
  *  - inodeWaitList: array of i-numbers
  *  - len: array length
  *  - lock_mode: determines if it is a write or a read lock
- *  - try: determines if this function trylocks or locks
  */
-void lock_or_trylock(int inumber, int inodeWaitList[], int *len, lock_mode mode, int try) {
-    if (try) {
-        if (trylock(inumber, mode)) addLockedInode(inumber, inodeWaitList, len);
-    }
-    else {
-        if (lock(inumber, mode)) addLockedInode(inumber, inodeWaitList, len);
-    }
+void lock_and_add(int inumber, int inodeWaitList[], int *len, lock_mode mode) {
+    if (lock(inumber, mode)) addLockedInode(inumber, inodeWaitList, len);
 }
 
-/* Given a path, fills pointers with strings for the parent path and child
- * file name
+/*
+ * Unlocks the i-node before the last one in an array, once the last one
+ * (its child) is locked, and removes it from the array.
  * Input:
- *  - path: the path to split. ATENTION: the function may alter this parameter
- *  - parent: reference to a char*, to store parent path
- *  - child: reference to a char*, to store child file name
+ *  - inodeWaitList: array of i-numbers
+ *  - len: array length
  */
-void split_parent_child_from_path(char * path, char ** parent, char ** child) {
-
-	int n_slashes = 0, last_slash_location = 0;
-	int len = strlen(path);
-
-	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
-		path[len-1] = '\0';
-	}
-
-	for (int i=0; i < len; ++i) {
-		if (path[i] == '/' && path[i+1] != '\0') {
-			last_slash_location = i;
-			n_slashes++;
-		}
-	}
-
-	if (n_slashes == 0) { // root directory
-		*parent = "";
-		*child = path;
-		return;
-	}
-
-	path[last_slash_location] = '\0';
-	*parent = path;
-	*child = path + last_slash_location + 1;
+static void unlock_parent(int inodeWaitList[], int *len) {
+    unlock(inodeWaitList[*len - 2]);
+    inodeWaitList[*len - 2] = inodeWaitList[*len - 1];
+    inodeWaitList[*len - 1] = 0;
+    *len = *len - 1;
+}
 
+/*
+ * Starts a create or delete (shared) or a move (exclusive): the paths it
+ * walks keep leading to the same nodes until fs_mutation_end. Ending it
+ * only after the mutation is logged keeps the log in an order that
+ * resolves every path of a replay to the node it resolved to here: a
+ * create below a directory cannot be logged after a move of one of its
+ * ancestors it was applied before.
+ * Input:
+ *  - exclusive: set for a move
+ */
+void fs_mutation_begin(int exclusive) {
+    if (exclusive)
+        pthread_rwlock_wrlock(&rename_lock);
+    else
+        pthread_rwlock_rdlock(&rename_lock);
 }
 
+/*
+ * Ends a mutation started with fs_mutation_begin.
+ */
+void fs_mutation_end() {
+    pthread_rwlock_unlock(&rename_lock);
+}
 
 /*
  * Initializes tecnicofs and creates root node.
  */
 void init_fs() {
 	inode_table_init();
+	dcache_init();
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
 	if (root != FS_ROOT) {
@@ -98,29 +108,40 @@ void init_fs() {
 }
 
 
+/*
+ * Initializes tecnicofs from a checkpoint image instead of an empty root.
+ * Input:
+ *  - path: the image
+ *  - lsn: pointer to store the log offset of the first mutation not in it
+ * Returns: SUCCESS or FAIL
+ */
+int load_fs(const char *path, unsigned long *lsn) {
+	if (checkpoint_load(path, lsn) == FAIL)
+		return FAIL;
+	dcache_init();
+	return SUCCESS;
+}
+
+
 /*
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
 	inode_table_destroy();
+	dcache_destroy();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - directory: entries of directory
  * Returns: SUCCESS or FAIL
  */
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *directory) {
+	if (directory == NULL || directory->count != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL; 
-		}
-	}
 	return SUCCESS;
 }
 
@@ -128,83 +149,81 @@ int is_dir_empty(DirEntry *dirEntries) {
 /*
  * Looks for node in directory entry from name.
  * Input:
- *  - name: path of node
- *  - entries: entries of directory
+ *  - name: name of node
+ *  - directory: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(const DirName *name, Directory *directory) {
 
-	if (entries == NULL) {
+	if (directory == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+	return directory_lookup(directory, name);
 }
 
 
 /*
- * Creates a new node given a path.
+ * Creates a new node given a path, between fs_mutation_begin and
+ * fs_mutation_end.
  * Input:
- *  - name: path of node
+ *  - path: path of node
  *  - nodeType: type of node
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
  */
-int create(char *name, type nodeType, int inodeWaitList[], int *len){
+int create(Path *path, type nodeType, int inodeWaitList[], int *len){
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, parent_len;
+	const DirName *child_name;
 	/* use for copy */
 	type pType;
 	union Data pdata;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	if (path->count == 0) {
+		log_printf(LOG_FAILURE, "failed to create the root dir\n");
+		return TECNICOFS_ERROR_OTHER;
+	}
+	child_name = PATH_LAST(path);
+	parent_len = PATH_KEY_LEN(path, path->count - 1);
 
-	parent_inumber = lookup(parent_name, inodeWaitList, len, 0);
+	parent_inumber = lookup(path, path->count - 1, inodeWaitList, len, LWRITE);
 
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
-		        name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to create %s, invalid parent dir %.*s\n",
+		        path->key, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
 	}
 
 	inode_get(parent_inumber, &pType, &pdata);
 
-    unlockLast(inodeWaitList, len);
-    lock(parent_inumber, LWRITE);
-    addLockedInode(parent_inumber, inodeWaitList, len);
-
 	if (pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to create %s, parent %.*s is not a dir\n",
+		        path->key, parent_len, path->key);
+		return TECNICOFS_ERROR_NOT_A_DIRECTORY;
 	}
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
-		       child_name, parent_name);
-		return FAIL;
+	if (lookup_sub_node(child_name, pdata.directory) != FAIL) {
+		log_printf(LOG_FAILURE, "failed to create %s, already exists in dir %.*s\n",
+		       child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
 	}
 
 	/* create node and add entry to folder that contains new node */
 	child_inumber = inode_create(nodeType);
-    lock(child_inumber, LWRITE);
-    addLockedInode(child_inumber, inodeWaitList, len);
 
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
-		        child_name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to create %s in  %.*s, couldn't allocate inode\n",
+		        child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_OTHER;
 	}
+    lock(child_inumber, LWRITE);
+    addLockedInode(child_inumber, inodeWaitList, len);
+
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       child_name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "could not add entry %s in dir %.*s\n",
+		       child_name->name, parent_len, path->key);
+		inode_delete(child_inumber);
+		return TECNICOFS_ERROR_OTHER;
 	}
 
 	return SUCCESS;
@@ -212,90 +231,159 @@ int create(char *name, type nodeType, int inodeWaitList[], int *len){
 
 
 /*
- * Deletes a node given a path.
+ * Deletes a node given a path, between fs_mutation_begin and
+ * fs_mutation_end.
  * Input:
- *  - name: path of node
- * Returns: SUCCESS or FAIL
+ *  - path: path of node
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
  */
-int delete(char *name, int inodeWaitList[], int *len){
+int delete(Path *path, int inodeWaitList[], int *len){
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, parent_len;
+	const DirName *child_name;
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	if (path->count == 0) {
+		log_printf(LOG_FAILURE, "could not delete the root dir\n");
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
+	child_name = PATH_LAST(path);
+	parent_len = PATH_KEY_LEN(path, path->count - 1);
 
-	parent_inumber = lookup(parent_name, inodeWaitList, len, 0);
+	parent_inumber = lookup(path, path->count - 1, inodeWaitList, len, LWRITE);
 
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
-		        child_name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to delete %s, invalid parent dir %.*s\n",
+		        child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
 	}
 
 	inode_get(parent_inumber, &pType, &pdata);
 
-    unlockLast(inodeWaitList, len);
-    lock(parent_inumber, LWRITE);
-    addLockedInode(parent_inumber, inodeWaitList, len);
-
 	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to delete %s, parent %.*s is not a dir\n",
+		        child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_NOT_A_DIRECTORY;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, pdata.directory);
 
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
-		       name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "could not delete %s, does not exist in dir %.*s\n",
+		       path->key, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
 	}
+	/* no one may add entries to the child while it is being deleted */
+	lock(child_inumber, LWRITE);
+	addLockedInode(child_inumber, inodeWaitList, len);
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n",
-		       name);
-		return FAIL;
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.directory) == FAIL) {
+		log_printf(LOG_FAILURE, "could not delete %s: is a directory and not empty\n",
+		       path->key);
+		return TECNICOFS_ERROR_DIR_NOT_EMPTY;
 	}
 
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
-		       child_name, parent_name);
-		return FAIL;
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		log_printf(LOG_FAILURE, "failed to delete %s from dir %.*s\n",
+		       child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_OTHER;
 	}
 	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n",
-		       child_inumber, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "could not delete inode number %d from dir %.*s\n",
+		       child_inumber, parent_len, path->key);
+		return TECNICOFS_ERROR_OTHER;
     }
+	dcache_invalidate(path->key, path->len, path->key_hash[path->count]);
 
 	return SUCCESS;
 }
 
 
 /*
- * Lookup for a given path.
+ * Checks that no i-node from a cached one up to the root was moved since
+ * it was cached, so the path still leads to it.
+ * Input:
+ *  - inumber: the cached i-node
+ *  - depth: its depth when cached
+ *  - rename_seq: rename sequence when cached
+ * Returns: 1 if none was, else 0
+ */
+static int path_unmoved(int inumber, int depth, unsigned long rename_seq) {
+	for (; depth > 0; depth--) {
+		/* a parent set by a move is read with the move's stamp */
+		int parent = inode_get_parent(inumber, NULL);
+		if (parent == FREE_INODE || inode_get_moved(inumber) >= rename_seq)
+			return 0;
+		inumber = parent;
+	}
+	return inumber == FS_ROOT;
+}
+
+/*
+ * Locks the node of a cached path and checks that the entry still holds.
+ * Input:
+ *  - entry: the cached entry
+ *  - mode: lock mode for the node found
+ *  - result: pointer to store the i-number found, or FAIL for a negative entry
+ * Returns: 1 if the entry is valid, else 0 (and nothing is left locked)
+ */
+static int lookup_cached(DCacheEntry *entry, int inodeWaitList[], int *len, lock_mode mode, int *result) {
+	type nType;
+	union Data data;
+
+	lock_and_add(entry->inumber, inodeWaitList, len, entry->negative ? LREAD : mode);
+	if (inode_get_generation(entry->inumber) == entry->generation &&
+	    path_unmoved(entry->inumber, entry->depth, entry->rename_seq) &&
+	    inode_get(entry->inumber, &nType, &data) == SUCCESS) {
+		if (!entry->negative) {
+			*result = entry->inumber;
+			return 1;
+		}
+		/* the path is still missing while its last ancestor is unchanged */
+		if (nType != T_DIRECTORY || data.directory->version == entry->version) {
+			*result = FAIL;
+			return 1;
+		}
+	}
+	unlockLast(inodeWaitList, len);
+	return 0;
+}
+
+/*
+ * Lookup for a given path, with lock coupling: every node along the path
+ * is read-locked before its parent is unlocked, so only the node found
+ * (locked with the given mode) is left locked. Paths resolved recently
+ * are served from the dentry cache, locking only the node found.
  * Input:
- *  - name: path of node
+ *  - path: path of node
+ *  - depth: number of leading components of the path to resolve
+ *  - mode: lock mode for the node found
  * Returns:
  *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *     FAIL: otherwise (the deepest node found is left read-locked)
  */
-int lookup(char *name, int inodeWaitList[], int *len, int try) {
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-
-	strcpy(full_path, name);
+int lookup(Path *path, int depth, int inodeWaitList[], int *len, lock_mode mode) {
+	int key_len = PATH_KEY_LEN(path, depth);
+	DCacheEntry entry;
+	int i = 0;
+
+	if (key_len > 0) {
+		int cached;
+		if (dcache_get(path->key, key_len, path->key_hash[depth], &entry) &&
+		    lookup_cached(&entry, inodeWaitList, len, mode, &cached))
+			return cached;
+	}
+	/* moves during the walk leave the entry stale from the start, and a
+	 * walk during one may see it half done */
+	entry.rename_seq = dcache_rename_seq();
 
 	/* start at root node */
-    lock_or_trylock(FS_ROOT, inodeWaitList, len, LREAD, try);
-	int current_inumber = FS_ROOT;
+	lock_and_add(FS_ROOT, inodeWaitList, len, depth == 0 ? mode : LREAD);
+	int current_inumber = FS_ROOT, next_inumber;
 
 	/* use for copy */
 	type nType;
@@ -304,143 +392,415 @@ int lookup(char *name, int inodeWaitList[], int *len, int try) {
 	/* get root inode data */
 	inode_get(current_inumber, &nType, &data);
 
-	char *path = strtok(full_path, delim);
-
 	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-        lock_or_trylock(FS_ROOT, inodeWaitList, len, LREAD, try);
+	while (i < depth && (next_inumber = lookup_sub_node(&path->components[i], data.directory)) != FAIL) {
+		i++;
+		/* the entry cannot be removed while its parent is locked */
+		lock_and_add(next_inumber, inodeWaitList, len, i == depth ? mode : LREAD);
+		unlock_parent(inodeWaitList, len);
+		current_inumber = next_inumber;
 		inode_get(current_inumber, &nType, &data);
-		path = strtok(NULL, delim);
 	}
 
-	return current_inumber;
+	if (key_len > 0 && !(entry.rename_seq & 1)) {
+		/* the node where the walk stopped is locked, so it can be cached */
+		entry.negative = i < depth;
+		entry.inumber = current_inumber;
+		entry.depth = i;
+		entry.generation = inode_get_generation(current_inumber);
+		entry.version = nType == T_DIRECTORY ? data.directory->version : 0;
+		dcache_put(path->key, key_len, path->key_hash[depth], &entry);
+	}
+	return i == depth ? current_inumber : FAIL;
+}
+
+/*
+ * Walks a path without taking any lock. Every directory is read between
+ * two samples of its sequence counter, and the child found is sampled
+ * before its parent is validated, so it was still linked when sampled.
+ * Must run inside an epoch read section.
+ * Input:
+ *  - path: path of node
+ *  - result: pointer to store the i-number found, or FAIL
+ * Returns: 1 if the walk saw a consistent tree, else 0
+ */
+static int lookup_walk(Path *path, int *result) {
+	unsigned long rename_seq = dcache_rename_seq();
+	int current_inumber = FS_ROOT, next_inumber, i = 0;
+	unsigned int seq, next_seq = 0;
+	type nType;
+	union Data data;
+
+	/* a move changes two directories, which are validated one at a time */
+	if (rename_seq & 1)
+		return 0;
+
+	seq = inode_read_begin(current_inumber);
+	while (i < path->count) {
+		if (inode_get_optimistic(current_inumber, &nType, &data) == FAIL)
+			return 0;
+		/* the directory may have been deleted, and its slot reused */
+		if (inode_read_retry(current_inumber, seq))
+			return 0;
+		next_inumber = FAIL;
+		if (nType == T_DIRECTORY && data.directory != NULL)
+			next_inumber = directory_lookup_optimistic(data.directory, &path->components[i]);
+		if (next_inumber != FAIL) {
+			if (!inode_is_valid(next_inumber))
+				return 0;
+			next_seq = inode_read_begin(next_inumber);
+		}
+		if (inode_read_retry(current_inumber, seq))
+			return 0;
+		if (next_inumber == FAIL)
+			break;
+		current_inumber = next_inumber;
+		seq = next_seq;
+		i++;
+	}
+
+	if (dcache_rename_seq() != rename_seq)
+		return 0;
+	*result = i == path->count ? current_inumber : FAIL;
+	return 1;
+}
+
+/*
+ * Lookup for a given path that only reads the tree. Walks it without
+ * locks while no writer gets in the way, otherwise falls back to lookup.
+ * Input:
+ *  - path: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise (nodes may be left read-locked by the fallback)
+ */
+int lookup_optimistic(Path *path, int inodeWaitList[], int *len) {
+	int inumber;
+
+	for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+		epoch_enter();
+		int valid = lookup_walk(path, &inumber);
+		epoch_exit();
+		if (valid)
+			return inumber;
+	}
+	return lookup(path, path->count, inodeWaitList, len, LREAD);
 }
 
 /*
- * Move an entry to a new path
+ * Resolves a path without keeping any lock.
+ * Input:
+ *  - path: path of node
+ *  - depth: number of leading components of the path to resolve
+ *  - generation: pointer to store the generation of the node found
+ * Returns: the i-number found, or FAIL
+ */
+static int resolve(Path *path, int depth, unsigned int *generation) {
+	int locked[MAX_LOCKED], len = 0, inumber;
+
+	inumber = lookup(path, depth, locked, &len, LREAD);
+	if (inumber != FAIL)
+		*generation = inode_get_generation(inumber);
+	while (len > 0)
+		unlockLast(locked, &len);
+	return inumber;
+}
+
+/*
+ * Checks if a node is an ancestor of another, walking up from the other
+ * to the root. Must be called with rename_lock held exclusive, so no
+ * parent changes.
+ * Input:
+ *  - ancestor: i-number of the node
+ *  - inumber: i-number of the other node
+ * Returns: 1 if it is, or if both are the same node, else 0
+ */
+static int is_ancestor(int ancestor, int inumber) {
+    while (inumber != FREE_INODE) {
+        if (inumber == ancestor)
+            return 1;
+        inumber = inode_get_parent(inumber, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Move an entry to a new path, with rename_lock held exclusive.
+ * Both parents are resolved first and then write-locked ancestor first,
+ * the order lookups lock in. That order is only right if the parents
+ * resolved are still the nodes at those paths: the generations of both
+ * are checked once the first lock is held, before the second is taken.
+ * Creates and deletes hold rename_lock shared, so neither can be freed
+ * and reused meanwhile, but the check keeps the order from depending on
+ * that.
  * Input:
  *  - path: path of the existing entry
  *  - new_path: path which the moving entry will occupy
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
  */
-int move(char *path, char *new_path, int inodeWaitList[], int *len) {
-    int parent_inumber, child_inumber, new_parent_inumber, counter;
-	char *parent_name, *child_name, path_copy[MAX_FILE_NAME];
-    char *new_parent_name, *new_child_name, new_path_copy[MAX_FILE_NAME], new_path_copy2[MAX_FILE_NAME];
-    char *token;
+static int move_locked(Path *path, Path *new_path, int inodeWaitList[], int *len) {
+    int parent_inumber, child_inumber, new_parent_inumber, first, second;
+    unsigned int parent_generation, new_parent_generation;
+    int parent_depth = path->count - 1, new_parent_depth = new_path->count - 1;
+    int parent_len = PATH_KEY_LEN(path, parent_depth);
+    int new_parent_len = PATH_KEY_LEN(new_path, new_parent_depth);
+    const DirName *child_name = PATH_LAST(path), *new_child_name = PATH_LAST(new_path);
 
     type pType, npType;
 	union Data pdata, npdata;
 
-    strcpy(path_copy, path);
-    strcpy(new_path_copy, new_path);
-    strcpy(new_path_copy2, new_path);
-	split_parent_child_from_path(path_copy, &parent_name, &child_name);
-    split_parent_child_from_path(new_path_copy, &new_parent_name, &new_child_name);
-
-    /* Test for infinite loops */
-    counter = 0;
-    token = strtok(new_path_copy2, "/");
-    while (token != NULL) {
-        if (!strcmp(token, child_name)) counter++;
-        token = strtok(NULL, "/");
-    }
-    if (counter > 1) {
-        printf("failed to move %s, infinite loop detected\n", child_name);
-        return FAIL;
-    }
-
-    parent_inumber = lookup(parent_name, inodeWaitList, len, 0);
-
+    parent_inumber = resolve(path, parent_depth, &parent_generation);
     if (parent_inumber == FAIL) {
-		printf("failed to move %s, invalid parent dir %s\n",
-		        path, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to move %s, invalid parent dir %.*s\n",
+		        path->key, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
+    new_parent_inumber = resolve(new_path, new_parent_depth, &new_parent_generation);
+    if (new_parent_inumber == FAIL) {
+		log_printf(LOG_FAILURE, "failed to move %s, invalid parent dir %.*s\n",
+		        new_path->key, new_parent_len, new_path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
 	}
-    inode_get(parent_inumber, &pType, &pdata);
-
-    unlockLast(inodeWaitList, len);
-    lock(parent_inumber, LWRITE);
-    addLockedInode(parent_inumber, inodeWaitList, len);
 
+    /* with moves serialized, the parents tell which one is the ancestor */
+    if (new_parent_inumber != parent_inumber && is_ancestor(new_parent_inumber, parent_inumber)) {
+        first = new_parent_inumber;
+        second = parent_inumber;
+    } else {
+        first = parent_inumber;
+        second = new_parent_inumber;
+    }
+    lock_and_add(first, inodeWaitList, len, LWRITE);
+    /* deleted (and maybe reused) before the first was locked: the order may be wrong */
+    if (inode_get_generation(parent_inumber) != parent_generation ||
+        inode_get_generation(new_parent_inumber) != new_parent_generation) {
+		log_printf(LOG_FAILURE, "failed to move %s, parent dir was deleted\n", path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    }
+    if (second != first)
+        lock_and_add(second, inodeWaitList, len, LWRITE);
 
+    inode_get(parent_inumber, &pType, &pdata);
     if (pType != T_DIRECTORY) {
-		printf("failed to move %s, parent %s is not a dir\n",
-		        path, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to move %s, parent %.*s is not a dir\n",
+		        path->key, parent_len, path->key);
+		return TECNICOFS_ERROR_NOT_A_DIRECTORY;
+	}
+    inode_get(new_parent_inumber, &npType, &npdata);
+    if (npType != T_DIRECTORY) {
+		log_printf(LOG_FAILURE, "failed to move %s, parent %.*s is not a dir\n",
+		        new_path->key, new_parent_len, new_path->key);
+		return TECNICOFS_ERROR_NOT_A_DIRECTORY;
 	}
 
-    child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+    child_inumber = lookup_sub_node(child_name, pdata.directory);
 	if (child_inumber == FAIL) {
-		printf("failed to move %s, does not exist in dir %s\n",
-		       child_name, parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "failed to move %s, does not exist in dir %.*s\n",
+		       child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
 	}
-
-    lock(child_inumber, LWRITE);
-    addLockedInode(child_inumber, inodeWaitList, len);
-
-    /* lookup operation will trylock to avoid deadlocks */
-    new_parent_inumber = lookup(new_parent_name, inodeWaitList, len, 1);
-
-    if (new_parent_inumber == FAIL) {
-		printf("failed to move %s, invalid parent dir %s\n",
-		        new_path, new_parent_name);
-		return FAIL;
+    /* an entry cannot be moved into itself or below itself */
+    if (is_ancestor(child_inumber, new_parent_inumber)) {
+        log_printf(LOG_FAILURE, "failed to move %s, infinite loop detected\n", child_name->name);
+        return TECNICOFS_ERROR_OTHER;
+    }
+	if (lookup_sub_node(new_child_name, npdata.directory) != FAIL) {
+		log_printf(LOG_FAILURE, "failed to move %s, already exists in dir %.*s\n",
+		       new_child_name->name, new_parent_len, new_path->key);
+		return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
 	}
-    inode_get(new_parent_inumber, &npType, &npdata);
-
-    if (inodeWaitList[*len - 1] == new_parent_inumber) unlockLast(inodeWaitList, len);
-    if (trylock(new_parent_inumber, LWRITE)) addLockedInode(new_parent_inumber, inodeWaitList, len);
 
-    if (npType != T_DIRECTORY) {
-		printf("failed to move %s, parent %s is not a dir\n",
-		        new_path, new_parent_name);
-		return FAIL;
-	}
+    lock_and_add(child_inumber, inodeWaitList, len, LWRITE);
 
-	if (lookup_sub_node(child_name, npdata.dirEntries) != FAIL) {
-		printf("failed to move %s, already exists in dir %s\n",
-		       child_name, new_parent_name);
-		return FAIL;
-	}
+    /* cached paths through the moved node are about to change */
+    dcache_rename_begin();
+    inode_set_moved(child_inumber, dcache_rename_seq());
 
-    if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
-		       child_name, parent_name);
-		return FAIL;
+    if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		log_printf(LOG_FAILURE, "failed to delete %s from dir %.*s\n",
+		       child_name->name, parent_len, path->key);
+		return TECNICOFS_ERROR_OTHER;
 	}
 
     if (dir_add_entry(new_parent_inumber, child_inumber, new_child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       new_child_name, new_parent_name);
-		return FAIL;
+		log_printf(LOG_FAILURE, "could not add entry %s in dir %.*s\n",
+		       new_child_name->name, new_parent_len, new_path->key);
+		/* put the entry back where it was */
+		dir_add_entry(parent_inumber, child_inumber, child_name);
+		return TECNICOFS_ERROR_OTHER;
 	}
     
     return SUCCESS;
 }
 
+/*
+ * Move an entry to a new path, between fs_mutation_begin (exclusive) and
+ * fs_mutation_end.
+ * Input:
+ *  - path: path of the existing entry
+ *  - new_path: path which the moving entry will occupy
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */
+int move(Path *path, Path *new_path, int inodeWaitList[], int *len) {
+    int res;
+
+    /* the root has no parent to move from, nor a name to move to */
+    if (path->count == 0) {
+        log_printf(LOG_FAILURE, "failed to move the root dir\n");
+        return TECNICOFS_ERROR_OTHER;
+    }
+    if (new_path->count == 0) {
+        log_printf(LOG_FAILURE, "failed to move %s, invalid destination\n", path->key);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    res = move_locked(path, new_path, inodeWaitList, len);
+    /* with moves serialized, an odd sequence means this one changed the tree */
+    if (dcache_rename_seq() & 1)
+        dcache_rename_end();
+    return res;
+}
+
+/*
+ * Takes a snapshot of the tree, see inode_snapshot_begin. The slot is
+ * waited for without rename_lock, which only fixes the point of the cut.
+ * Input:
+ *  - wait: if unset, fails instead of waiting for a snapshot in use
+ * Returns: id of the snapshot, or 0
+ */
+unsigned long snapshot_fs(int wait) {
+    unsigned long snapshot;
+
+    if (inode_snapshot_reserve(wait) == FAIL)
+        return 0;
+    pthread_rwlock_wrlock(&rename_lock);
+    snapshot = inode_snapshot_begin();
+    pthread_rwlock_unlock(&rename_lock);
+    return snapshot;
+}
+
 /*
  * Prints tecnicofs tree to a given file.
  * Input:
  *  - path: path to output file
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code (TECNICOFS_ERROR_BUSY while
+ *  a dump holds the snapshot)
  */
 int printFS(char *path) {
     FILE *out_file;
-    /* Write lock na root */
-    lock(0, LWRITE);
+    unsigned long snapshot;
+    int res;
+
+    /* the tree is frozen only for the dump, which then runs without locks */
+    if ((snapshot = snapshot_fs(1)) == 0) {
+        log_printf(LOG_FAILURE, "could not print to %s, a dump holds the snapshot\n", path);
+        return TECNICOFS_ERROR_BUSY;
+    }
     out_file = fopen(path, "w");
     if (out_file == NULL) {
-        printf("could not open file %s\n", path);
-        return FAIL;
+        log_printf(LOG_ERROR, "could not open file %s\n", path);
+        inode_snapshot_end(snapshot);
+        return TECNICOFS_ERROR_OTHER;
     }
-    print_tecnicofs_tree(out_file);
-    unlock(0);
+    res = inode_snapshot_print(out_file, snapshot, FS_ROOT, "");
+    if (inode_snapshot_end(snapshot) == FAIL)
+        res = FAIL;
     fclose(out_file);
+    if (res == FAIL) {
+        log_printf(LOG_ERROR, "could not save the tree for %s\n", path);
+        return TECNICOFS_ERROR_OTHER;
+    }
     return SUCCESS;
 }
 
+/*
+ * Builds the path of an i-node walking up from it to the root, without
+ * taking any lock. Every parent is read between two samples of its
+ * sequence counter, as in lookup_walk, and must still hold the entry of
+ * the node below. Must run inside an epoch read section.
+ * Input:
+ *  - inumber: the i-node
+ *  - path: buffer of MAX_PATH_SIZE bytes to store its path, left empty
+ *    if the i-node is not in the tree
+ * Returns: 1 if the walk saw a consistent tree, else 0
+ */
+static int path_walk(int inumber, char *path) {
+    char buffer[MAX_PATH_SIZE];
+    unsigned long rename_seq = dcache_rename_seq();
+    int start = MAX_PATH_SIZE - 1;
+
+    /* a move unlinks the node before linking it again */
+    if (rename_seq & 1)
+        return 0;
+
+    buffer[start] = '\0';
+    while (inumber != FS_ROOT) {
+        unsigned int name_hash, seq;
+        int parent = inode_get_parent(inumber, &name_hash), len;
+        const char *name;
+        type nType;
+        union Data data;
+
+        if (parent == FREE_INODE)
+            break;
+        seq = inode_read_begin(parent);
+        if (inode_get_optimistic(parent, &nType, &data) == FAIL || inode_read_retry(parent, seq))
+            return 0;
+        len = FAIL;
+        if (nType == T_DIRECTORY && data.directory != NULL)
+            len = directory_name_optimistic(data.directory, name_hash, inumber, &name);
+        /* the name and its slash must fit before the rest of the path */
+        if (len != FAIL && len < start) {
+            start -= len;
+            memcpy(buffer + start, name, len);
+            buffer[--start] = '/';
+        } else {
+            len = FAIL;
+        }
+        if (inode_read_retry(parent, seq))
+            return 0;
+        if (len == FAIL)
+            break;
+        inumber = parent;
+    }
+
+    if (dcache_rename_seq() != rename_seq)
+        return 0;
+    if (inumber != FS_ROOT)
+        path[0] = '\0';
+    else
+        strcpy(path, start < MAX_PATH_SIZE - 1 ? buffer + start : "/");
+    return 1;
+}
+
+/*
+ * Finds the paths of some i-nodes from their parents, in O(depth) each.
+ * Input:
+ *  - inumbers: the i-nodes
+ *  - paths: buffers of MAX_PATH_SIZE bytes to store their paths, left
+ *    empty for the i-nodes not in the tree
+ *  - count: number of i-nodes
+ * Returns: SUCCESS, or FAIL if the tree kept changing under some walk,
+ *  whose path is left empty
+ */
+int find_paths(const int inumbers[], char *paths[], int count) {
+    int res = SUCCESS;
+
+    for (int i = 0; i < count; i++) {
+        int valid = 0;
+
+        for (int attempt = 0; attempt < OPTIMISTIC_RETRIES && !valid; attempt++) {
+            epoch_enter();
+            valid = path_walk(inumbers[i], paths[i]);
+            epoch_exit();
+        }
+        if (!valid) {
+            paths[i][0] = '\0';
+            res = FAIL;
+        }
+    }
+    return res;
+}
+
 /*
  * Prints tecnicofs tree.
  * Input:
@@ -1,18 +1,32 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "path.h"
+
+/* Most i-nodes an operation keeps locked at once (a move locks both parents and the entry) */
+#define MAX_LOCKED 3
+
+/* Lock-free walks of a path tried before lookup_optimistic takes locks */
+#define OPTIMISTIC_RETRIES 4
 
 void addLockedInode(int inumber, int inodeWaitList[], int *len);
 void unlockLast(int inodeWaitList[], int *len);
-void lock_or_trylock(int inumber, int inodeWaitList[], int *len, lock_mode mode, int try);
+void lock_and_add(int inumber, int inodeWaitList[], int *len, lock_mode mode);
+void fs_mutation_begin(int exclusive);
+void fs_mutation_end();
 void init_fs();
+int load_fs(const char *path, unsigned long *lsn);
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
-int create(char *name, type nodeType, int inodeWaitList[], int *len);
-int delete(char *name, int inodeWaitList[], int *len);
-int lookup(char *name, int inodeWaitList[], int *len, int try);
-int move(char *path, char *new_path, int inodeWaitList[], int *len);
+int is_dir_empty(Directory *directory);
+int lookup_sub_node(const DirName *name, Directory *directory);
+int create(Path *path, type nodeType, int inodeWaitList[], int *len);
+int delete(Path *path, int inodeWaitList[], int *len);
+int lookup(Path *path, int depth, int inodeWaitList[], int *len, lock_mode mode);
+int lookup_optimistic(Path *path, int inodeWaitList[], int *len);
+int move(Path *path, Path *new_path, int inodeWaitList[], int *len);
+unsigned long snapshot_fs(int wait);
 int printFS(char *path);
+int find_paths(const int inumbers[], char *paths[], int count);
 void print_tecnicofs_tree(FILE *fp);
 
 #endif /* FS_H */
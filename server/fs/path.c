@@ -0,0 +1,83 @@
+#include <string.h>
+#include "path.h"
+#include "pool.h"
+
+/*
+ * Parses a path into its components, reading it straight from where it
+ * was received.
+ * Input:
+ *  - path: the path to fill, released with path_release
+ *  - text: the path, not necessarily '\0' terminated
+ *  - len: length of the path
+ * Returns: SUCCESS, or FAIL if it has MAX_PATH_SIZE bytes or more, has a
+ *  '\0', or is too deep to fit in memory
+ */
+int path_parse(Path *path, const char *text, int len) {
+    unsigned int key_hash = 2166136261u;
+    int key_len = 0, count = 0, i;
+
+    if (len < 0 || len >= MAX_PATH_SIZE || memchr(text, '\0', len) != NULL)
+        return FAIL;
+    for (i = 0; i < len; i++)
+        count += text[i] != '/' && (i == 0 || text[i - 1] == '/');
+    path->key = path->inline_key;
+    path->components = path->inline_components;
+    path->key_hash = path->inline_key_hash;
+    /* the key is never longer than the text */
+    if (len >= PATH_INLINE_KEY && (path->key = pool_alloc(len + 1)) == NULL)
+        return FAIL;
+    if (count > PATH_INLINE_DEPTH) {
+        /* the components first, for their alignment */
+        if ((path->components = pool_alloc(count * sizeof(DirName) + (count + 1) * sizeof(unsigned int))) == NULL) {
+            path->components = path->inline_components;
+            path_release(path);
+            return FAIL;
+        }
+        path->key_hash = (unsigned int *) (path->components + count);
+    }
+
+    count = 0;
+    path->key_hash[0] = key_hash;
+    for (i = 0; i < len; ) {
+        DirName *component;
+        unsigned int hash = 2166136261u;
+        int start;
+
+        if (text[i] == '/') {
+            i++;
+            continue;
+        }
+        if (key_len > 0) {
+            path->key[key_len++] = '/';
+            key_hash = (key_hash ^ '/') * 16777619u;
+        }
+        start = key_len;
+        while (i < len && text[i] != '/') {
+            /* dir_hash_name and the key hash in the same pass */
+            hash = (hash ^ (unsigned char) text[i]) * 16777619u;
+            key_hash = (key_hash ^ (unsigned char) text[i]) * 16777619u;
+            path->key[key_len++] = text[i++];
+        }
+        component = &path->components[count++];
+        component->name = path->key + start;
+        component->len = key_len - start;
+        component->hash = hash;
+        path->key_hash[count] = key_hash;
+    }
+    path->key[key_len] = '\0';
+    path->len = key_len;
+    path->count = count;
+    return SUCCESS;
+}
+
+/*
+ * Frees what path_parse allocated for a path.
+ * Input:
+ *  - path: a path parsed with success
+ */
+void path_release(Path *path) {
+    if (path->key != path->inline_key)
+        pool_free(path->key);
+    if (path->components != path->inline_components)
+        pool_free(path->components);
+}
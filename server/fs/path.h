@@ -0,0 +1,43 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "state.h"
+
+/* Components and key bytes a path holds without allocating */
+#define PATH_INLINE_DEPTH 16
+#define PATH_INLINE_KEY 256
+
+/*
+ * A path parsed once per request. Its components are joined by single
+ * slashes into a key, without leading or trailing slashes, so "/a//b/"
+ * and "a/b" are the same path. Every component is a DirName pointing
+ * into the key, with its length and hash, and the key of each prefix of
+ * the path (the first depth components) has its hash precomputed, so
+ * the dentry cache is probed at any depth without scanning it again.
+ * The arrays are sized from the path: short ones use the inline
+ * storage, longer or deeper ones are allocated (see path_release).
+ */
+typedef struct path {
+    char *key; /* '\0' terminated */
+    int len;
+    int count;
+    /* key_hash[depth]: FNV-1a hash of the key of the first depth components */
+    unsigned int *key_hash;
+    DirName *components;
+    char inline_key[PATH_INLINE_KEY];
+    unsigned int inline_key_hash[PATH_INLINE_DEPTH + 1];
+    DirName inline_components[PATH_INLINE_DEPTH];
+} Path;
+
+/* Length of the key of the first depth components of a path */
+#define PATH_KEY_LEN(path, depth) \
+    ((depth) == 0 ? 0 : (int) ((path)->components[(depth) - 1].name - (path)->key + \
+                               (path)->components[(depth) - 1].len))
+
+/* Last component of a path, with at least one */
+#define PATH_LAST(path) (&(path)->components[(path)->count - 1])
+
+int path_parse(Path *path, const char *text, int len);
+void path_release(Path *path);
+
+#endif /* PATH_H */
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "state.h"
+#include "pool.h"
+
+/*
+ * Precedes every block, allocated or free. The payload that follows is
+ * 16-byte aligned, and links free blocks while they are free.
+ */
+typedef struct poolHeader {
+    int size_class; /* POOL_CLASSES for blocks from malloc */
+} __attribute__((aligned(16))) PoolHeader;
+
+typedef struct poolBlock {
+    PoolHeader header;
+    struct poolBlock *next;
+} PoolBlock;
+
+/*
+ * Free blocks of one class.
+ */
+typedef struct poolList {
+    PoolBlock *first;
+    int count;
+} PoolList;
+
+/*
+ * Free blocks shared by every thread, one depot per class.
+ */
+typedef struct poolDepot {
+    pthread_mutex_t lock;
+    PoolList free;
+} PoolDepot;
+
+static PoolDepot depots[POOL_CLASSES];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+/* gives the cache of an exiting thread back to the depots */
+static pthread_key_t pool_key;
+static __thread PoolList cache[POOL_CLASSES];
+static __thread int cache_registered = 0;
+
+/* Even classes are powers of two, odd ones half way to the next */
+#define CLASS_SIZE(class) ((size_t) (2 + ((class) & 1)) << (POOL_MIN_SHIFT - 1 + (class) / 2))
+#define BLOCK_OF(ptr) ((PoolBlock *) ((char *) (ptr) - sizeof(PoolHeader)))
+
+
+/*
+ * Returns: the smallest class whose blocks hold size bytes, or
+ *  POOL_CLASSES if none does
+ */
+static int size_class_of(size_t size) {
+    int class = 0;
+
+    size += sizeof(PoolHeader);
+    while (class < POOL_CLASSES && CLASS_SIZE(class) < size)
+        class++;
+    return class;
+}
+
+/*
+ * Bytes usable in the block pool_alloc returns for a size, so callers can
+ * size what they allocate to fill it.
+ * Input:
+ *  - size: number of bytes asked for
+ * Returns: size, or more if its class has room to spare
+ */
+size_t pool_usable_size(size_t size) {
+    int class = size_class_of(size);
+
+    return class == POOL_CLASSES ? size : CLASS_SIZE(class) - sizeof(PoolHeader);
+}
+
+/*
+ * Moves up to count blocks from the front of one list to another.
+ */
+static void list_move(PoolList *from, PoolList *to, int count) {
+    while (count-- > 0 && from->first != NULL) {
+        PoolBlock *block = from->first;
+        from->first = block->next;
+        from->count--;
+        block->next = to->first;
+        to->first = block;
+        to->count++;
+    }
+}
+
+static void pool_thread_exit(void *arg) {
+    (void) arg;
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        pthread_mutex_lock(&depots[class].lock);
+        list_move(&cache[class], &depots[class].free, cache[class].count);
+        pthread_mutex_unlock(&depots[class].lock);
+    }
+}
+
+static void pool_init() {
+    for (int class = 0; class < POOL_CLASSES; class++)
+        pthread_mutex_init(&depots[class].lock, NULL);
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+/*
+ * Makes the cache of this thread go back to the depots when it exits.
+ */
+static void cache_register() {
+    if (cache_registered)
+        return;
+    pthread_once(&pool_once, pool_init);
+    /* any non-NULL value makes the destructor run */
+    pthread_setspecific(pool_key, cache);
+    cache_registered = 1;
+}
+
+/*
+ * Refills the cache of this thread with a batch of blocks of a class,
+ * from the depot or, if it is empty, from a new slab.
+ * Input:
+ *  - class: the class, with an empty cache
+ * Returns: SUCCESS or FAIL
+ */
+static int cache_refill(int class) {
+    PoolDepot *depot = &depots[class];
+    size_t size = CLASS_SIZE(class), slab_size = size > POOL_SLAB_SIZE ? size : POOL_SLAB_SIZE;
+    char *slab;
+
+    cache_register();
+    pthread_mutex_lock(&depot->lock);
+    list_move(&depot->free, &cache[class], POOL_BATCH);
+    pthread_mutex_unlock(&depot->lock);
+    if (cache[class].count > 0)
+        return SUCCESS;
+
+    /* slabs are never freed, their blocks only move between lists */
+    if ((slab = malloc(slab_size)) == NULL)
+        return FAIL;
+    for (size_t offset = 0; offset + size <= slab_size; offset += size) {
+        PoolBlock *block = (PoolBlock *) (slab + offset);
+        block->header.size_class = class;
+        block->next = cache[class].first;
+        cache[class].first = block;
+        cache[class].count++;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Allocates memory, like malloc.
+ * Input:
+ *  - size: number of bytes
+ * Returns: 16-byte aligned memory, or NULL if out of memory
+ */
+void *pool_alloc(size_t size) {
+    int class = size_class_of(size);
+    PoolBlock *block;
+
+    if (class == POOL_CLASSES) {
+        if ((block = malloc(sizeof(PoolHeader) + size)) == NULL)
+            return NULL;
+        block->header.size_class = POOL_CLASSES;
+        return (char *) block + sizeof(PoolHeader);
+    }
+    if (cache[class].first == NULL && cache_refill(class) == FAIL)
+        return NULL;
+    block = cache[class].first;
+    cache[class].first = block->next;
+    cache[class].count--;
+    return (char *) block + sizeof(PoolHeader);
+}
+
+/*
+ * Releases memory from pool_alloc to the cache of this thread, which may
+ * not be the one that allocated it.
+ * Input:
+ *  - ptr: the memory, or NULL
+ */
+void pool_free(void *ptr) {
+    PoolBlock *block;
+    int class;
+
+    if (ptr == NULL)
+        return;
+    block = BLOCK_OF(ptr);
+    if ((class = block->header.size_class) == POOL_CLASSES) {
+        free(block);
+        return;
+    }
+    cache_register();
+    block->next = cache[class].first;
+    cache[class].first = block;
+    if (++cache[class].count > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&depots[class].lock);
+        list_move(&cache[class], &depots[class].free, POOL_BATCH);
+        pthread_mutex_unlock(&depots[class].lock);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Allocator of small blocks in size classes, two per power of two (32,
+ * 48, 64, 96, ... bytes with the block header). Every thread keeps a
+ * cache of free blocks of each class and only takes the lock of a class
+ * to move POOL_BATCH blocks between its cache and the shared depot, or to
+ * carve a new slab. Slabs are never returned to the system, so only
+ * blocks up to 4 KB are pooled: larger ones come from malloc and go back
+ * to it when freed.
+ */
+
+/* Smallest class, 1 << POOL_MIN_SHIFT bytes with the block header */
+#define POOL_MIN_SHIFT 5
+/* Number of classes; larger allocations go straight to malloc */
+#define POOL_CLASSES 15
+/* Blocks moved at once between a thread's cache and the depot */
+#define POOL_BATCH 32
+/* Blocks of a class a thread keeps before giving a batch back */
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+/* Memory carved into blocks when the depot of a class is empty */
+#define POOL_SLAB_SIZE (256 * 1024)
+
+void *pool_alloc(size_t size);
+size_t pool_usable_size(size_t size);
+void pool_free(void *ptr);
+
+#endif /* POOL_H */
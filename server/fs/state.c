@@ -2,11 +2,74 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 #include "state.h"
+#include "epoch.h"
+#include "checkpoint.h"
+#include "log.h"
 #include "../tecnicofs-api-constants.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+/* Segments of the i-node table, published once and never moved */
+static inode_t *inode_segments[MAX_INODE_SEGMENTS];
+/* Number of i-numbers backed by a published segment */
+static int inode_count = 0;
+/* Serializes the allocation of new segments */
+static pthread_mutex_t inode_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Head of the lock-free free list: the low 32 bits hold the first free
+ * i-number and the high 32 bits a tag incremented on every pop, so a
+ * stale head can never be swapped back in (ABA).
+ */
+static uint64_t free_list_head;
+
+/*
+ * Copy-on-write snapshot of the tree. While one is taken, the first
+ * change to an i-node saves its type and entries (see inode_snapshot_save)
+ * and deleted i-nodes are kept out of the free list, so the snapshot can
+ * be read without locks while the tree keeps changing.
+ */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when the snapshot taken is released or left unused */
+static pthread_cond_t snapshot_released = PTHREAD_COND_INITIALIZER;
+/* Set while the holder of the snapshot is reading it */
+static int snapshot_busy = 0;
+/* Set between inode_snapshot_reserve and inode_snapshot_begin */
+static int snapshot_reserved = 0;
+/* When the snapshot, if not in use, may be released for another one */
+static time_t snapshot_expires = 0;
+/* Id of the snapshot taken, or 0 */
+static unsigned long snapshot_current = 0;
+static unsigned long snapshot_last_id = 0;
+/* Set if an i-node could not be saved */
+static int snapshot_failed = 0;
+/* I-nodes saved for the snapshot, linked through snap_next */
+static int snapshot_saved = FREE_INODE;
+/* I-nodes deleted while the snapshot is taken, linked through nextFree */
+static int snapshot_deleted = FREE_INODE;
+
+/*
+ * Lock profiling: counters of every i-node, in segments parallel to the
+ * table's, allocated with them once it is enabled.
+ */
+static int lock_profiling = 0;
+static lock_stats *lock_stats_segments[MAX_INODE_SEGMENTS];
+/* Locks held by this thread and when they were acquired */
+static __thread struct {
+    int inumber;
+    unsigned long since;
+} lock_held[LOCK_PROFILE_HELD];
+static __thread int lock_held_count = 0;
+
+#define INODE(inumber) (&inode_segments[(inumber) >> INODE_SEGMENT_SHIFT][(inumber) & INODE_SEGMENT_MASK])
+#define INODE_DATA(inumber) relptr_load(&INODE(inumber)->data, __ATOMIC_RELAXED)
+#define HEAD_INDEX(head) ((int) (uint32_t) (head))
+#define HEAD_TAG(head) ((uint32_t) ((head) >> 32))
+#define MAKE_HEAD(index, tag) (((uint64_t) (tag) << 32) | (uint32_t) (index))
+
+#define LOCK_STATS(inumber) (&lock_stats_segments[(inumber) >> INODE_SEGMENT_SHIFT][(inumber) & INODE_SEGMENT_MASK])
 
 /*
  * Sleeps for synchronization testing.
@@ -15,6 +78,242 @@ void insert_delay(int cycles) {
     for (int i = 0; i < cycles; i++) {}
 }
 
+/*
+ * Checks if an i-number belongs to an allocated segment of the table.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: 1 if valid, else 0
+ */
+int inode_is_valid(int inumber) {
+    return inumber >= 0 && inumber < __atomic_load_n(&inode_count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Pushes a chain of free i-nodes, already linked through nextFree from
+ * first to last, onto the free list.
+ * Input:
+ *  - first: i-number at the top of the chain
+ *  - last: i-number at the bottom of the chain
+ */
+static void free_list_push(int first, int last) {
+    uint64_t head = __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    do {
+        __atomic_store_n(&INODE(last)->nextFree, HEAD_INDEX(head), __ATOMIC_RELAXED);
+        new_head = MAKE_HEAD(first, HEAD_TAG(head));
+    } while (!__atomic_compare_exchange_n(&free_list_head, &head, new_head, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Pops a free i-node from the free list.
+ * Returns:
+ *  inumber: identifier of the free i-node
+ *  FREE_INODE: if the list is empty
+ */
+static int free_list_pop() {
+    uint64_t head = __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    int inumber;
+    do {
+        inumber = HEAD_INDEX(head);
+        if (inumber == FREE_INODE)
+            return FREE_INODE;
+        /* segments are never freed, so reading a stale link is harmless */
+        new_head = MAKE_HEAD(__atomic_load_n(&INODE(inumber)->nextFree, __ATOMIC_RELAXED),
+                             HEAD_TAG(head) + 1);
+    } while (!__atomic_compare_exchange_n(&free_list_head, &head, new_head, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return inumber;
+}
+
+/*
+ * Allocates a new segment of the table and pushes its i-nodes to the free list.
+ * Returns: SUCCESS or FAIL
+ */
+static int inode_table_grow() {
+    int first, segment;
+    inode_t *slots;
+
+    pthread_mutex_lock(&inode_grow_lock);
+    /* another thread may have grown the table while we waited */
+    if (HEAD_INDEX(__atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE)) != FREE_INODE) {
+        pthread_mutex_unlock(&inode_grow_lock);
+        return SUCCESS;
+    }
+    first = inode_count;
+    segment = first >> INODE_SEGMENT_SHIFT;
+    /* i-nodes must start cache lines, as inode_t is aligned to them */
+    if (segment >= MAX_INODE_SEGMENTS ||
+        posix_memalign((void **) &slots, __alignof__(inode_t), sizeof(inode_t) * INODE_SEGMENT_SIZE) != 0) {
+        pthread_mutex_unlock(&inode_grow_lock);
+        return FAIL;
+    }
+    if (lock_profiling && lock_stats_segments[segment] == NULL &&
+        (lock_stats_segments[segment] = calloc(INODE_SEGMENT_SIZE, sizeof(lock_stats))) == NULL) {
+        free(slots);
+        pthread_mutex_unlock(&inode_grow_lock);
+        return FAIL;
+    }
+    for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+        slots[i].nodeType = T_NONE;
+        slots[i].data = 0;
+        slots[i].nextFree = first + i + 1;
+        slots[i].generation = 0;
+        slots[i].seq = 0;
+        slots[i].parent = FREE_INODE;
+        slots[i].moved = 0;
+        slots[i].snap_id = 0;
+        slots[i].snap_directory = NULL;
+        if (pthread_rwlock_init(&slots[i].lock, NULL)) {
+            free(slots);
+            pthread_mutex_unlock(&inode_grow_lock);
+            return FAIL;
+        }
+    }
+    /* publish the segment before any of its i-numbers becomes reachable */
+    __atomic_store_n(&inode_segments[segment], slots, __ATOMIC_RELEASE);
+    __atomic_store_n(&inode_count, first + INODE_SEGMENT_SIZE, __ATOMIC_RELEASE);
+    /* lowest i-numbers are handed out first */
+    free_list_push(first, first + INODE_SEGMENT_SIZE - 1);
+    pthread_mutex_unlock(&inode_grow_lock);
+    return SUCCESS;
+}
+
+/*
+ * Pushes an i-number onto a list linked through one of its fields.
+ * Input:
+ *  - head: head of the list
+ *  - link: the link field of the i-node
+ *  - inumber: identifier of the i-node
+ */
+static void inode_list_push(int *head, int *link, int inumber) {
+    int first = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    do {
+        *link = first;
+    } while (!__atomic_compare_exchange_n(head, &first, inumber, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Saves the type and entries of an i-node for the snapshot being taken,
+ * unless they were already saved. Called before the i-node changes.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_snapshot_save(int inumber) {
+    unsigned long id = __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST);
+    inode_t *inode = INODE(inumber);
+
+    /* i-nodes that are free now were not reachable when it was taken */
+    if (id == 0 || inode->snap_id == id || inode->nodeType == T_NONE)
+        return;
+    inode->snap_type = inode->nodeType;
+    inode->snap_directory = NULL;
+    if (inode->nodeType == T_DIRECTORY &&
+        (inode->snap_directory = directory_copy(INODE_DATA(inumber))) == NULL)
+        __atomic_store_n(&snapshot_failed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&inode->snap_id, id, __ATOMIC_RELEASE);
+    inode_list_push(&snapshot_saved, &inode->snap_next, inumber);
+}
+
+/*
+ * Starts a change that lock-free readers must not trust, making the
+ * sequence counter odd. The i-node must be write-locked (or unreachable).
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_write_begin(int inumber) {
+    inode_t *inode = INODE(inumber);
+
+    /* lets inode_snapshot_begin wait for changes that missed the snapshot */
+    epoch_enter();
+    inode_snapshot_save(inumber);
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Ends a change started by inode_write_begin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_write_end(int inumber) {
+    inode_t *inode = INODE(inumber);
+
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+    epoch_exit();
+}
+
+static unsigned long lock_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/*
+ * Returns: the lock counters of a valid i-node, or NULL if lock
+ *  profiling is off
+ */
+static lock_stats *lock_stats_get(int inumber) {
+    if (!__atomic_load_n(&lock_profiling, __ATOMIC_ACQUIRE))
+        return NULL;
+    return LOCK_STATS(inumber);
+}
+
+/*
+ * Counts an acquired lock and remembers when, for its hold time.
+ * Input:
+ *  - stats: counters of the i-node
+ *  - inumber: identifier of the i-node
+ *  - wait_start: when lock started waiting, or 0 if it did not wait
+ */
+static void lock_acquired(lock_stats *stats, int inumber, unsigned long wait_start) {
+    unsigned long now = lock_clock();
+
+    __atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait_start != 0) {
+        __atomic_add_fetch(&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->wait_ns, now - wait_start, __ATOMIC_RELAXED);
+    }
+    if (lock_held_count < LOCK_PROFILE_HELD) {
+        lock_held[lock_held_count].inumber = inumber;
+        lock_held[lock_held_count].since = now;
+        lock_held_count++;
+    }
+}
+
+/*
+ * Adds the time a lock was held by this thread to its i-node.
+ * Input:
+ *  - stats: counters of the i-node
+ *  - inumber: identifier of the i-node
+ */
+static void lock_released(lock_stats *stats, int inumber) {
+    for (int i = lock_held_count - 1; i >= 0; i--) {
+        if (lock_held[i].inumber == inumber) {
+            __atomic_add_fetch(&stats->hold_ns, lock_clock() - lock_held[i].since, __ATOMIC_RELAXED);
+            lock_held[i] = lock_held[--lock_held_count];
+            return;
+        }
+    }
+}
+
+/*
+ * Tries to take the lock of an i-node without waiting.
+ * Returns: 0 if taken, else an error number
+ */
+static int rwlock_try(int inumber, lock_mode mode) {
+    switch (mode) {
+        case LREAD:
+            return pthread_rwlock_tryrdlock(&INODE(inumber)->lock);
+        case LWRITE:
+            return pthread_rwlock_trywrlock(&INODE(inumber)->lock);
+        default:
+            exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * Read-lock or write-lock an i-node.
  * Input:
@@ -23,23 +322,33 @@ void insert_delay(int cycles) {
  * Returns: 1 if successful, else 0
  */ 
 int lock(int inumber, lock_mode mode) {
+    lock_stats *stats;
+    unsigned long wait_start = 0;
     int err;
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE)) {
-        printf("lock: invalid inumber %d\n", inumber);
+    if (!inode_is_valid(inumber)) {
+        log_printf(LOG_ERROR, "lock: invalid inumber %d\n", inumber);
         exit(EXIT_FAILURE);
     } 
+    /* when profiling, only a lock that has to wait is timed */
+    if ((stats = lock_stats_get(inumber)) != NULL) {
+        if (rwlock_try(inumber, mode) == 0) {
+            lock_acquired(stats, inumber, 0);
+            return 1;
+        }
+        wait_start = lock_clock();
+    }
     switch (mode) {
         case LREAD:
-            err = pthread_rwlock_rdlock(&inode_table[inumber].lock);
+            err = pthread_rwlock_rdlock(&INODE(inumber)->lock);
             if (err) {
-                printf("lock: read lock error (%d, %s) \n", err, strerror(err));
+                log_printf(LOG_ERROR, "lock: read lock error (%d, %s) \n", err, strerror(err));
                 return 0;
             }
             break;
         case LWRITE:
-            err = pthread_rwlock_wrlock(&inode_table[inumber].lock);
+            err = pthread_rwlock_wrlock(&INODE(inumber)->lock);
             if (err) {
-                printf("lock: write lock error (%d, %s)\n", err, strerror(err));
+                log_printf(LOG_ERROR, "lock: write lock error (%d, %s)\n", err, strerror(err));
                 return 0;
             }
             break;
@@ -47,6 +356,8 @@ int lock(int inumber, lock_mode mode) {
             exit(EXIT_FAILURE);
             break;
     }
+    if (stats != NULL)
+        lock_acquired(stats, inumber, wait_start);
     return 1;
 }
 
@@ -58,28 +369,19 @@ int lock(int inumber, lock_mode mode) {
  * Returns: 1 if successful, else 0
  */
 int trylock(int inumber, lock_mode mode) {
-    int err;
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE)) {
-        printf("lock: invalid inumber %d\n", inumber);
+    lock_stats *stats;
+    if (!inode_is_valid(inumber)) {
+        log_printf(LOG_ERROR, "lock: invalid inumber %d\n", inumber);
         exit(EXIT_FAILURE);
     } 
-    switch (mode) {
-        case LREAD:
-            err = pthread_rwlock_tryrdlock(&inode_table[inumber].lock);
-            if (err) {
-                return 0;
-            }
-            break;
-        case LWRITE:
-            err = pthread_rwlock_trywrlock(&inode_table[inumber].lock);
-            if (err) {
-                return 0;
-            }
-            break;
-        default:
-            exit(EXIT_FAILURE);
-            break;
+    stats = lock_stats_get(inumber);
+    if (rwlock_try(inumber, mode)) {
+        if (stats != NULL)
+            __atomic_add_fetch(&stats->trylock_failures, 1, __ATOMIC_RELAXED);
+        return 0;
     }
+    if (stats != NULL)
+        lock_acquired(stats, inumber, 0);
     return 1;
 }
 
@@ -91,33 +393,125 @@ int trylock(int inumber, lock_mode mode) {
  * Returns: SUCCESS or FAIL
  */
 int unlock(int inumber) {
+    lock_stats *stats;
     int err;
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE)) {
-        printf("unlock: invalid inumber\n");
+    if (!inode_is_valid(inumber)) {
+        log_printf(LOG_ERROR, "unlock: invalid inumber\n");
         return FAIL;
     } 
-    err = pthread_rwlock_unlock(&inode_table[inumber].lock);
+    if ((stats = lock_stats_get(inumber)) != NULL)
+        lock_released(stats, inumber);
+    err = pthread_rwlock_unlock(&INODE(inumber)->lock);
     if (err) {
-        printf("unlock: unlock error (%d, %s)\n", err, strerror(err));
+        log_printf(LOG_ERROR, "unlock: unlock error (%d, %s)\n", err, strerror(err));
         return FAIL;
     }
     return SUCCESS;
 }
 
+/*
+ * Starts counting the lock contention of every i-node, see lock_stats.
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+int lock_profiling_enable() {
+    pthread_mutex_lock(&inode_grow_lock);
+    for (int segment = 0; segment < (inode_count >> INODE_SEGMENT_SHIFT); segment++) {
+        if (lock_stats_segments[segment] == NULL &&
+            (lock_stats_segments[segment] = calloc(INODE_SEGMENT_SIZE, sizeof(lock_stats))) == NULL) {
+            pthread_mutex_unlock(&inode_grow_lock);
+            return FAIL;
+        }
+    }
+    /* new segments get their counters from now on */
+    __atomic_store_n(&lock_profiling, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&inode_grow_lock);
+    return SUCCESS;
+}
+
+/*
+ * Returns: 1 if lock profiling is on, else 0
+ */
+int lock_profiling_enabled() {
+    return __atomic_load_n(&lock_profiling, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Finds the most contended i-nodes in use: those that waited longest for
+ * their lock, then those with the most failed trylocks and acquisitions.
+ * Counters are read while they change, each one is exact on its own.
+ * Input:
+ *  - count: most i-nodes to find
+ *  - inumbers: array to store their i-numbers, the most contended first
+ *  - stats: array to store their counters
+ * Returns: number of i-nodes found
+ */
+int lock_stats_top(int count, int inumbers[], lock_stats stats[]) {
+    int found = 0, total = __atomic_load_n(&inode_count, __ATOMIC_ACQUIRE);
+
+    if (!lock_profiling_enabled())
+        return 0;
+    for (int inumber = 0; inumber < total; inumber++) {
+        lock_stats *counters = LOCK_STATS(inumber), copy;
+        int i;
+
+        if (INODE(inumber)->nodeType == T_NONE)
+            continue;
+        copy.acquisitions = __atomic_load_n(&counters->acquisitions, __ATOMIC_RELAXED);
+        copy.contended = __atomic_load_n(&counters->contended, __ATOMIC_RELAXED);
+        copy.wait_ns = __atomic_load_n(&counters->wait_ns, __ATOMIC_RELAXED);
+        copy.hold_ns = __atomic_load_n(&counters->hold_ns, __ATOMIC_RELAXED);
+        copy.trylock_failures = __atomic_load_n(&counters->trylock_failures, __ATOMIC_RELAXED);
+        if (copy.acquisitions == 0 && copy.trylock_failures == 0)
+            continue;
+        /* insertion into the sorted array of the ones found */
+        for (i = found; i > 0; i--) {
+            lock_stats *other = &stats[i - 1];
+            if (other->wait_ns > copy.wait_ns || (other->wait_ns == copy.wait_ns &&
+                (other->trylock_failures > copy.trylock_failures ||
+                 (other->trylock_failures == copy.trylock_failures &&
+                  other->acquisitions >= copy.acquisitions))))
+                break;
+            if (i < count) {
+                stats[i] = stats[i - 1];
+                inumbers[i] = inumbers[i - 1];
+            }
+        }
+        if (i < count) {
+            stats[i] = copy;
+            inumbers[i] = inumber;
+            if (found < count)
+                found++;
+        }
+    }
+    return found;
+}
 
 
 /*
- * Initializes the i-nodes table.
+ * Initializes the i-nodes table with its first segment.
  * Returns: SUCCESS or FAIL
  */
 int inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if (pthread_rwlock_init(&inode_table[i].lock, NULL)) return FAIL;
-    }
-    return SUCCESS;
+    inode_count = 0;
+    free_list_head = MAKE_HEAD(FREE_INODE, 0);
+    return inode_table_grow();
+}
+
+/*
+ * Uses an i-node table mapped from a checkpoint image instead of
+ * initializing one. Only the segment pointers are set: the i-nodes are
+ * used where they are, and i-numbers from used up are free, linked
+ * through nextFree in increasing order.
+ * Input:
+ *  - slots: the i-nodes, in INODE_SEGMENT_SIZE aligned segments
+ *  - count: number of i-nodes, a multiple of INODE_SEGMENT_SIZE
+ *  - used: number of i-nodes in use, the first ones
+ */
+void inode_table_adopt(inode_t *slots, int count, int used) {
+    for (int segment = 0; segment < (count >> INODE_SEGMENT_SHIFT); segment++)
+        inode_segments[segment] = slots + ((long) segment << INODE_SEGMENT_SHIFT);
+    inode_count = count;
+    free_list_head = MAKE_HEAD(used < count ? used : FREE_INODE, 0);
 }
 
 /*
@@ -125,13 +519,22 @@ int inode_table_init() {
  */
 
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	        if (inode_table[i].data.dirEntries) free(inode_table[i].data.dirEntries);
-        }
+    for (int i = 0; i < inode_count; i++) {
+        if (INODE(i)->nodeType == T_DIRECTORY)
+            directory_destroy(INODE_DATA(i));
+        else if (INODE(i)->nodeType == T_FILE)
+            free(INODE_DATA(i));
     }
+    for (int segment = 0; segment < (inode_count >> INODE_SEGMENT_SHIFT); segment++) {
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++)
+            pthread_rwlock_destroy(&inode_segments[segment][i].lock);
+        if (!checkpoint_contains(inode_segments[segment]))
+            free(inode_segments[segment]);
+        inode_segments[segment] = NULL;
+        free(lock_stats_segments[segment]);
+        lock_stats_segments[segment] = NULL;
+    }
+    inode_count = 0;
 }
 
 /*
@@ -143,30 +546,47 @@ void inode_table_destroy() {
  *     FAIL: if an error occurs
  */
 int inode_create(type nType) {
+    int inumber;
+    inode_t *inode;
+    lock_stats *stats;
+
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        /* Read-lock while searching for an empty i-node */
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            /* Unlock locked i-nodes */
-            return inumber;
+    /* the popped i-node is owned by this thread, no other create can see it */
+    while ((inumber = free_list_pop()) == FREE_INODE) {
+        if (inode_table_grow() == FAIL)
+            return FAIL;
+    }
+    /* contention of the i-node deleted before does not count for this one */
+    if ((stats = lock_stats_get(inumber)) != NULL) {
+        __atomic_store_n(&stats->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->trylock_failures, 0, __ATOMIC_RELAXED);
+    }
+    inode = INODE(inumber);
+    inode_write_begin(inumber);
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        Directory *dir = directory_create();
+        if (dir == NULL) {
+            inode_write_end(inumber);
+            free_list_push(inumber, inumber);
+            return FAIL;
         }
+        relptr_store(&inode->data, dir, __ATOMIC_RELAXED);
+    }
+    else {
+        inode->data = 0;
     }
-    return FAIL;
+    inode->nodeType = nType;
+    /* linked by dir_add_entry */
+    __atomic_store_n(&inode->parent, FREE_INODE, __ATOMIC_RELAXED);
+    __atomic_store_n(&inode->moved, 0, __ATOMIC_RELAXED);
+    inode_write_end(inumber);
+    return inumber;
 }
 
 /*
@@ -176,18 +596,34 @@ int inode_create(type nType) {
  * Returns: SUCCESS or FAIL
  */
 int inode_delete(int inumber) {
+    int deferred;
+
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_delete: invalid inumber\n");
+    if (!inode_is_valid(inumber) || (INODE(inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_delete: invalid inumber\n");
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    inode_write_begin(inumber);
+    /* lock-free lookups may still be probing the entries */
+    if (INODE(inumber)->nodeType == T_DIRECTORY)
+        directory_retire(INODE_DATA(inumber));
+    else
+        free(INODE_DATA(inumber));
+    relptr_store(&INODE(inumber)->data, NULL, __ATOMIC_RELAXED);
+    INODE(inumber)->nodeType = T_NONE;
+    __atomic_store_n(&INODE(inumber)->parent, FREE_INODE, __ATOMIC_RELAXED);
+    /* invalidates every cached path resolved to this i-node */
+    __atomic_add_fetch(&INODE(inumber)->generation, 1, __ATOMIC_SEQ_CST);
+    /* a snapshot may still read the saved i-node, it must not be reused */
+    deferred = __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST) != 0;
+    if (deferred)
+        inode_list_push(&snapshot_deleted, &INODE(inumber)->nextFree, inumber);
+    inode_write_end(inumber);
+    if (!deferred)
+        free_list_push(inumber, inumber);
     return SUCCESS;
 }
 
@@ -204,16 +640,114 @@ int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_get: invalid inumber %d\n", inumber);
+    if (!inode_is_valid(inumber) || (INODE(inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = INODE(inumber)->nodeType;
 
     if (data)
-        *data = inode_table[inumber].data;
+        data->directory = INODE_DATA(inumber);
+    return SUCCESS;
+}
+
+
+/*
+ * Reads the generation of an i-node, which changes when it is deleted.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the generation
+ */
+unsigned int inode_get_generation(int inumber) {
+    return __atomic_load_n(&INODE(inumber)->generation, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Reads where the entry of an i-node is. Parents only change while the
+ * entry is being moved, so they are stable for callers holding the lock
+ * that serializes moves, and are validated by lock-free readers like the
+ * entries they lead to (see inode_read_retry). A new parent is read with
+ * the stamp of the move that set it (see inode_set_moved).
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - name_hash: pointer to store the hash of the name of the entry, or NULL
+ * Returns: the i-number of the parent directory, or FREE_INODE for the
+ *  root and for i-nodes without an entry
+ */
+int inode_get_parent(int inumber, unsigned int *name_hash) {
+    if (!inode_is_valid(inumber))
+        return FREE_INODE;
+    if (name_hash)
+        *name_hash = __atomic_load_n(&INODE(inumber)->name_hash, __ATOMIC_RELAXED);
+    return __atomic_load_n(&INODE(inumber)->parent, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Reads when an i-node was last moved.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the rename sequence stamped by inode_set_moved, 0 if never
+ *  moved, or the largest one for an invalid i-number
+ */
+unsigned long inode_get_moved(int inumber) {
+    if (!inode_is_valid(inumber))
+        return ~0ul;
+    return __atomic_load_n(&INODE(inumber)->moved, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stamps an i-node that is about to be moved, before its entry changes,
+ * so cached paths through it can tell they are stale.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - rename_seq: the rename sequence of the move
+ */
+void inode_set_moved(int inumber, unsigned long rename_seq) {
+    __atomic_store_n(&INODE(inumber)->moved, rename_seq, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Starts a lock-free read of an i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the sequence counter, odd if a change is in progress
+ */
+unsigned int inode_read_begin(int inumber) {
+    return __atomic_load_n(&INODE(inumber)->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Checks if an i-node changed since inode_read_begin, in which case what
+ * was read from it (and its entries) may be inconsistent.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - seq: value returned by inode_read_begin
+ * Returns: 1 if the read must be retried, else 0
+ */
+int inode_read_retry(int inumber, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&INODE(inumber)->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Copies the type and data of an i-node without locking it, for readers
+ * between inode_read_begin and inode_read_retry.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to type
+ *  - data: pointer to data
+ * Returns: SUCCESS or FAIL
+ */
+int inode_get_optimistic(int inumber, type *nType, union Data *data) {
+    if (!inode_is_valid(inumber))
+        return FAIL;
+    *nType = __atomic_load_n(&INODE(inumber)->nodeType, __ATOMIC_RELAXED);
+    data->directory = INODE_DATA(inumber);
     return SUCCESS;
 }
 
@@ -223,38 +757,39 @@ int inode_get(int inumber, type *nType, union Data *data) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, const DirName *sub_name) {
+    int res;
+
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid inumber\n");
+    if (!inode_is_valid(inumber) || (INODE(inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_reset_entry: can only reset entry to directories\n");
+    if (INODE(inumber)->nodeType != T_DIRECTORY) {
+        log_printf(LOG_ERROR, "inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid entry inumber\n");
+    if (!inode_is_valid(sub_inumber) || (INODE(sub_inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-    return FAIL;
+
+    inode_write_begin(inumber);
+    res = directory_remove(INODE_DATA(inumber), sub_name, sub_inumber);
+    if (res == SUCCESS)
+        __atomic_store_n(&INODE(sub_inumber)->parent, FREE_INODE, __ATOMIC_RELEASE);
+    inode_write_end(inumber);
+    return res;
 }
 
 
@@ -266,42 +801,45 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  *  - sub_name: name of the sub i-node entry 
  * Returns: SUCCESS or FAIL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+int dir_add_entry(int inumber, int sub_inumber, const DirName *sub_name) {
+    int res;
+
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid inumber\n");
+    if (!inode_is_valid(inumber) || (INODE(inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_add_entry: invalid inumber\n");
         unlock(inumber);
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_add_entry: can only add entry to directories\n");
+    if (INODE(inumber)->nodeType != T_DIRECTORY) {
+        log_printf(LOG_ERROR, "inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid entry inumber\n");
+    if (!inode_is_valid(sub_inumber) || (INODE(sub_inumber)->nodeType == T_NONE)) {
+        log_printf(LOG_ERROR, "inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    if (strlen(sub_name) == 0 ) {
-        printf("inode_add_entry: \
+    if (sub_name->len == 0) {
+        log_printf(LOG_ERROR, "inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
     }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
-        }
+
+    inode_write_begin(inumber);
+    res = directory_insert(INODE_DATA(inumber), sub_name, sub_inumber);
+    if (res == SUCCESS) {
+        /* readers find the entry from the child through these */
+        __atomic_store_n(&INODE(sub_inumber)->name_hash, sub_name->hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&INODE(sub_inumber)->parent, inumber, __ATOMIC_RELEASE);
     }
-    return FAIL;
+    inode_write_end(inumber);
+    return res;
 }
 
 
@@ -312,22 +850,372 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
  *  - name: pointer to the name of current file/dir
  */
 void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
+    if (INODE(inumber)->nodeType == T_FILE) {
         fprintf(fp, "%s\n", name);
         return;
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+    if (INODE(inumber)->nodeType == T_DIRECTORY) {
+        Directory *dir = INODE_DATA(inumber);
+        DirEntry *entries = DIR_ENTRIES(dir);
         fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > (long) sizeof(path)) {
+        for (int i = 0; i < dir->capacity; i++) {
+            if (entries[i].inumber != FREE_INODE) {
+                char path[MAX_PATH_SIZE];
+                if (snprintf(path, sizeof(path), "%s/%s", name, DIR_ENTRY_NAME(entries, i)) > (long) sizeof(path)) {
                     fprintf(stderr, "truncation when building full path\n");
                 }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
+                inode_print_tree(fp, entries[i].inumber, path);
             }
         }
     }
 }
 
+
+
+/*
+ * Releases the snapshot taken: the saved copies, and the deleted i-nodes
+ * that were kept out of the free list. Called with snapshot_lock held.
+ */
+static void snapshot_release() {
+    int inumber, next;
+
+    __atomic_store_n(&snapshot_current, 0, __ATOMIC_SEQ_CST);
+    /* no change can still be saving or deferring for it */
+    epoch_synchronize();
+
+    inumber = __atomic_exchange_n(&snapshot_saved, FREE_INODE, __ATOMIC_ACQUIRE);
+    for (; inumber != FREE_INODE; inumber = next) {
+        next = INODE(inumber)->snap_next;
+        directory_destroy(INODE(inumber)->snap_directory);
+        INODE(inumber)->snap_directory = NULL;
+    }
+    inumber = __atomic_exchange_n(&snapshot_deleted, FREE_INODE, __ATOMIC_ACQUIRE);
+    if (inumber != FREE_INODE) {
+        int last = inumber;
+        while (INODE(last)->nextFree != FREE_INODE)
+            last = INODE(last)->nextFree;
+        free_list_push(inumber, last);
+    }
+    snapshot_busy = 0;
+    pthread_cond_broadcast(&snapshot_released);
+}
+
+/*
+ * Reserves the snapshot, to be taken with inode_snapshot_begin. Only one
+ * is taken at a time; one left unused for SNAPSHOT_LEASE seconds is
+ * released for the next. Waiting here holds no lock of the tree, so the
+ * caller only excludes moves for the short inode_snapshot_begin.
+ * Input:
+ *  - wait: if set, waits while the snapshot taken is being read
+ * Returns: SUCCESS, or FAIL if another one is taken and in use, or kept
+ *  unused with its lease running (its holder may renew it indefinitely,
+ *  so that is never waited for)
+ */
+int inode_snapshot_reserve(int wait) {
+    pthread_mutex_lock(&snapshot_lock);
+    while (snapshot_current != 0 || snapshot_reserved) {
+        struct timespec until = {0, 0};
+
+        if (!snapshot_reserved && !snapshot_busy && time(NULL) >= snapshot_expires) {
+            /* its holder went away, it cannot read it again */
+            snapshot_release();
+            break;
+        }
+        if (!wait || (!snapshot_reserved && !snapshot_busy)) {
+            pthread_mutex_unlock(&snapshot_lock);
+            return FAIL;
+        }
+        until.tv_sec = time(NULL) + 1;
+        pthread_cond_timedwait(&snapshot_released, &snapshot_lock, &until);
+    }
+    snapshot_reserved = 1;
+    pthread_mutex_unlock(&snapshot_lock);
+    return SUCCESS;
+}
+
+/*
+ * Takes the snapshot reserved by the caller, in use by it until it calls
+ * inode_snapshot_unuse or inode_snapshot_end. No change may span more
+ * than one directory while it is taken (moves must be excluded by the
+ * caller).
+ * Returns: id of the snapshot
+ */
+unsigned long inode_snapshot_begin() {
+    unsigned long id;
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_reserved = 0;
+    snapshot_failed = 0;
+    snapshot_busy = 1;
+    id = ++snapshot_last_id;
+    __atomic_store_n(&snapshot_current, id, __ATOMIC_SEQ_CST);
+    /* changes that started before and did not save anything are over */
+    epoch_synchronize();
+    pthread_mutex_unlock(&snapshot_lock);
+    return id;
+}
+
+/*
+ * Checks if a snapshot is still taken, without using it.
+ * Input:
+ *  - id: id of the snapshot
+ * Returns: 1 if it is, else 0
+ */
+int inode_snapshot_taken(unsigned long id) {
+    return __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST) == id;
+}
+
+/*
+ * Resumes using a snapshot left with inode_snapshot_unuse.
+ * Input:
+ *  - id: id of the snapshot
+ * Returns: SUCCESS, or FAIL if its lease expired and it was released
+ */
+int inode_snapshot_use(unsigned long id) {
+    int res = FAIL;
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_current == id) {
+        snapshot_busy = 1;
+        res = SUCCESS;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return res;
+}
+
+/*
+ * Stops using a snapshot for now, keeping it for SNAPSHOT_LEASE seconds.
+ * Input:
+ *  - id: id of the snapshot
+ */
+void inode_snapshot_unuse(unsigned long id) {
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_current == id) {
+        snapshot_busy = 0;
+        snapshot_expires = time(NULL) + SNAPSHOT_LEASE;
+        /* whoever waits for it gives up instead */
+        pthread_cond_broadcast(&snapshot_released);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+/*
+ * Releases a snapshot.
+ * Input:
+ *  - id: id of the snapshot
+ * Returns: SUCCESS, or FAIL if some i-node could not be saved for it (or
+ *  its lease expired)
+ */
+int inode_snapshot_end(unsigned long id) {
+    int res = FAIL;
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_current == id) {
+        res = snapshot_failed ? FAIL : SUCCESS;
+        snapshot_release();
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return res;
+}
+
+/*
+ * Reads an i-node as it was when a snapshot was taken, without locks.
+ * Input:
+ *  - id: id of the snapshot, in use by the caller
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to store its type
+ *  - dir: pointer to store its entries, if a directory
+ *  - copied: set if *dir is a private copy the caller must destroy
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+static int inode_snapshot_get(unsigned long id, int inumber, type *nType, Directory **dir, int *copied) {
+    inode_t *inode = INODE(inumber);
+
+    while (1) {
+        unsigned int seq;
+        union Data data;
+
+        epoch_enter();
+        seq = inode_read_begin(inumber);
+        if (__atomic_load_n(&inode->snap_id, __ATOMIC_ACQUIRE) == id) {
+            /* changed since, the saved fields never change again */
+            epoch_exit();
+            *nType = inode->snap_type;
+            *dir = inode->snap_directory;
+            *copied = 0;
+            return SUCCESS;
+        }
+        /* not changed since the snapshot, as long as seq holds */
+        inode_get_optimistic(inumber, nType, &data);
+        *dir = NULL;
+        if (!inode_read_retry(inumber, seq) && *nType == T_DIRECTORY) {
+            if ((*dir = directory_copy(data.directory)) == NULL) {
+                epoch_exit();
+                return FAIL;
+            }
+        }
+        if (!inode_read_retry(inumber, seq)) {
+            epoch_exit();
+            *copied = *dir != NULL;
+            return SUCCESS;
+        }
+        directory_destroy(*dir);
+        epoch_exit();
+    }
+}
+
+/*
+ * Prints the tree of a snapshot, while the live tree may change.
+ * Input:
+ *  - fp: output file
+ *  - id: id of the snapshot, in use by the caller
+ *  - inumber: identifier of the i-node
+ *  - name: pointer to the name of current file/dir
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+int inode_snapshot_print(FILE *fp, unsigned long id, int inumber, char *name) {
+    type nType;
+    Directory *dir;
+    int copied, res = SUCCESS;
+
+    if (inode_snapshot_get(id, inumber, &nType, &dir, &copied) == FAIL)
+        return FAIL;
+    if (nType == T_FILE || nType == T_DIRECTORY)
+        fprintf(fp, "%s\n", name);
+    if (dir != NULL) {
+        DirEntry *entries = DIR_ENTRIES(dir);
+        for (int i = 0; i < dir->capacity && res == SUCCESS; i++) {
+            if (entries[i].inumber != FREE_INODE) {
+                char path[MAX_PATH_SIZE];
+                if (snprintf(path, sizeof(path), "%s/%s", name, DIR_ENTRY_NAME(entries, i)) > (long) sizeof(path)) {
+                    fprintf(stderr, "truncation when building full path\n");
+                }
+                res = inode_snapshot_print(fp, id, entries[i].inumber, path);
+            }
+        }
+    }
+    if (copied)
+        directory_destroy(dir);
+    return res;
+}
+
+/*
+ * Starts a depth-first walk of a snapshot.
+ * Input:
+ *  - cursor: the walk
+ *  - id: id of the snapshot
+ */
+void inode_snapshot_cursor_init(SnapshotCursor *cursor, unsigned long id) {
+    cursor->id = id;
+    cursor->frames = NULL;
+    cursor->depth = 0;
+    cursor->capacity = 0;
+    cursor->started = 0;
+    cursor->inumber = FREE_INODE;
+}
+
+/*
+ * Enters a directory of the walk.
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+static int cursor_push(SnapshotCursor *cursor, Directory *dir, int copied) {
+    if (cursor->depth == cursor->capacity) {
+        int capacity = cursor->capacity > 0 ? cursor->capacity * 2 : 16;
+        SnapshotFrame *frames = realloc(cursor->frames, sizeof(SnapshotFrame) * capacity);
+        if (frames == NULL)
+            return FAIL;
+        cursor->frames = frames;
+        cursor->capacity = capacity;
+    }
+    cursor->frames[cursor->depth].dir = dir;
+    cursor->frames[cursor->depth].copied = copied;
+    cursor->frames[cursor->depth].slot = 0;
+    cursor->depth++;
+    return SUCCESS;
+}
+
+/*
+ * Leaves the innermost directory of the walk.
+ */
+static void cursor_pop(SnapshotCursor *cursor) {
+    SnapshotFrame *frame = &cursor->frames[--cursor->depth];
+    if (frame->copied)
+        directory_destroy(frame->dir);
+}
+
+/*
+ * Visits the next node of a walk, in the order of inode_print_tree: a
+ * directory comes right before its subtree. The snapshot must be in use.
+ * Its i-number is left in cursor->inumber.
+ * Input:
+ *  - cursor: the walk
+ *  - nType: pointer to store the type of the node
+ *  - depth: pointer to store its depth (0 for the root)
+ *  - name: pointer to store its name, valid until the next call
+ * Returns: 1 if a node was visited, 0 at the end, or FAIL if out of memory
+ *  (the node can be visited again)
+ */
+int inode_snapshot_next(SnapshotCursor *cursor, type *nType, int *depth, const char **name) {
+    Directory *dir;
+    int copied;
+
+    if (!cursor->started) {
+        if (inode_snapshot_get(cursor->id, FS_ROOT, nType, &dir, &copied) == FAIL)
+            return FAIL;
+        if (cursor_push(cursor, dir, copied) == FAIL) {
+            if (copied)
+                directory_destroy(dir);
+            return FAIL;
+        }
+        cursor->started = 1;
+        cursor->inumber = FS_ROOT;
+        *depth = 0;
+        *name = "";
+        return 1;
+    }
+    while (cursor->depth > 0) {
+        SnapshotFrame *frame = &cursor->frames[cursor->depth - 1];
+        DirEntry *entries;
+        int parent, slot;
+
+        while (frame->slot < frame->dir->capacity &&
+               DIR_ENTRIES(frame->dir)[frame->slot].inumber == FREE_INODE)
+            frame->slot++;
+        if (frame->slot == frame->dir->capacity) {
+            cursor_pop(cursor);
+            continue;
+        }
+        /* the slot array stays put, unlike frame if the stack grows */
+        entries = DIR_ENTRIES(frame->dir);
+        slot = frame->slot;
+        if (inode_snapshot_get(cursor->id, entries[slot].inumber, nType, &dir, &copied) == FAIL)
+            return FAIL;
+        if (dir != NULL && cursor_push(cursor, dir, copied) == FAIL) {
+            if (copied)
+                directory_destroy(dir);
+            return FAIL;
+        }
+        /* the parent frame may have moved if the stack grew */
+        parent = dir != NULL ? cursor->depth - 2 : cursor->depth - 1;
+        cursor->frames[parent].slot++;
+        *depth = parent + 1;
+        *name = DIR_ENTRY_NAME(entries, slot);
+        cursor->inumber = entries[slot].inumber;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Ends a walk, releasing the copies it holds.
+ * Input:
+ *  - cursor: the walk
+ */
+void inode_snapshot_cursor_release(SnapshotCursor *cursor) {
+    while (cursor->depth > 0)
+        cursor_pop(cursor);
+    free(cursor->frames);
+    cursor->frames = NULL;
+    cursor->capacity = 0;
+}
@@ -5,45 +5,101 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include "../tecnicofs-api-constants.h"
+#include "directory.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+
+/*
+ * The i-node table is split in segments that are allocated on demand.
+ * An i-number maps to segment (inumber >> INODE_SEGMENT_SHIFT) and slot
+ * (inumber & INODE_SEGMENT_MASK), so segments never move once published.
+ */
+#define INODE_SEGMENT_SHIFT 10
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_SHIFT)
+#define INODE_SEGMENT_MASK (INODE_SEGMENT_SIZE - 1)
+#define MAX_INODE_SEGMENTS (1 << 16)
 
 #define SUCCESS 0
 #define FAIL -1
 
+/* Busy loop of every i-node access, overridden with -DDELAY=0 to time real costs */
+#ifndef DELAY
 #define DELAY 5000000
+#endif
 
+/* Seconds a snapshot left unused is kept before another may replace it */
+#define SNAPSHOT_LEASE 5
+
+/* Locks a thread holds at once whose hold time is measured */
+#define LOCK_PROFILE_HELD 8
 
-/*
- * Contains the name of the entry and respective i-number
- */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either text (file) or entries (Directory)
  */
 union Data {
 	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	Directory *directory; /* for directories */
 };
 
 /*
- * I-node definition
+ * I-node definition. Each i-node takes whole cache lines of its own, so
+ * locking or changing one never evicts its neighbours from other cores:
+ * the fields read by lock-free lookups, the lock, written by every lock
+ * and unlock, and the fields of the free list and snapshots each start a
+ * line.
  */
 typedef struct inode_t {    
+    unsigned int seq; /* odd while the i-node or its entries are being changed */
 	type nodeType;
-	union Data data;
-    pthread_rwlock_t lock;
+	relptr data; /* the union Data, self-relative so the table can be mapped */
+    unsigned int generation; /* incremented every time the i-node is deleted */
+    int parent; /* directory with the entry of the i-node, FREE_INODE for the root */
+    unsigned int name_hash; /* dir_hash_name of that entry, to find it in the parent */
+    unsigned long moved; /* dcache rename sequence of its last move, 0 if never moved */
+    pthread_rwlock_t lock __attribute__((aligned(64)));
+    int nextFree __attribute__((aligned(64))); /* next i-number in the free list, while T_NONE */
+    unsigned long snap_id; /* snapshot the fields below were saved for */
+    type snap_type; /* type when the snapshot was taken */
+    Directory *snap_directory; /* copy of the entries when the snapshot was taken */
+    int snap_next; /* next i-node on the list of saved ones */
     /* more i-node attributes will be added in future exercises */
-} inode_t;
+} __attribute__((aligned(64))) inode_t;
+
+/*
+ * Directory being walked by a SnapshotCursor.
+ */
+typedef struct snapshot_frame {
+	Directory *dir;
+	int copied; /* dir is a private copy */
+	int slot; /* next slot to visit */
+} SnapshotFrame;
+
+/*
+ * Depth-first walk of a snapshot, see inode_snapshot_next.
+ */
+typedef struct snapshot_cursor {
+	unsigned long id; /* snapshot walked */
+	SnapshotFrame *frames; /* directories entered, the innermost last */
+	int depth, capacity; /* frames in use and allocated */
+	int started;
+	int inumber; /* of the node visited last */
+} SnapshotCursor;
+
+/*
+ * Lock contention of an i-node, counted while lock profiling is on (see
+ * lock_profiling_enable) since the i-node was created.
+ */
+typedef struct lock_stats {
+	unsigned long acquisitions; /* by lock, or by a successful trylock */
+	unsigned long contended; /* lock calls that had to wait */
+	unsigned long wait_ns; /* spent waiting in lock */
+	unsigned long hold_ns; /* between acquiring and unlocking */
+	unsigned long trylock_failures;
+} lock_stats;
 
 /*
  * lock mode:
@@ -53,17 +109,39 @@ typedef struct inode_t {
 typedef enum lock_mode {LREAD, LWRITE} lock_mode;
 
 void insert_delay(int cycles);
+int inode_is_valid(int inumber);
 int lock(int inumber, lock_mode mode);
 int trylock(int inumber, lock_mode mode);
 int unlock(int inumber);
+int lock_profiling_enable();
+int lock_profiling_enabled();
+int lock_stats_top(int count, int inumbers[], lock_stats stats[]);
 int inode_table_init();
+void inode_table_adopt(inode_t *slots, int count, int used);
 void inode_table_destroy();
 int inode_create(type nType);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
+unsigned int inode_get_generation(int inumber);
+int inode_get_parent(int inumber, unsigned int *name_hash);
+unsigned long inode_get_moved(int inumber);
+void inode_set_moved(int inumber, unsigned long rename_seq);
+unsigned int inode_read_begin(int inumber);
+int inode_read_retry(int inumber, unsigned int seq);
+int inode_get_optimistic(int inumber, type *nType, union Data *data);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_reset_entry(int inumber, int sub_inumber, const DirName *sub_name);
+int dir_add_entry(int inumber, int sub_inumber, const DirName *sub_name);
 void inode_print_tree(FILE *fp, int inumber, char *name);
+int inode_snapshot_reserve(int wait);
+unsigned long inode_snapshot_begin();
+int inode_snapshot_taken(unsigned long id);
+int inode_snapshot_use(unsigned long id);
+void inode_snapshot_unuse(unsigned long id);
+int inode_snapshot_end(unsigned long id);
+int inode_snapshot_print(FILE *fp, unsigned long id, int inumber, char *name);
+void inode_snapshot_cursor_init(SnapshotCursor *cursor, unsigned long id);
+int inode_snapshot_next(SnapshotCursor *cursor, type *nType, int *depth, const char **name);
+void inode_snapshot_cursor_release(SnapshotCursor *cursor);
 
 #endif /* INODES_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -11,15 +12,50 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
 #include "fs/operations.h"
+#include "fs/checkpoint.h"
+#include "fs/log.h"
+#include "server.h"
+#include "wal.h"
+#include "metrics.h"
 
-#define MAX_INPUT_SIZE 100
-#define MAX_DEPTH 10
 #define MAX_SOCKET_PATH 100
 
 int numberThreads = 0;
 pthread_t *tid_arr;
 
+/* I/O threads draining the socket, 0 if every worker receives by itself */
+int numberIOThreads = 0;
+pthread_t *io_tid_arr;
+transport_type transport = TRANSPORT_DGRAM;
+/* I/O threads use io_uring instead of recvmmsg and sendmmsg */
+int useUring = 0;
+/* write-ahead log of the mutations, NULL for none */
+char *walPath = NULL;
+wal_sync walPolicy = WAL_SYNC_GROUP;
+/* checkpoint image, NULL for none, and seconds between checkpoints */
+char *checkpointPath = NULL;
+int checkpointInterval = CHECKPOINT_INTERVAL;
+/* count the lock contention of every i-node, for TFS_OP_LOCKS */
+int lockProfiling = 0;
+/* Prometheus file the latency histograms are written to, NULL for none */
+char *metricsPath = NULL;
+pthread_t checkpoint_tid;
+
+message *message_pool;
+io_thread *io_threads;
+Queue free_messages, requests;
+sem_t requests_ready;
+
+/* Counters reported by the stats command */
+unsigned long stat_messages = 0, stat_recv_calls = 0, stat_send_calls = 0;
+int stat_queue_max = 0, stat_connections = 0;
+
 int sockfd;
 socklen_t addrlen;
 struct sockaddr_un server_addr;
@@ -50,94 +86,283 @@ void unlockAll(int inodeWaitList[], int *len) {
 
 
 /*
- * Execute a command and store i-numbers corresponding to
- * locked nodes to unlock after command execution.
+ * Copies a path of a request to a '\0' terminated buffer.
  * Input:
- *  - command: string representation of a command
- * Returns: SUCCESS or FAIL
- */ 
-int applyCommands(char *command){
-    int inodeWaitList[MAX_DEPTH], res, len = 0;
-
-    if (command == NULL){
+ *  - dest: buffer with MAX_PATH_SIZE bytes
+ *  - src: path in the request
+ *  - len: length of the path
+ * Returns: SUCCESS or FAIL if the path does not fit or has a '\0'
+ */
+int copyPath(char *dest, const char *src, int len) {
+    if (len >= MAX_PATH_SIZE || memchr(src, '\0', len) != NULL)
         return FAIL;
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+    return SUCCESS;
+}
+
+
+/*
+ * Starts a create or delete, or with exclusive set a move: see
+ * checkpoint_mutation_begin and fs_mutation_begin.
+ * Input:
+ *  - exclusive: set for a move
+ */
+void beginMutation(int exclusive) {
+    checkpoint_mutation_begin();
+    fs_mutation_begin(exclusive);
+}
+
+
+/*
+ * Ends a create, delete or move started with beginMutation: logs it if it
+ * succeeded, while its i-nodes are still locked and no other mutation its
+ * paths depend on can run, and unlocks them.
+ * Input:
+ *  - request: the request
+ *  - res: result of the operation
+ *  - inodeWaitList: array of locked i-numbers
+ *  - len: number of i-numbers in the array
+ * Returns: res
+ */
+int endMutation(tfs_request *request, int res, int inodeWaitList[], int *len) {
+    if (res == SUCCESS)
+        wal_append(request);
+    fs_mutation_end();
+    checkpoint_mutation_end();
+    unlockAll(inodeWaitList, len);
+    return res;
+}
+
+
+/*
+ * Executes a print request, whose path is a file of the host rather
+ * than a path of the tree.
+ * Input:
+ *  - request: decoded request
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */
+int executePrint(tfs_request *request) {
+    char name[MAX_PATH_SIZE];
+
+    if (copyPath(name, request->path, request->header.path_len) == FAIL) {
+        fprintf(stderr, "Error: invalid path in request\n");
+        return TECNICOFS_ERROR_OTHER;
     }
-    char token, type;
-    char name[MAX_INPUT_SIZE], name2[MAX_INPUT_SIZE];
-    int numTokens = sscanf(command, "%c %s %s", &token, name, name2);
-    if (numTokens < 2) {
-        fprintf(stderr, "Error: invalid command in Queue\n");
-        exit(EXIT_FAILURE);
+    log_printf(LOG_TRACE, "Print: %s\n", name);
+    return printFS(name);
+}
+
+
+/*
+ * Execute a request and store i-numbers corresponding to
+ * locked nodes to unlock after command execution. Mutations are appended
+ * to the write-ahead log before their locks are released (see
+ * endMutation), the caller commits them with wal_commit before replying.
+ * Input:
+ *  - request: decoded request
+ *  - value: pointer to store the result of the operation
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */ 
+int executeCommands(tfs_request *request, int *value){
+    int inodeWaitList[MAX_LOCKED], res, len = 0;
+    /* parsed once from the request, every step of the operation reuses the components */
+    Path path, path2;
+
+    *value = 0;
+    if (request->header.opcode == TFS_OP_PRINT)
+        return executePrint(request);
+    if (path_parse(&path, request->path, request->header.path_len) == FAIL) {
+        fprintf(stderr, "Error: invalid path in request\n");
+        return TECNICOFS_ERROR_OTHER;
     }
 
     int searchResult;
-    switch (token) {
-        case 'c':
-            type = name2[0];
-            switch (type) {
+    switch (request->header.opcode) {
+        case TFS_OP_CREATE:
+            switch (request->header.node_type) {
                 case 'f':
-                    printf("Create file: %s\n", name);
-                    res = create(name, T_FILE, inodeWaitList, &len);
-                    unlockAll(inodeWaitList, &len);
-                    return res;
+                    log_printf(LOG_TRACE, "Create file: %s\n", path.key);
+                    beginMutation(0);
+                    res = create(&path, T_FILE, inodeWaitList, &len);
+                    res = endMutation(request, res, inodeWaitList, &len);
+                    break;
                 case 'd':
-                    printf("Create directory: %s\n", name);
-                    res = create(name, T_DIRECTORY, inodeWaitList, &len);
-                    unlockAll(inodeWaitList, &len);
-                    return res;
+                    log_printf(LOG_TRACE, "Create directory: %s\n", path.key);
+                    beginMutation(0);
+                    res = create(&path, T_DIRECTORY, inodeWaitList, &len);
+                    res = endMutation(request, res, inodeWaitList, &len);
+                    break;
                 default:
                     fprintf(stderr, "Error: invalid node type\n");
-                    exit(EXIT_FAILURE);
+                    res = TECNICOFS_ERROR_OTHER;
             }
             break;
-        case 'l': 
-            searchResult = lookup(name, inodeWaitList, &len, 0);
-            unlockAll(inodeWaitList, &len);
-            if (searchResult >= 0)
-                printf("Search: %s found\n", name);
-            else
-                printf("Search: %s not found\n", name);
-            return searchResult;
-        case 'd':
-            printf("Delete: %s\n", name);
-            res = delete(name, inodeWaitList, &len);
+        case TFS_OP_LOOKUP: 
+            searchResult = lookup_optimistic(&path, inodeWaitList, &len);
             unlockAll(inodeWaitList, &len);
-            return res;
-        case 'm':
-            printf("Move: %s %s\n", name, name2);
-            res = move(name, name2, inodeWaitList, &len);
-            unlockAll(inodeWaitList, &len);
-            return res;
-        case 'p':
-            printf("Print: %s", name);
-            res = printFS(name);
-            return res;
+            if (searchResult >= 0) {
+                log_printf(LOG_TRACE, "Search: %s found\n", path.key);
+                *value = searchResult;
+                res = SUCCESS;
+            } else {
+                log_printf(LOG_TRACE, "Search: %s not found\n", path.key);
+                res = TECNICOFS_ERROR_FILE_NOT_FOUND;
+            }
+            break;
+        case TFS_OP_DELETE:
+            log_printf(LOG_TRACE, "Delete: %s\n", path.key);
+            beginMutation(0);
+            res = delete(&path, inodeWaitList, &len);
+            res = endMutation(request, res, inodeWaitList, &len);
+            break;
+        case TFS_OP_MOVE:
+            if (path_parse(&path2, request->path2, request->header.path2_len) == FAIL) {
+                fprintf(stderr, "Error: invalid path in request\n");
+                res = TECNICOFS_ERROR_OTHER;
+                break;
+            }
+            log_printf(LOG_TRACE, "Move: %s %s\n", path.key, path2.key);
+            beginMutation(1);
+            res = move(&path, &path2, inodeWaitList, &len);
+            res = endMutation(request, res, inodeWaitList, &len);
+            path_release(&path2);
+            break;
         default: { /* error */
             fprintf(stderr, "Error: command to apply\n");
-            exit(EXIT_FAILURE);
+            res = TECNICOFS_ERROR_OTHER;
         }
     }
-    return FAIL;
+    path_release(&path);
+    return res;
+}
+
+/*
+ * Executes a request received from a client (see executeCommands) and
+ * records its latency in the histogram of its opcode.
+ * Input:
+ *  - request: decoded request
+ *  - value: pointer to store the result of the operation
+ * Returns: SUCCESS or a TECNICOFS_ERROR_* code
+ */
+int applyCommands(tfs_request *request, int *value) {
+    uint64_t start = metrics_now();
+    int res = executeCommands(request, value);
+
+    metrics_record(request->header.opcode, start, res == SUCCESS);
+    return res;
 }
 
 
 /*
  * Parses arguments from stdin: number of threads to be used and socket name for server socket
+ * Usage: tecnicofs [-i ioThreads] [-t dgram|stream] [-u] [-l logfile] [-f none|interval|group] [-c image] [-C seconds] [-p] [-m metricsfile] [-q level] numberThreads socketname
+ *  - -i: number of I/O threads receiving for the workers (default 0, each
+ *    worker receives its own requests)
+ *  - -t: socket type, datagrams (default) or stream connections, which
+ *    need at least one I/O thread
+ *  - -u: datagram I/O threads use io_uring, at least one is started
+ *  - -l: write-ahead log, replayed on startup and appended with every
+ *    successful create, delete and move
+ *  - -f: when logged mutations are fsync'ed: never, every
+ *    WAL_SYNC_INTERVAL_MS, or before replying (default, group commit)
+ *  - -c: checkpoint image, loaded on startup (then the log is replayed
+ *    from where it ends) and rewritten periodically
+ *  - -C: seconds between checkpoints (default CHECKPOINT_INTERVAL)
+ *  - -p: profiles the lock of every i-node, see applyLockStats
+ *  - -m: file the latency histograms of every opcode are written to,
+ *    every METRICS_INTERVAL seconds, in the Prometheus text format
+ *  - -q: most verbose lines logged, none, error, failure or trace
+ *    (default, every request)
  * Input:
  *  - argc: number of arguments
  *  - argv: the arguments
  *  - socketname: name for the server's socket
  */
 void args(int argc, char *argv[], char *socketname) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:t:ul:f:c:C:pm:q:")) != -1) {
+        switch (opt) {
+            case 'i':
+                if ((numberIOThreads = atoi(optarg)) < 0 || numberIOThreads > IO_BATCH) {
+                    fprintf(stderr,"ERROR: number of I/O threads must be between 0 and %d\n", IO_BATCH);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "dgram") == 0)
+                    transport = TRANSPORT_DGRAM;
+                else if (strcmp(optarg, "stream") == 0)
+                    transport = TRANSPORT_STREAM;
+                else {
+                    fprintf(stderr,"ERROR: transport must be dgram or stream\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                useUring = 1;
+                break;
+            case 'l':
+                walPath = optarg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "none") == 0)
+                    walPolicy = WAL_SYNC_NONE;
+                else if (strcmp(optarg, "interval") == 0)
+                    walPolicy = WAL_SYNC_INTERVAL;
+                else if (strcmp(optarg, "group") == 0)
+                    walPolicy = WAL_SYNC_GROUP;
+                else {
+                    fprintf(stderr,"ERROR: fsync policy must be none, interval or group\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                checkpointPath = optarg;
+                break;
+            case 'C':
+                if ((checkpointInterval = atoi(optarg)) <= 0) {
+                    fprintf(stderr,"ERROR: checkpoint interval must be a positive integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                lockProfiling = 1;
+                break;
+            case 'm':
+                metricsPath = optarg;
+                break;
+            case 'q':
+                if (log_parse_level(optarg, &log_threshold) == FAIL) {
+                    fprintf(stderr,"ERROR: log level must be none, error, failure or trace\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i ioThreads] [-t dgram|stream] [-u] [-l logfile] [-f none|interval|group] [-c image] [-C seconds] [-p] [-m metricsfile] [-q level] numberThreads socketname\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (useUring && transport == TRANSPORT_STREAM) {
+        fprintf(stderr,"ERROR: io_uring is only supported for datagrams\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((transport == TRANSPORT_STREAM || useUring) && numberIOThreads == 0)
+        numberIOThreads = 1;
+    if (argc - optind != 2) {
         fprintf(stderr, "ERROR: invalid argument number\n");
         exit(EXIT_FAILURE);
     }
-    if ((numberThreads = atoi(argv[1])) <= 0) {
+    if ((numberThreads = atoi(argv[optind])) <= 0) {
         fprintf(stderr,"ERROR: number of threads must be a positive integer\n");
         exit(EXIT_FAILURE);
     }
-    strcpy(socketname, argv[2]);
+    if (strlen(argv[optind + 1]) >= MAX_SOCKET_PATH) {
+        fprintf(stderr,"ERROR: socket name too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(socketname, argv[optind + 1]);
 }
 
 
@@ -183,29 +408,186 @@ void createSocket(char * path) {
 }
 
 
+/*
+ * Executes every request of a batch and builds a single reply holding
+ * one reply header per request.
+ * Input:
+ *  - message: received batch
+ *  - length: size of the batch
+ *  - response: buffer with TFS_MAX_MESSAGE bytes for the reply
+ * Returns: size of the reply, or FAIL if the batch header is malformed
+ */
+int applyBatch(char *message, int length, char *response) {
+    tfs_batch_header batch;
+    tfs_request_header header;
+    tfs_request request;
+    int offset, n, res, value, done, status = SUCCESS;
+    char *replies = response + sizeof(tfs_reply_header);
+
+    if ((offset = tfs_decode_batch(message, length, &batch)) < 0)
+        return FAIL;
+    for (done = 0; done < batch.count; done++) {
+        if ((n = tfs_decode_request(message + offset, length - offset, &request)) < 0) {
+            fprintf(stderr, "Error: malformed request in batch\n");
+            status = TECNICOFS_ERROR_OTHER;
+            break;
+        }
+        offset += n;
+        res = applyCommands(&request, &value);
+        replies += tfs_encode_reply(replies, &request.header, res, value, 0);
+    }
+    header.opcode = TFS_OP_BATCH;
+    header.request_id = batch.request_id;
+    tfs_encode_reply(response, &header, status, done, done * sizeof(tfs_reply_header));
+    return replies - response;
+}
+
+
+/*
+ * Writes the server counters as "name value" lines.
+ * Input:
+ *  - buffer: where to write
+ *  - size: size of the buffer
+ * Returns: number of bytes written
+ */
+int applyStats(char *buffer, int size) {
+    int n = snprintf(buffer, size,
+                     "tecnicofs_messages_received_total %lu\n"
+                     "tecnicofs_recv_calls_total %lu\n"
+                     "tecnicofs_send_calls_total %lu\n"
+                     "tecnicofs_uring_enter_calls_total %lu\n"
+                     "tecnicofs_io_threads %d\n"
+                     "tecnicofs_connections %d\n"
+                     "tecnicofs_request_queue_capacity %d\n"
+                     "tecnicofs_request_queue_depth %d\n"
+                     "tecnicofs_request_queue_depth_max %d\n",
+                     __atomic_load_n(&stat_messages, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_recv_calls, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_send_calls, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_uring_enters, __ATOMIC_RELAXED),
+                     numberIOThreads,
+                     __atomic_load_n(&stat_connections, __ATOMIC_RELAXED),
+                     numberIOThreads > 0 ? MESSAGE_POOL_SIZE : 0,
+                     numberIOThreads > 0 ? queue_depth(&requests) : 0,
+                     __atomic_load_n(&stat_queue_max, __ATOMIC_RELAXED));
+    if (n < size)
+        n += metrics_stats(buffer + n, size - n);
+    return n < size ? n : size - 1;
+}
+
+
+/*
+ * Writes the most contended i-nodes, with their lock counters and paths.
+ * Input:
+ *  - request: TFS_OP_LOCKS request, with the number of i-nodes as path
+ *  - buffer: where to write
+ *  - size: size of the buffer
+ * Returns: number of bytes written, or TECNICOFS_ERROR_OTHER if the
+ *  locks are not profiled or the request is invalid
+ */
+int applyLockStats(tfs_request *request, char *buffer, int size) {
+    int inumbers[TFS_MAX_LOCK_REPORT], count, n, found;
+    lock_stats stats[TFS_MAX_LOCK_REPORT];
+    char number[MAX_PATH_SIZE], *end;
+    char (*paths)[MAX_PATH_SIZE];
+    char *path_ptrs[TFS_MAX_LOCK_REPORT];
+
+    if (!lock_profiling_enabled() ||
+        copyPath(number, request->path, request->header.path_len) == FAIL)
+        return TECNICOFS_ERROR_OTHER;
+    count = strtol(number, &end, 10);
+    if (*end != '\0' || count <= 0 || count > TFS_MAX_LOCK_REPORT)
+        return TECNICOFS_ERROR_OTHER;
+    if ((paths = malloc(sizeof(*paths) * count)) == NULL)
+        return TECNICOFS_ERROR_OTHER;
+    found = lock_stats_top(count, inumbers, stats);
+    for (int i = 0; i < found; i++)
+        path_ptrs[i] = paths[i];
+    /* paths are left empty for i-nodes deleted since, or moved meanwhile */
+    find_paths(inumbers, path_ptrs, found);
+
+    n = snprintf(buffer, size, "inumber acquisitions contended wait_us hold_us trylock_failures path\n");
+    for (int i = 0; i < found && n < size; i++) {
+        n += snprintf(buffer + n, size - n, "%d %lu %lu %lu %lu %lu %s\n", inumbers[i],
+                      stats[i].acquisitions, stats[i].contended, stats[i].wait_ns / 1000,
+                      stats[i].hold_ns / 1000, stats[i].trylock_failures,
+                      paths[i][0] != '\0' ? paths[i] : "?");
+    }
+    free(paths);
+    return n < size ? n : size - 1;
+}
+
+
+/*
+ * Executes a received message, a single request or a batch.
+ * Input:
+ *  - message: received bytes
+ *  - length: number of received bytes
+ *  - response: buffer with TFS_MAX_MESSAGE bytes for the reply
+ * Returns: size of the reply, or FAIL if the message is malformed
+ */
+int applyMessage(char *message, int length, char *response) {
+    tfs_request request;
+    int res, value;
+
+    if (tfs_peek_opcode(message, length) == TFS_OP_BATCH) {
+        /* a single commit for the whole batch */
+        res = applyBatch(message, length, response);
+        wal_commit();
+        return res;
+    }
+    if (tfs_decode_request(message, length, &request) < 0)
+        return FAIL;
+    if (request.header.opcode == TFS_OP_DUMP)
+        return applyDump(&request, response);
+    if (request.header.opcode == TFS_OP_STATS) {
+        int hlen = sizeof(tfs_reply_header);
+        int n = applyStats(response + hlen, TFS_MAX_MESSAGE - hlen);
+        return tfs_encode_reply(response, &request.header, SUCCESS, 0, n) + n;
+    }
+    if (request.header.opcode == TFS_OP_LOCKS) {
+        int hlen = sizeof(tfs_reply_header);
+        int n = applyLockStats(&request, response + hlen, TFS_MAX_MESSAGE - hlen);
+        if (n < 0)
+            return tfs_encode_reply(response, &request.header, n, 0, 0);
+        return tfs_encode_reply(response, &request.header, SUCCESS, 0, n) + n;
+    }
+    res = applyCommands(&request, &value);
+    wal_commit();
+    return tfs_encode_reply(response, &request.header, res, value, 0);
+}
+
+
 /*
  * Infinite loop that waits for a client request corresponding to a command
- * Protocol:
- *  - Receives: string representing a command to be executed
- *  - Responds: SUCCESS or FAIL
+ * Protocol (see tecnicofs-protocol.h):
+ *  - Receives: a tfs_request_header followed by its paths, or a batch
+ *  - Responds: a tfs_reply_header with the status and value of the
+ *    operation, or of every operation of the batch
  */
 void socketOn() {
     struct sockaddr_un client_addr;
-    char command[MAX_INPUT_SIZE], response[3];
-    int n, res;
+    socklen_t client_addrlen;
+    char command[TFS_MAX_MESSAGE], response[TFS_MAX_MESSAGE];
+    int n;
 
     while (1) {
-        addrlen=sizeof(struct sockaddr_un);
-        n = recvfrom(sockfd, command, sizeof(command)-1, 0, (struct sockaddr *)&client_addr, &addrlen);
+        client_addrlen = sizeof(struct sockaddr_un);
+        n = recvfrom(sockfd, command, sizeof(command), 0, (struct sockaddr *)&client_addr, &client_addrlen);
+        __atomic_add_fetch(&stat_recv_calls, 1, __ATOMIC_RELAXED);
         if (n <= 0) {
             fprintf(stderr,"socketOn: recvfrom error\n");
             continue;
         }
-        command[n] = '\0';
-        res = applyCommands(command);
-        sprintf(response, "%d", res);
-        response[2] = '\0';
-        if (sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&client_addr, addrlen) < 0) {
+        __atomic_add_fetch(&stat_messages, 1, __ATOMIC_RELAXED);
+        /* received by this thread, nothing to wait for */
+        metrics_received(0);
+        if ((n = applyMessage(command, n, response)) < 0) {
+            fprintf(stderr,"socketOn: malformed request\n");
+            continue;
+        }
+        __atomic_add_fetch(&stat_send_calls, 1, __ATOMIC_RELAXED);
+        if (sendto(sockfd, response, n, 0, (struct sockaddr *)&client_addr, client_addrlen) < 0) {
             fprintf(stderr,"socketOn: sendto error\n");
             continue;
         }
@@ -214,12 +596,245 @@ void socketOn() {
 
 
 /*
- * Allocates memory and initializes the threads that will execute the commands.
+ * Worker of the I/O thread mode: executes the requests queued by the
+ * I/O threads and hands each reply back to the thread that received it.
+ */
+void worker() {
+    message *m;
+    io_thread *io;
+
+    while (1) {
+        while (sem_wait(&requests_ready) != 0);
+        /* the semaphore counts published requests, but the head one may
+         * still be finishing its push */
+        while ((m = queue_pop(&requests)) == NULL)
+            sched_yield();
+        metrics_received(m->received);
+        m->length = applyMessage(m->request, m->length, m->response);
+        if (m->length < 0)
+            fprintf(stderr,"worker: malformed request\n");
+        io = &io_threads[m->io];
+        queue_push(&io->replies, m);
+        if (__atomic_exchange_n(&io->sleeping, 0, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(io->eventfd, &one, sizeof(one)) < 0)
+                fprintf(stderr,"worker: eventfd write error\n");
+        }
+    }
+}
+
+
+/*
+ * Queues a received request for the workers.
+ * Input:
+ *  - m: message holding the request
+ */
+void queueRequest(message *m) {
+    int depth;
+
+    m->received = metrics_now();
+    queue_push(&requests, m);
+    __atomic_add_fetch(&stat_messages, 1, __ATOMIC_RELAXED);
+    depth = queue_depth(&requests);
+    if (depth > __atomic_load_n(&stat_queue_max, __ATOMIC_RELAXED))
+        __atomic_store_n(&stat_queue_max, depth, __ATOMIC_RELAXED);
+    sem_post(&requests_ready);
+}
+
+
+/*
+ * Sends every reply queued for an I/O thread, IO_BATCH per sendmmsg, and
+ * returns their messages to the pool.
+ * Input:
+ *  - io: the I/O thread
+ * Returns: number of messages recycled
+ */
+int ioSendReplies(io_thread *io) {
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec iov[IO_BATCH];
+    message *batch[IO_BATCH], *m;
+    int n = 0, sent, done = 0, total = 0;
+
+    while (1) {
+        while (n < IO_BATCH && (m = queue_pop(&io->replies)) != NULL) {
+            if (m->length < 0) {
+                queue_push(&free_messages, m);
+                total++;
+                continue;
+            }
+            iov[n].iov_base = m->response;
+            iov[n].iov_len = m->length;
+            memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[n].msg_hdr.msg_name = &m->addr;
+            msgs[n].msg_hdr.msg_namelen = m->addrlen;
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            batch[n++] = m;
+        }
+        if (n == 0)
+            return total;
+        for (done = 0; done < n; done += sent) {
+            __atomic_add_fetch(&stat_send_calls, 1, __ATOMIC_RELAXED);
+            if ((sent = sendmmsg(sockfd, msgs + done, n - done, 0)) <= 0) {
+                /* drop the reply that failed, e.g. its client is gone */
+                fprintf(stderr,"ioThread: sendmmsg error\n");
+                sent = 1;
+            }
+        }
+        for (int i = 0; i < n; i++)
+            queue_push(&free_messages, batch[i]);
+        total += n;
+        n = 0;
+    }
+}
+
+
+/*
+ * Receives up to IO_BATCH datagrams with a single recvmmsg and queues
+ * them for the workers.
+ * Input:
+ *  - index: index of the I/O thread
+ *  - spare: free messages owned by the I/O thread
+ *  - nspare: number of free messages, updated
+ * Returns: number of datagrams queued
+ */
+int ioReceive(int index, message *spare[], int *nspare) {
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec iov[IO_BATCH];
+    int n;
+
+    for (int i = 0; i < *nspare; i++) {
+        message *m = spare[*nspare - 1 - i];
+        iov[i].iov_base = m->request;
+        iov[i].iov_len = TFS_MAX_MESSAGE;
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &m->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    __atomic_add_fetch(&stat_recv_calls, 1, __ATOMIC_RELAXED);
+    n = recvmmsg(sockfd, msgs, *nspare, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            fprintf(stderr,"ioThread: recvmmsg error\n");
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        message *m = spare[--*nspare];
+        m->length = msgs[i].msg_len;
+        m->addrlen = msgs[i].msg_hdr.msg_namelen;
+        m->io = index;
+        m->conn = NULL;
+        queueRequest(m);
+    }
+    return n;
+}
+
+
+/*
+ * Loop of an I/O thread: drains the socket with recvmmsg into the
+ * request queue and sends the replies of its requests with sendmmsg.
+ * It sleeps in poll when there is nothing to receive or send, and
+ * stops receiving while every message of the pool is in use.
+ * Input:
+ *  - arg: index of the I/O thread
+ */
+void *ioThread(void *arg) {
+    int index = (int) (long) arg;
+    io_thread *io = &io_threads[index];
+    message *spare[IO_BATCH], *m;
+    int nspare = 0, progress, received, readable = 1;
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    while (1) {
+        progress = ioSendReplies(io);
+        while (nspare < IO_BATCH && (m = queue_pop(&free_messages)) != NULL)
+            spare[nspare++] = m;
+        /* a short recvmmsg drained the socket, wait for poll to say otherwise */
+        if (nspare > 0 && readable) {
+            received = nspare;
+            progress += ioReceive(index, spare, &nspare);
+            readable = received - nspare == received;
+        }
+        if (progress > 0)
+            continue;
+
+        /* a worker that queues a reply after this store will wake us */
+        __atomic_store_n(&io->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (queue_depth(&io->replies) > 0) {
+            __atomic_store_n(&io->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        pfd[0].fd = io->eventfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = sockfd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, nspare > 0 ? 2 : 1, -1) < 0 && errno != EINTR)
+            fprintf(stderr,"ioThread: poll error\n");
+        __atomic_store_n(&io->sleeping, 0, __ATOMIC_SEQ_CST);
+        readable = nspare > 0 && (pfd[1].revents & POLLIN);
+        if ((pfd[0].revents & POLLIN) && read(io->eventfd, &count, sizeof(count)) < 0)
+            fprintf(stderr,"ioThread: eventfd read error\n");
+    }
+    return NULL;
+}
+
+
+/*
+ * Allocates the message pool and queues of the I/O thread mode.
+ * Exit: EXIT_FAILURE on error
+ */
+void initIOThreads() {
+    message_pool = malloc(sizeof(message) * MESSAGE_POOL_SIZE);
+    io_threads = malloc(sizeof(io_thread) * numberIOThreads);
+    if (message_pool == NULL || io_threads == NULL ||
+        queue_init(&free_messages, MESSAGE_POOL_SIZE) == FAIL ||
+        queue_init(&requests, MESSAGE_POOL_SIZE) == FAIL ||
+        sem_init(&requests_ready, 0, 0) != 0) {
+        fprintf(stderr,"ERROR: unable to allocate the message pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MESSAGE_POOL_SIZE; i++)
+        queue_push(&free_messages, &message_pool[i]);
+    for (int i = 0; i < numberIOThreads; i++) {
+        io_threads[i].sleeping = 0;
+        if (queue_init(&io_threads[i].replies, MESSAGE_POOL_SIZE) == FAIL ||
+            (io_threads[i].eventfd = eventfd(0, 0)) < 0) {
+            fprintf(stderr,"ERROR: unable to create the I/O threads\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * Allocates memory and initializes the threads that will execute the commands,
+ * and the I/O threads feeding them if any.
  */
 void createThreadPool() {
+    void *(*routine)(void *) = (void*)socketOn;
+
+    if (numberIOThreads > 0) {
+        initIOThreads();
+        routine = (void*)worker;
+        io_tid_arr = (pthread_t*) malloc(sizeof(pthread_t) * (numberIOThreads));
+        for (int i = 0; i < numberIOThreads; i++) {
+            void *(*io_routine)(void *) = ioThread;
+            if (transport == TRANSPORT_STREAM)
+                io_routine = streamThread;
+            else if (useUring)
+                io_routine = uringThread;
+            if (pthread_create(&io_tid_arr[i], NULL, io_routine, (void *) (long) i) != 0) {
+                fprintf(stderr,"ERROR: unsuccessful thread creation\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
     tid_arr = (pthread_t*) malloc(sizeof(pthread_t) * (numberThreads));
     for (int i = 0; i < numberThreads; i++){
-        if (pthread_create((&tid_arr[i]), NULL, (void*)socketOn, NULL) != 0) {
+        if (pthread_create((&tid_arr[i]), NULL, routine, NULL) != 0) {
             fprintf(stderr,"ERROR: unsuccessful thread creation\n");
             exit(EXIT_FAILURE);
         }
@@ -238,6 +853,59 @@ void joinThreadPool() {
         }
     }
     free(tid_arr);
+    for (int i = 0; i < numberIOThreads; i++) {
+        if (pthread_join(io_tid_arr[i], NULL) != 0) {
+            fprintf(stderr,"ERROR: unsuccessful thread join\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(io_tid_arr);
+}
+
+
+/*
+ * Writes a checkpoint of the tree, then drops the log records it holds.
+ * Returns: SUCCESS, TECNICOFS_ERROR_BUSY if a dump holds the snapshot,
+ *  or FAIL
+ */
+int saveCheckpoint() {
+    unsigned long lsn, snapshot;
+
+    snapshot = checkpoint_cut(walPath != NULL ? wal_position : NULL, &lsn);
+    if (snapshot == 0)
+        return TECNICOFS_ERROR_BUSY;
+    /* the log must not end before an image that says it goes further */
+    wal_sync_to(lsn);
+    if (checkpoint_write(checkpointPath, snapshot, lsn) == FAIL) {
+        fprintf(stderr, "checkpoint: unable to write %s\n", checkpointPath);
+        return FAIL;
+    }
+    wal_discard(lsn);
+    return SUCCESS;
+}
+
+
+/*
+ * Writes a checkpoint every checkpointInterval seconds. One skipped while
+ * a dump holds the snapshot is retried every CHECKPOINT_RETRY seconds.
+ */
+void *checkpointThread() {
+    int delay = checkpointInterval, skipped = 0;
+
+    while (1) {
+        sleep(delay);
+        if (saveCheckpoint() == TECNICOFS_ERROR_BUSY) {
+            if (skipped++ == 0)
+                fprintf(stderr, "checkpoint: skipped, a dump holds the snapshot\n");
+            delay = CHECKPOINT_RETRY;
+            continue;
+        }
+        if (skipped > 0)
+            fprintf(stderr, "checkpoint: written after %d retries\n", skipped);
+        skipped = 0;
+        delay = checkpointInterval;
+    }
+    return NULL;
 }
 
 
@@ -252,12 +920,43 @@ void joinThreadPool() {
  */ 
 int main(int argc, char* argv[]) {
     char *socketname = malloc(sizeof(char) * MAX_SOCKET_PATH);
-    init_fs();
+    unsigned long lsn = 0;
     args(argc, argv, socketname);
-    createSocket(socketname);
+    if (checkpointPath != NULL && access(checkpointPath, F_OK) == 0) {
+        if (load_fs(checkpointPath, &lsn) == FAIL)
+            exit(EXIT_FAILURE);
+        printf("[CHECKPOINT] loaded %s\n", checkpointPath);
+    } else {
+        init_fs();
+    }
+    if (walPath != NULL && wal_open(walPath, walPolicy, lsn, executeCommands) == FAIL)
+        exit(EXIT_FAILURE);
+    if (lockProfiling && lock_profiling_enable() == FAIL) {
+        fprintf(stderr,"ERROR: cannot profile the locks\n");
+        exit(EXIT_FAILURE);
+    }
+    if (metricsPath != NULL && metrics_start(metricsPath) == FAIL) {
+        fprintf(stderr,"ERROR: cannot write the metrics\n");
+        exit(EXIT_FAILURE);
+    }
+    /* the replay of the log above is printed as it runs */
+    if (log_start() == FAIL) {
+        fprintf(stderr,"ERROR: unsuccessful thread creation\n");
+        exit(EXIT_FAILURE);
+    }
+    if (transport == TRANSPORT_STREAM)
+        createStreamSocket(socketname);
+    else
+        createSocket(socketname);
     createThreadPool();
+    if (checkpointPath != NULL && pthread_create(&checkpoint_tid, NULL, checkpointThread, NULL) != 0) {
+        fprintf(stderr,"ERROR: unsuccessful thread creation\n");
+        exit(EXIT_FAILURE);
+    }
     printf("[SERVER ON]\n");
     joinThreadPool();
+    log_stop();
+    wal_close();
     destroy_fs();    
     exit(EXIT_SUCCESS);
 }
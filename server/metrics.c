@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs/state.h"
+#include "metrics.h"
+
+/*
+ * Every thread that executes requests records their latencies in
+ * histograms of its own, with plain stores, and never takes a lock. The
+ * histograms of all threads are summed when the metrics are read: by a
+ * stats request, or by a background thread that periodically writes them
+ * to a file in the Prometheus text format.
+ */
+typedef struct metrics_thread {
+    metrics_histogram histograms[METRICS_OP_COUNT][METRICS_KINDS];
+    struct metrics_thread *next;
+} metrics_thread;
+
+static const char *metrics_op_names[METRICS_OP_COUNT] = {"create", "lookup", "delete", "move", "print"};
+static const char *metrics_result_names[METRICS_KINDS] = {NULL, "success", "failure"};
+
+/* histograms of every thread that recorded, pushed once per thread */
+static metrics_thread *metrics_threads = NULL;
+static __thread metrics_thread *metrics_self = NULL;
+/* when the request being executed by this thread was queued, 0 if unknown */
+static __thread uint64_t metrics_queued = 0;
+/* serializes the readers, which share the merged histograms */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_histogram metrics_merged[METRICS_OP_COUNT][METRICS_KINDS];
+static const char *metrics_path = NULL;
+static pthread_t metrics_tid;
+
+
+/*
+ * Returns: CLOCK_MONOTONIC time in ns
+ */
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Sets when the request this thread executes next was queued.
+ * Input:
+ *  - when: metrics_now() when it was queued, or 0 if unknown
+ */
+void metrics_received(uint64_t when) {
+    metrics_queued = when;
+}
+
+static int bucket_of(uint64_t value) {
+    int e;
+
+    if (value < METRICS_SUB)
+        return value;
+    e = 63 - __builtin_clzll(value);
+    return (e - METRICS_SUB_BITS + 1) * METRICS_SUB + ((value >> (e - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+}
+
+/*
+ * Returns: the lowest value counted by a bucket
+ */
+static uint64_t bucket_low(int bucket) {
+    int e = bucket / METRICS_SUB + METRICS_SUB_BITS - 1;
+
+    if (bucket < METRICS_SUB)
+        return bucket;
+    return (uint64_t) (METRICS_SUB + bucket % METRICS_SUB) << (e - METRICS_SUB_BITS);
+}
+
+/*
+ * Adds a value to a histogram only this thread writes. Readers may load
+ * the counters at any time, so each one is stored whole.
+ */
+static void histogram_add(metrics_histogram *histogram, uint64_t value) {
+    /* a value equal to a bound belongs to the bucket below it */
+    uint64_t *count = &histogram->counts[bucket_of(value > 0 ? value - 1 : 0)];
+
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records a request executed by this thread.
+ * Input:
+ *  - opcode: TFS_OP_* of the request
+ *  - start: metrics_now() when its execution started
+ *  - success: set if it succeeded
+ */
+void metrics_record(char opcode, uint64_t start, int success) {
+    const char *op = strchr(METRICS_OPS, opcode);
+    uint64_t end = metrics_now();
+    metrics_thread *self = metrics_self;
+
+    if (opcode == '\0' || op == NULL)
+        return;
+    if (self == NULL) {
+        if ((self = calloc(1, sizeof(metrics_thread))) == NULL)
+            return;
+        self->next = __atomic_load_n(&metrics_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metrics_threads, &self->next, self, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        metrics_self = self;
+    }
+    if (metrics_queued != 0 && metrics_queued <= start) {
+        histogram_add(&self->histograms[op - METRICS_OPS][METRICS_QUEUE], start - metrics_queued);
+        /* the next requests of a batch are timed from here */
+        metrics_queued = 0;
+    }
+    histogram_add(&self->histograms[op - METRICS_OPS][success ? METRICS_SUCCESS : METRICS_FAILURE], end - start);
+}
+
+/*
+ * Sums the histograms of every thread into metrics_merged. Called with
+ * metrics_lock held.
+ */
+static void metrics_merge() {
+    metrics_thread *thread = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE);
+
+    memset(metrics_merged, 0, sizeof(metrics_merged));
+    for (; thread != NULL; thread = thread->next) {
+        for (int op = 0; op < METRICS_OP_COUNT; op++) {
+            for (int kind = 0; kind < METRICS_KINDS; kind++) {
+                metrics_histogram *from = &thread->histograms[op][kind], *to = &metrics_merged[op][kind];
+                for (int i = 0; i < METRICS_BUCKETS; i++)
+                    to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+                to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static uint64_t histogram_count(const metrics_histogram *histogram) {
+    uint64_t count = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+        count += histogram->counts[i];
+    return count;
+}
+
+/*
+ * Returns: the value, in seconds, below which a fraction q of the values
+ *  of a histogram are (the middle of the bucket it falls in)
+ */
+static double histogram_quantile(const metrics_histogram *histogram, uint64_t count, double q) {
+    uint64_t target = (uint64_t) (q * count), seen = 0;
+    int i;
+
+    if (target >= count)
+        target = count - 1;
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        seen += histogram->counts[i];
+        if (seen > target)
+            break;
+    }
+    return (bucket_low(i) + bucket_low(i + 1)) / 2 / 1e9;
+}
+
+/*
+ * Writes the labels of a histogram: its opcode and, for executions, result.
+ */
+static int labels(char *buffer, int size, int op, int kind) {
+    if (kind == METRICS_QUEUE)
+        return snprintf(buffer, size, "op=\"%s\"", metrics_op_names[op]);
+    return snprintf(buffer, size, "op=\"%s\",result=\"%s\"", metrics_op_names[op], metrics_result_names[kind]);
+}
+
+static const char *metric_name(int kind) {
+    return kind == METRICS_QUEUE ? "tecnicofs_request_queue_seconds" : "tecnicofs_request_duration_seconds";
+}
+
+/*
+ * Writes the p50, p99 and p999 latency of every opcode as "name value"
+ * lines, for the stats request.
+ * Input:
+ *  - buffer: where to write
+ *  - size: size of the buffer
+ * Returns: number of bytes written
+ */
+int metrics_stats(char *buffer, int size) {
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    char label[64];
+    int n = 0;
+
+    pthread_mutex_lock(&metrics_lock);
+    metrics_merge();
+    for (int op = 0; op < METRICS_OP_COUNT; op++) {
+        for (int kind = 0; kind < METRICS_KINDS; kind++) {
+            uint64_t count = histogram_count(&metrics_merged[op][kind]);
+            if (count == 0)
+                continue;
+            labels(label, sizeof(label), op, kind);
+            for (int q = 0; q < 3 && n < size; q++)
+                n += snprintf(buffer + n, size - n, "%s{%s,quantile=\"%g\"} %.9f\n", metric_name(kind), label,
+                              quantiles[q], histogram_quantile(&metrics_merged[op][kind], count, quantiles[q]));
+            if (n < size)
+                n += snprintf(buffer + n, size - n, "%s_count{%s} %lu\n", metric_name(kind), label,
+                              (unsigned long) count);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return n < size ? n : (size > 0 ? size - 1 : 0);
+}
+
+/*
+ * Writes the histograms in the Prometheus text format, with
+ * METRICS_EXPORT_SUB buckets per power of two ns from 2^7 (128 ns) to
+ * 2^34 (about 17 s). Every bound is one of the histogram, so the
+ * cumulative counts are exact.
+ * Called with metrics_lock held.
+ */
+static void metrics_write_histograms(FILE *fp) {
+    char label[64];
+
+    for (int kind = 0; kind < METRICS_KINDS; kind++) {
+        /* the two execution kinds are one metric, told apart by a label */
+        if (kind != METRICS_SUCCESS) {
+            fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", metric_name(kind),
+                    kind == METRICS_QUEUE ? "Time requests waited to be executed." : "Time requests took to execute.",
+                    metric_name(kind));
+        }
+        for (int op = 0; op < METRICS_OP_COUNT; op++) {
+            metrics_histogram *histogram = &metrics_merged[op][kind];
+            uint64_t cumulative = 0;
+            int bucket = 0;
+
+            labels(label, sizeof(label), op, kind);
+            for (int power = 7; power <= 34; power++) {
+                for (int step = 0; step < METRICS_EXPORT_SUB && (power < 34 || step == 0); step++) {
+                    uint64_t bound = (1ull << power) + step * ((1ull << power) / METRICS_EXPORT_SUB);
+                    for (; bucket < bucket_of(bound); bucket++)
+                        cumulative += histogram->counts[bucket];
+                    fprintf(fp, "%s_bucket{%s,le=\"%.12g\"} %lu\n", metric_name(kind), label,
+                            (double) bound / 1e9, (unsigned long) cumulative);
+                }
+            }
+            fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %lu\n", metric_name(kind), label,
+                    (unsigned long) histogram_count(histogram));
+            fprintf(fp, "%s_sum{%s} %.9f\n", metric_name(kind), label, histogram->sum / 1e9);
+            fprintf(fp, "%s_count{%s} %lu\n", metric_name(kind), label,
+                    (unsigned long) histogram_count(histogram));
+        }
+    }
+}
+
+/*
+ * Merges the histograms and replaces the metrics file with them.
+ * Returns: SUCCESS or FAIL
+ */
+static int metrics_write() {
+    char tmp[MAX_PATH_SIZE];
+    FILE *fp;
+    int res;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return FAIL;
+    pthread_mutex_lock(&metrics_lock);
+    metrics_merge();
+    metrics_write_histograms(fp);
+    pthread_mutex_unlock(&metrics_lock);
+    res = ferror(fp) ? FAIL : SUCCESS;
+    if (fclose(fp) != 0 || res == FAIL || rename(tmp, metrics_path) != 0) {
+        unlink(tmp);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes the metrics file every METRICS_INTERVAL seconds.
+ */
+static void *metrics_thread_run() {
+    while (1) {
+        if (metrics_write() == FAIL)
+            fprintf(stderr, "metrics: cannot write %s\n", metrics_path);
+        sleep(METRICS_INTERVAL);
+    }
+    return NULL;
+}
+
+/*
+ * Starts the thread that writes the metrics file, read for example by the
+ * textfile collector of the Prometheus node exporter.
+ * Input:
+ *  - path: the file, replaced every METRICS_INTERVAL seconds
+ * Returns: SUCCESS or FAIL
+ */
+int metrics_start(const char *path) {
+    metrics_path = path;
+    if (metrics_write() == FAIL) {
+        fprintf(stderr, "metrics: cannot write %s\n", path);
+        return FAIL;
+    }
+    if (pthread_create(&metrics_tid, NULL, metrics_thread_run, NULL) != 0)
+        return FAIL;
+    return SUCCESS;
+}
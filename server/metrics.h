@@ -0,0 +1,44 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/* Seconds between writes of the metrics file */
+#define METRICS_INTERVAL 10
+/* Each power of two of a histogram is split in 2^METRICS_SUB_BITS buckets, about 3% of error */
+#define METRICS_SUB_BITS 5
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB)
+/* Prometheus buckets exported per power of two, a power of two up to METRICS_SUB */
+#define METRICS_EXPORT_SUB 4
+/* Opcodes with histograms, and their names in the exported metrics */
+#define METRICS_OPS "cldmp"
+#define METRICS_OP_COUNT 5
+
+/*
+ * What a histogram of an opcode measures:
+ *  - METRICS_QUEUE: from the I/O thread queueing the request to a worker
+ *    starting it (only requests received by I/O threads)
+ *  - METRICS_SUCCESS, METRICS_FAILURE: execution of requests that
+ *    succeeded or failed
+ */
+typedef enum metrics_kind {METRICS_QUEUE, METRICS_SUCCESS, METRICS_FAILURE, METRICS_KINDS} metrics_kind;
+
+/*
+ * Latencies in ns, log-linear: values up to METRICS_SUB have a bucket of
+ * their own, every power of two above is split in METRICS_SUB buckets.
+ * A bucket counts the values above its low bound up to and including the
+ * next one, as a Prometheus "le" bucket does.
+ */
+typedef struct metrics_histogram {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t sum;
+} metrics_histogram;
+
+uint64_t metrics_now();
+void metrics_received(uint64_t when);
+void metrics_record(char opcode, uint64_t start, int success);
+int metrics_stats(char *buffer, int size);
+int metrics_start(const char *path);
+
+#endif /* METRICS_H */
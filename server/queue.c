@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <sched.h>
+#include "fs/state.h"
+#include "queue.h"
+
+/*
+ * Initializes an empty queue.
+ * Input:
+ *  - queue: the queue
+ *  - capacity: most elements held at once, a power of 2
+ * Returns: SUCCESS or FAIL
+ */
+int queue_init(Queue *queue, int capacity) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+        return FAIL;
+    if ((queue->cells = malloc(sizeof(QueueCell) * capacity)) == NULL)
+        return FAIL;
+    for (int i = 0; i < capacity; i++)
+        queue->cells[i].seq = i;
+    queue->mask = capacity - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    return SUCCESS;
+}
+
+/*
+ * Releases the cells of a queue.
+ * Input:
+ *  - queue: the queue
+ */
+void queue_destroy(Queue *queue) {
+    free(queue->cells);
+}
+
+/*
+ * Adds an element at the tail, without blocking, other than to let a
+ * consumer finish taking the element its cell held the lap before.
+ * Input:
+ *  - queue: the queue
+ *  - data: the element
+ * Returns: SUCCESS or FAIL if the queue is full
+ */
+int queue_push(Queue *queue, void *data) {
+    unsigned long pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED), head;
+    QueueCell *cell;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        long diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            /* the cell is free for this position, claim it */
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* the cell still holds the element of the previous lap: the
+             * queue is full, unless a consumer has claimed that element
+             * and is about to free the cell */
+            head = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE);
+            if ((long) (pos - head) > (long) queue->mask)
+                return FAIL;
+            sched_yield();
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+/*
+ * Removes the element at the head, without blocking.
+ * Input:
+ *  - queue: the queue
+ * Returns: the element, or NULL if the queue is empty (or its head
+ *  element is still being written)
+ */
+void *queue_pop(Queue *queue) {
+    unsigned long pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    QueueCell *cell;
+    void *data;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        long diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    data = cell->data;
+    /* free the cell for the producer of the next lap */
+    __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+/*
+ * Returns: number of elements queued, counting pushes still in progress
+ */
+int queue_depth(Queue *queue) {
+    unsigned long tail = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_SEQ_CST);
+    unsigned long head = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_SEQ_CST);
+    return tail > head ? (int) (tail - head) : 0;
+}
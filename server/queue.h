@@ -0,0 +1,29 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+ * Bounded multi-producer multi-consumer queue of pointers (Vyukov).
+ * Each cell carries a sequence number telling whether it is ready to be
+ * written or read at a given position, so producers and consumers only
+ * contend on their own position counter.
+ */
+typedef struct queue_cell {
+	unsigned long seq;
+	void *data;
+} QueueCell;
+
+typedef struct queue {
+	QueueCell *cells;
+	unsigned long mask; /* capacity - 1, capacity is a power of 2 */
+	/* producer and consumer positions live on separate cache lines */
+	unsigned long enqueue_pos __attribute__((aligned(64)));
+	unsigned long dequeue_pos __attribute__((aligned(64)));
+} Queue;
+
+int queue_init(Queue *queue, int capacity);
+void queue_destroy(Queue *queue);
+int queue_push(Queue *queue, void *data);
+void *queue_pop(Queue *queue);
+int queue_depth(Queue *queue);
+
+#endif /* QUEUE_H */
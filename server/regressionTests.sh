@@ -0,0 +1,154 @@
+#!/bin/bash
+# Runs tecnicofs-load mixes that once hung the server, each under a time
+# limit, and fails if one does not finish or loses requests:
+#  - prints concurrent with moves
+#  - the same, with a checkpoint cut every second
+#  - pipelined stream clients asking for more messages than the pool has
+# and fails if a server restarted on its write-ahead log (and checkpoint
+# image) rebuilds a tree other than the one it printed:
+#  - creates below directories concurrent with moves of the directories
+#  - the same followed by a load mix, with a checkpoint cut every second
+# Usage: ./regressionTests.sh [numThreads]
+threads=${1:-4}
+load=../client/tecnicofs-load
+client=../client/tecnicofs-client
+socket=/tmp/tecnicofs-regression-$$
+dir=/tmp/tecnicofs-regression-$$.d
+limit=60
+
+if [[ ! $threads =~ ^[0-9]+$ ]] || (($threads < 1))
+then
+    echo "Usage: $0 [numThreads]"
+    echo "Error: invalid thread number"
+    exit 1
+fi
+
+if [[ ! -x ./tecnicofs || ! -x $load || ! -x $client ]]
+then
+    echo "Error: build ./tecnicofs, $load and $client first"
+    exit 1
+fi
+
+# Starts the server with the given options and waits for its socket
+startServer() {
+    rm -f $socket
+    ./tecnicofs $1 $threads $socket > /dev/null &
+    server=$!
+    for ((tries = 0; tries < 50; tries++))
+    do
+        [[ -S $socket ]] && break
+        sleep 0.1
+    done
+    if [[ ! -S $socket ]]
+    then
+        echo "Error: server did not start"
+        kill $server 2> /dev/null
+        exit 1
+    fi
+}
+
+stopServer() {
+    kill $server
+    wait $server 2> /dev/null
+}
+
+# Runs tecnicofs-load with the given options on the server started
+runLoad() {
+    result=$(timeout $limit $load "$@" $socket)
+    status=$?
+    if (($status != 0))
+    then
+        echo "Error: load generator failed or did not finish in $limit s"
+        stopServer
+        exit 1
+    fi
+    lost=$(echo "$result" | cut -d, -f8)
+    if [[ $lost != 0 ]]
+    then
+        echo "Error: $lost requests lost"
+        stopServer
+        exit 1
+    fi
+    echo "$result"
+}
+
+# Runs one mix: name, server options, then tecnicofs-load options
+runCase() {
+    local name=$1 opts=$2
+    shift 2
+    echo "Test: $name"
+    rm -rf $socket $dir
+    mkdir -p $dir
+    startServer "$opts"
+    runLoad "$@"
+    stopServer
+    rm -rf $socket $dir
+}
+
+# Runs a client on an input file of $dir, under the time limit
+runClient() {
+    if ! timeout $limit $client $dir/$1 $socket > /dev/null
+    then
+        echo "Error: client failed or did not finish in $limit s"
+        stopServer
+        exit 1
+    fi
+}
+
+# Creates files below /a/x and /b/x from two clients while a third swaps
+# /a and /b, then runs tecnicofs-load if given options for it, prints the
+# tree, restarts the server with the same options and checks it prints
+# the same tree, and that a checkpoint image was written if asked for:
+# name, server options, then tecnicofs-load options
+runReplayCase() {
+    local name=$1 opts=$2 i
+    shift 2
+    echo "Test: $name"
+    rm -rf $socket $dir
+    mkdir -p $dir
+    printf "c /a d\nc /a/x d\nc /b d\nc /b/x d\n" > $dir/setup
+    for ((i = 0; i < 300; i++))
+    do
+        echo "c /a/x/f$i f" >> $dir/createA
+        echo "c /b/x/g$i f" >> $dir/createB
+        printf "m /a /c\nm /b /a\nm /c /b\n" >> $dir/move
+    done
+    echo "p $dir/before" > $dir/printBefore
+    echo "p $dir/after" > $dir/printAfter
+    startServer "$opts"
+    runClient setup
+    runClient createA & createA=$!
+    runClient createB & createB=$!
+    runClient move
+    wait $createA && wait $createB || exit 1
+    (($# > 0)) && runLoad "$@"
+    runClient printBefore
+    stopServer
+    if [[ $opts == *"-c $dir/checkpoint"* && ! -s $dir/checkpoint ]]
+    then
+        echo "Error: no checkpoint image was written"
+        exit 1
+    fi
+    # loads the image, if any, and replays the log after it
+    startServer "$opts"
+    runClient printAfter
+    stopServer
+    # entries of a directory are listed in slot order, which a replay may change
+    if ! diff <(sort $dir/before) <(sort $dir/after) > /dev/null
+    then
+        echo "Error: tree rebuilt on restart differs from the tree printed"
+        exit 1
+    fi
+    echo "$(wc -l < $dir/before) paths rebuilt"
+    rm -rf $socket $dir
+}
+
+runCase "print and move" "" -c 4 -w 4 -d 3 -m c=20,m=60,p=20
+runCase "print and move with checkpoints" "-l $dir/wal -c $dir/checkpoint -C 1" \
+    -c 4 -w 4 -d 3 -m c=20,m=60,p=20
+runCase "stream clients past the message pool" "-t stream -i 4" \
+    -t stream -c 12 -w 64 -d 3
+runReplayCase "create below moved directories, replayed" "-l $dir/wal"
+runReplayCase "load, replayed over a checkpoint" "-l $dir/wal -c $dir/checkpoint -C 1" \
+    -c 4 -w 4 -d 3 -m c=40,l=10,d=20,m=30
+echo "All tests passed"
@@ -1,32 +1,62 @@
 #!/bin/bash
-inputDir=$1
-outputDir=$2
-maxThreads=$3
+# Runs the load generator against the server started with 1 to maxThreads
+# worker threads, and writes one CSV line per thread count to outputFile.
+# Arguments after outputFile are passed to tecnicofs-load, as -c 4 -r 20000,
+# and SERVER_OPTS to the server, as SERVER_OPTS="-t stream -i 2".
+maxThreads=$1
+outputFile=$2
+shift 2
+load=../client/tecnicofs-load
+socket=/tmp/tecnicofs-bench-$$
 
-
-if (($maxThreads < 1))
+if [[ ! $maxThreads =~ ^[0-9]+$ ]] || (($maxThreads < 1))
 then
+    echo "Usage: $0 maxThreads outputFile [tecnicofs-load options]"
     echo "Error: invalid thread number"
     exit 1
 fi
 
-if [[ ! -d $inputDir ]]
+if [[ -z $outputFile ]]
 then
-    echo "Error: invalid input directory"
+    echo "Error: invalid output file"
     exit 1
 fi
 
-if [[ ! -d $outputDir ]]
+if [[ ! -x ./tecnicofs || ! -x $load ]]
 then
-    echo "Error: invalid output directory"
+    echo "Error: build ./tecnicofs and $load first"
     exit 1
 fi
 
-for input in "$inputDir"*
-do 
-    for ((threads = 1; threads <= maxThreads; threads++))
+header=-H
+> "$outputFile"
+for ((threads = 1; threads <= maxThreads; threads++))
+do
+    echo "NumThreads=$threads"
+    rm -f $socket
+    ./tecnicofs $SERVER_OPTS $threads $socket > /dev/null &
+    server=$!
+    for ((tries = 0; tries < 50; tries++))
     do
-        echo "InputFile=$input NumThreads=$threads"
-        ./tecnicofs $input $outputdir/$input-$threads.txt $threads
+        [[ -S $socket ]] && break
+        sleep 0.1
     done
-done
\ No newline at end of file
+    if [[ ! -S $socket ]]
+    then
+        echo "Error: server did not start"
+        kill $server 2> /dev/null
+        exit 1
+    fi
+    if ! $load $header -T $threads "$@" $socket >> "$outputFile"
+    then
+        echo "Error: load generator failed"
+        kill $server
+        wait $server 2> /dev/null
+        rm -f $socket
+        exit 1
+    fi
+    header=
+    kill $server
+    wait $server 2> /dev/null
+done
+rm -f $socket
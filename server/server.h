@@ -0,0 +1,67 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "queue.h"
+#include "tecnicofs-protocol.h"
+
+/* Messages owned by the I/O threads and workers, and capacity of each queue */
+#define MESSAGE_POOL_SIZE 256
+/* Most datagrams received or sent by one recvmmsg or sendmmsg call */
+#define IO_BATCH 32
+
+/*
+ * Socket type the server listens on:
+ *  - TRANSPORT_DGRAM: SOCK_DGRAM, one message per datagram
+ *  - TRANSPORT_STREAM: SOCK_STREAM, persistent connections with
+ *    length-framed messages
+ */
+typedef enum transport_type {TRANSPORT_DGRAM, TRANSPORT_STREAM} transport_type;
+
+struct connection;
+
+/*
+ * Request received by an I/O thread, executed by a worker and sent back
+ * by the same I/O thread.
+ */
+typedef struct message {
+    int length; /* of the request, then of the reply (FAIL if none) */
+    int io; /* index of the I/O thread that received it */
+    struct sockaddr_un addr; /* sender, for datagrams */
+    socklen_t addrlen;
+    struct connection *conn; /* sender, for streams */
+    uint64_t received; /* metrics_now() when queued for the workers */
+    char request[TFS_MAX_MESSAGE];
+    char response[TFS_MAX_MESSAGE];
+} message;
+
+typedef struct io_thread {
+    Queue replies; /* messages executed, waiting to be sent */
+    int eventfd; /* signaled when replies are queued while sleeping */
+    int sleeping;
+} io_thread;
+
+extern int sockfd;
+extern int numberIOThreads;
+extern transport_type transport;
+extern int useUring;
+extern message *message_pool;
+extern io_thread *io_threads;
+extern Queue free_messages;
+extern unsigned long stat_messages, stat_recv_calls, stat_send_calls;
+extern int stat_connections;
+extern unsigned long stat_uring_enters;
+
+void queueRequest(message *m);
+
+void createStreamSocket(char *path);
+void *streamThread(void *arg);
+
+void *uringThread(void *arg);
+
+int applyDump(tfs_request *request, char *response);
+
+#endif /* SERVER_H */
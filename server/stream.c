@@ -0,0 +1,385 @@
+#define _GNU_SOURCE /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "fs/state.h"
+#include "server.h"
+
+/* Most requests of one connection queued or being executed at once */
+#define CONN_MAX_INFLIGHT 64
+/* Bytes of replies a connection may have unsent before it stops being read */
+#define CONN_MAX_UNSENT (1 << 20)
+/* Events returned by one epoll_wait */
+#define MAX_EVENTS 64
+/* Ms between retries of connections waiting for a free message */
+#define STALL_RETRY_MS 1
+
+/*
+ * Client connection, only ever touched by the I/O thread that accepted it.
+ * Workers only see it as the sender of a message.
+ */
+typedef struct connection {
+    int fd;
+    unsigned int events; /* epoll events registered for fd */
+    int inflight; /* requests queued or being executed */
+    int closed; /* fd closed, freed once inflight drops to 0 */
+    int dirty; /* in the list of connections with replies to write */
+    int stalled; /* in the list of connections waiting for a free message */
+    struct connection *next_dirty, *next_stalled;
+    int rlen; /* bytes in rbuf */
+    char rbuf[sizeof(tfs_frame_len) + TFS_MAX_MESSAGE];
+    char *wbuf; /* framed replies not written yet */
+    int woff, wlen, wcap;
+} connection;
+
+/*
+ * Per I/O thread state of the event loop.
+ */
+typedef struct stream_loop {
+    int index; /* index of the I/O thread */
+    int epfd;
+    connection *dirty, *stalled;
+} stream_loop;
+
+/* Listening socket, registered in the epoll set of every I/O thread */
+static int listenfd;
+
+
+/*
+ * Creates the listening stream socket of the server.
+ * Input:
+ *  - path: path for the socket address
+ * Exit: EXIT_FAILURE on error
+ */
+void createStreamSocket(char *path) {
+    struct sockaddr_un addr;
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        fprintf(stderr,"server: can't open socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(listenfd, (struct sockaddr *) &addr, SUN_LEN(&addr)) < 0) {
+        fprintf(stderr,"server: bind error");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(listenfd, SOMAXCONN) < 0) {
+        fprintf(stderr,"server: listen error");
+        exit(EXIT_FAILURE);
+    }
+    sockfd = listenfd;
+}
+
+
+/*
+ * Registers the events a connection is ready for: input while it may
+ * queue more requests, output while it has unsent replies.
+ */
+static void connUpdateEvents(stream_loop *loop, connection *conn) {
+    struct epoll_event ev;
+    unsigned int events = 0;
+
+    if (conn->closed)
+        return;
+    if (!conn->stalled && conn->inflight < CONN_MAX_INFLIGHT &&
+        conn->wlen - conn->woff < CONN_MAX_UNSENT && conn->rlen < (int) sizeof(conn->rbuf))
+        events |= EPOLLIN;
+    if (conn->wlen > conn->woff)
+        events |= EPOLLOUT;
+    if (events == conn->events)
+        return;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        fprintf(stderr,"streamThread: epoll_ctl error\n");
+    conn->events = events;
+}
+
+/*
+ * Frees a closed connection once no message refers to it anymore.
+ */
+static void connRelease(connection *conn) {
+    if (conn->closed && conn->inflight == 0 && !conn->dirty && !conn->stalled) {
+        free(conn->wbuf);
+        free(conn);
+    }
+}
+
+/*
+ * Closes the socket of a connection. Its requests still being executed
+ * complete normally, and their replies are discarded.
+ */
+static void connClose(stream_loop *loop, connection *conn) {
+    if (conn->closed)
+        return;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = 1;
+    conn->rlen = conn->wlen = conn->woff = 0;
+    __atomic_sub_fetch(&stat_connections, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Queues every complete request buffered by a connection, as long as it
+ * stays under CONN_MAX_INFLIGHT and messages are free.
+ * Returns: number of requests queued
+ */
+static int connParse(stream_loop *loop, connection *conn) {
+    int off = 0, queued = 0;
+    long len;
+    message *m;
+
+    while (!conn->closed && (len = tfs_decode_frame(conn->rbuf + off, conn->rlen - off)) >= 0) {
+        if (len == 0 || len > TFS_MAX_MESSAGE) {
+            fprintf(stderr,"streamThread: invalid frame of %ld bytes\n", len);
+            connClose(loop, conn);
+            return queued;
+        }
+        if (conn->rlen - off < (int) (sizeof(tfs_frame_len) + len) ||
+            conn->inflight >= CONN_MAX_INFLIGHT)
+            break;
+        if ((m = queue_pop(&free_messages)) == NULL) {
+            /* retried after replies, and every STALL_RETRY_MS meanwhile */
+            if (!conn->stalled) {
+                conn->stalled = 1;
+                conn->next_stalled = loop->stalled;
+                loop->stalled = conn;
+            }
+            break;
+        }
+        memcpy(m->request, conn->rbuf + off + sizeof(tfs_frame_len), len);
+        m->length = len;
+        m->io = loop->index;
+        m->conn = conn;
+        conn->inflight++;
+        queueRequest(m);
+        off += sizeof(tfs_frame_len) + len;
+        queued++;
+    }
+    if (off > 0) {
+        memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+        conn->rlen -= off;
+    }
+    connUpdateEvents(loop, conn);
+    return queued;
+}
+
+/*
+ * Reads what a connection has sent until the socket is drained or the
+ * connection may not queue more requests.
+ */
+static void connRead(stream_loop *loop, connection *conn) {
+    int n;
+
+    while (!conn->closed && (conn->events & EPOLLIN)) {
+        n = read(conn->fd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen);
+        __atomic_add_fetch(&stat_recv_calls, 1, __ATOMIC_RELAXED);
+        if (n > 0) {
+            conn->rlen += n;
+            connParse(loop, conn);
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            connClose(loop, conn);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+}
+
+/*
+ * Writes the buffered replies of a connection, as much as the socket takes.
+ */
+static void connFlush(stream_loop *loop, connection *conn) {
+    int n;
+
+    while (!conn->closed && conn->woff < conn->wlen) {
+        n = send(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff, MSG_NOSIGNAL);
+        __atomic_add_fetch(&stat_send_calls, 1, __ATOMIC_RELAXED);
+        if (n >= 0)
+            conn->woff += n;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else if (errno != EINTR)
+            connClose(loop, conn);
+    }
+    if (conn->woff == conn->wlen)
+        conn->woff = conn->wlen = 0;
+    connUpdateEvents(loop, conn);
+}
+
+/*
+ * Appends a framed reply to the write buffer of a connection.
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+static int connAppend(connection *conn, const char *reply, int length) {
+    tfs_frame_len len = length;
+    int need;
+
+    if (conn->woff > 0 && conn->wlen + (int) sizeof(len) + length > conn->wcap) {
+        /* reuse the room of what was already written */
+        memmove(conn->wbuf, conn->wbuf + conn->woff, conn->wlen - conn->woff);
+        conn->wlen -= conn->woff;
+        conn->woff = 0;
+    }
+    need = conn->wlen + sizeof(len) + length;
+    if (need > conn->wcap) {
+        int cap = conn->wcap > 0 ? conn->wcap : TFS_MAX_MESSAGE;
+        char *wbuf;
+        while (cap < need)
+            cap *= 2;
+        if ((wbuf = realloc(conn->wbuf, cap)) == NULL)
+            return FAIL;
+        conn->wbuf = wbuf;
+        conn->wcap = cap;
+    }
+    memcpy(conn->wbuf + conn->wlen, &len, sizeof(len));
+    memcpy(conn->wbuf + conn->wlen + sizeof(len), reply, length);
+    conn->wlen = need;
+    return SUCCESS;
+}
+
+/*
+ * Accepts every pending connection into the epoll set of this thread.
+ */
+static void streamAccept(stream_loop *loop) {
+    struct epoll_event ev;
+    connection *conn;
+    int fd;
+
+    while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        if ((conn = calloc(1, sizeof(connection))) == NULL) {
+            fprintf(stderr,"streamThread: out of memory for a connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr,"streamThread: epoll_ctl error\n");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        __atomic_add_fetch(&stat_connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Moves the replies executed by the workers to the write buffers of
+ * their connections, then writes each connection once and resumes the
+ * connections that were waiting for a message.
+ * Returns: number of replies handled
+ */
+static int streamReplies(stream_loop *loop) {
+    io_thread *io = &io_threads[loop->index];
+    connection *conn, *next;
+    message *m;
+    int n = 0;
+
+    while ((m = queue_pop(&io->replies)) != NULL) {
+        conn = m->conn;
+        conn->inflight--;
+        if (!conn->closed && m->length >= 0 && connAppend(conn, m->response, m->length) == FAIL) {
+            fprintf(stderr,"streamThread: out of memory for a reply\n");
+            connClose(loop, conn);
+        }
+        queue_push(&free_messages, m);
+        if (!conn->dirty) {
+            conn->dirty = 1;
+            conn->next_dirty = loop->dirty;
+            loop->dirty = conn;
+        }
+        n++;
+    }
+    for (conn = loop->dirty, loop->dirty = NULL; conn != NULL; conn = next) {
+        next = conn->next_dirty;
+        conn->dirty = 0;
+        connFlush(loop, conn);
+        /* below CONN_MAX_INFLIGHT again, buffered requests may go on */
+        connParse(loop, conn);
+        connRelease(conn);
+    }
+    /* messages may also have been freed by other I/O threads */
+    for (conn = loop->stalled, loop->stalled = NULL; conn != NULL; conn = next) {
+        next = conn->next_stalled;
+        conn->stalled = 0;
+        connParse(loop, conn);
+        connRelease(conn);
+    }
+    return n;
+}
+
+
+/*
+ * Loop of an I/O thread serving stream connections: an epoll set holds
+ * the listening socket, the connections accepted by this thread and its
+ * eventfd, so a single thread multiplexes many long-lived clients.
+ * Input:
+ *  - arg: index of the I/O thread
+ */
+void *streamThread(void *arg) {
+    stream_loop loop;
+    io_thread *io;
+    struct epoll_event ev, events[MAX_EVENTS];
+    uint64_t count;
+    int n, timeout;
+
+    loop.index = (int) (long) arg;
+    loop.dirty = loop.stalled = NULL;
+    io = &io_threads[loop.index];
+    if ((loop.epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr,"streamThread: epoll_create error\n");
+        exit(EXIT_FAILURE);
+    }
+    /* only one thread is woken for each incoming connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listenfd;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = io;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, io->eventfd, &ev);
+
+    while (1) {
+        /* a worker that queues a reply after this store will wake us */
+        __atomic_store_n(&io->sleeping, 1, __ATOMIC_SEQ_CST);
+        /* messages freed by other I/O threads do not wake this one */
+        timeout = queue_depth(&io->replies) > 0 ? 0 : (loop.stalled != NULL ? STALL_RETRY_MS : -1);
+        n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        __atomic_store_n(&io->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (n < 0 && errno != EINTR)
+            fprintf(stderr,"streamThread: epoll_wait error\n");
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listenfd) {
+                streamAccept(&loop);
+            } else if (ptr == io) {
+                if (read(io->eventfd, &count, sizeof(count)) < 0)
+                    fprintf(stderr,"streamThread: eventfd read error\n");
+            } else {
+                connection *conn = ptr;
+                if (events[i].events & EPOLLOUT)
+                    connFlush(&loop, conn);
+                if (events[i].events & EPOLLIN)
+                    connRead(&loop, conn);
+                else if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    /* reported even while input is not wanted, so the
+                     * connection is of no more use */
+                    connClose(&loop, conn);
+                connRelease(conn);
+            }
+        }
+        streamReplies(&loop);
+    }
+    return NULL;
+}
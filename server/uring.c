@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "fs/state.h"
+#include "server.h"
+
+/* Submission queue entries of each ring */
+#define URING_ENTRIES 256
+/* Receive buffers provided to the kernel, a power of 2 */
+#define URING_BUFFERS 64
+/* Buffer group of the receive buffers */
+#define URING_BGID 0
+/* Fixed file indexes */
+#define URING_SOCKET 0
+#define URING_EVENTFD 1
+/* user_data of the completions that are not sends (which carry a message) */
+#define URING_TAG_RECV 1
+#define URING_TAG_EVENT 2
+/* Bytes before the payload in a receive buffer */
+#define URING_RECV_HEADER (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_un))
+
+/*
+ * Minimal io_uring, mapped by hand: the kernel headers are all we rely on.
+ */
+typedef struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned int *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_local_tail; /* entries prepared, published by uringEnter */
+    unsigned int to_submit;
+} uring;
+
+/*
+ * Per I/O thread state of the io_uring backend.
+ */
+typedef struct uring_loop {
+    int index; /* index of the I/O thread */
+    uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers; /* URING_BUFFERS receive buffers of buffer_size bytes */
+    int buffer_size;
+    unsigned short buf_tail; /* next slot of buf_ring to refill */
+    int recv_armed; /* the multishot receive is active */
+    unsigned short pending[URING_BUFFERS]; /* received buffers waiting for a message */
+    int pending_head, pending_count;
+    struct msghdr recv_msg; /* template of the multishot receive */
+    struct msghdr send_msgs[MESSAGE_POOL_SIZE]; /* one per message of the pool */
+    struct iovec send_iovs[MESSAGE_POOL_SIZE];
+    uint64_t event_value;
+} uring_loop;
+
+unsigned long stat_uring_enters = 0;
+
+
+/*
+ * Sets up a ring and maps its queues.
+ * Returns: SUCCESS or FAIL
+ */
+static int uringInit(uring *ring) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    /* only this thread submits, and it handles completions when it enters */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        memset(&p, 0, sizeof(p));
+        if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+            return FAIL;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return FAIL;
+    cq_ptr = sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return FAIL;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return FAIL;
+
+    ring->sq_head = (unsigned int *) (sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq_ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned int *) (sq_ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned int *) (sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned int *) (cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *) (cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+    /* the kernel never reorders the array, so it maps slot i to sqe i */
+    for (unsigned int i = 0; i < p.sq_entries; i++)
+        ring->sq_array[i] = i;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->to_submit = 0;
+    return SUCCESS;
+}
+
+/*
+ * Publishes the prepared entries and optionally waits for a completion.
+ * Input:
+ *  - ring: the ring
+ *  - wait: if set, waits for at least one completion
+ *  - timeout_ns: if wait is set and this is not 0, waits at most this long
+ * Returns: SUCCESS or FAIL
+ */
+static int uringEnter(uring *ring, int wait, long timeout_ns) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    int res;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (ring->to_submit == 0 && !wait)
+        return SUCCESS;
+    if (wait && timeout_ns > 0) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_ns / 1000000000;
+        ts.tv_nsec = timeout_ns % 1000000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    __atomic_add_fetch(&stat_uring_enters, 1, __ATOMIC_RELAXED);
+    res = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0, flags, argp, argsz);
+    if (res < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+        return FAIL;
+    if (res > 0)
+        ring->to_submit -= res;
+    return SUCCESS;
+}
+
+/*
+ * Returns: a cleared submission entry, submitting the queued ones first
+ *  if the queue is full
+ */
+static struct io_uring_sqe *uringGetSqe(uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uringEnter(ring, 0, 0) == FAIL)
+            fprintf(stderr,"uringThread: io_uring_enter error\n");
+    }
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+
+/*
+ * Arms the multishot receive on the server socket: every datagram lands
+ * in one of the provided buffers and produces its own completion.
+ */
+static void armReceive(uring_loop *loop) {
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = URING_SOCKET;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->recv_msg;
+    sqe->len = 1;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_TAG_RECV;
+    loop->recv_armed = 1;
+}
+
+/*
+ * Arms a read of the eventfd the workers signal when replies are queued.
+ */
+static void armEvent(uring_loop *loop) {
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = URING_EVENTFD;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->event_value;
+    sqe->len = sizeof(loop->event_value);
+    sqe->user_data = URING_TAG_EVENT;
+}
+
+/*
+ * Prepares the send of a reply, sent by the next uringEnter together with
+ * every other entry prepared meanwhile.
+ */
+static void prepareSend(uring_loop *loop, message *m) {
+    int i = m - message_pool;
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    loop->send_iovs[i].iov_base = m->response;
+    loop->send_iovs[i].iov_len = m->length;
+    memset(&loop->send_msgs[i], 0, sizeof(struct msghdr));
+    loop->send_msgs[i].msg_name = &m->addr;
+    loop->send_msgs[i].msg_namelen = m->addrlen;
+    loop->send_msgs[i].msg_iov = &loop->send_iovs[i];
+    loop->send_msgs[i].msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = URING_SOCKET;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->send_msgs[i];
+    sqe->len = 1;
+    sqe->user_data = (uint64_t) (uintptr_t) m;
+}
+
+/*
+ * Gives a receive buffer back to the kernel.
+ */
+static void recycleBuffer(uring_loop *loop, unsigned short bid) {
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (loop->buffers + (size_t) bid * loop->buffer_size);
+    buf->len = loop->buffer_size;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the received datagrams to free messages and queues them for
+ * the workers, recycling their buffers. Datagrams wait in their buffers
+ * while the message pool is empty.
+ */
+static void queuePending(uring_loop *loop) {
+    struct io_uring_recvmsg_out *out;
+    unsigned short bid;
+    char *buffer;
+    message *m;
+
+    while (loop->pending_count > 0 && (m = queue_pop(&free_messages)) != NULL) {
+        bid = loop->pending[loop->pending_head];
+        loop->pending_head = (loop->pending_head + 1) % URING_BUFFERS;
+        loop->pending_count--;
+        buffer = loop->buffers + (size_t) bid * loop->buffer_size;
+        out = (struct io_uring_recvmsg_out *) buffer;
+        if ((out->flags & MSG_TRUNC) || out->payloadlen > TFS_MAX_MESSAGE) {
+            fprintf(stderr,"uringThread: datagram too long\n");
+            queue_push(&free_messages, m);
+        } else {
+            m->addrlen = out->namelen < sizeof(m->addr) ? out->namelen : sizeof(m->addr);
+            memcpy(&m->addr, buffer + sizeof(*out), m->addrlen);
+            memcpy(m->request, buffer + URING_RECV_HEADER, out->payloadlen);
+            m->length = out->payloadlen;
+            m->io = loop->index;
+            m->conn = NULL;
+            queueRequest(m);
+        }
+        recycleBuffer(loop, bid);
+    }
+}
+
+/*
+ * Handles every completion posted since the last call.
+ * Returns: number of completions
+ */
+static int reapCompletions(uring_loop *loop) {
+    uring *ring = &loop->ring;
+    unsigned int head = *ring->cq_head, n = 0;
+    struct io_uring_cqe *cqe;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        if (cqe->user_data == URING_TAG_RECV) {
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                int tail = (loop->pending_head + loop->pending_count++) % URING_BUFFERS;
+                loop->pending[tail] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                fprintf(stderr,"uringThread: recvmsg error %d\n", cqe->res);
+            }
+            /* stops on errors and when every buffer is in use */
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                loop->recv_armed = 0;
+        } else if (cqe->user_data == URING_TAG_EVENT) {
+            armEvent(loop);
+        } else {
+            message *m = (message *) (uintptr_t) cqe->user_data;
+            if (cqe->res < 0)
+                fprintf(stderr,"uringThread: sendmsg error %d\n", cqe->res);
+            queue_push(&free_messages, m);
+        }
+        head++;
+        n++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Creates the ring of an I/O thread, registers the socket, its eventfd
+ * and the receive buffers, and arms the first receive.
+ * Exit: EXIT_FAILURE on error
+ */
+static void uringSetup(uring_loop *loop, io_thread *io) {
+    struct io_uring_buf_reg reg;
+    int fds[2] = {sockfd, io->eventfd};
+
+    if (uringInit(&loop->ring) == FAIL) {
+        fprintf(stderr,"uringThread: io_uring unavailable (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (syscall(__NR_io_uring_register, loop->ring.fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+        fprintf(stderr,"uringThread: unable to register files (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    loop->buffer_size = URING_RECV_HEADER + TFS_MAX_MESSAGE;
+    loop->buffers = malloc((size_t) URING_BUFFERS * loop->buffer_size);
+    loop->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buffers == NULL || loop->buf_ring == MAP_FAILED) {
+        fprintf(stderr,"uringThread: out of memory for buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) loop->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr,"uringThread: unable to register buffers (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    loop->buf_tail = 0;
+    for (int i = 0; i < URING_BUFFERS; i++)
+        recycleBuffer(loop, i);
+
+    /* the kernel writes the sender address right after the header */
+    memset(&loop->recv_msg, 0, sizeof(loop->recv_msg));
+    loop->recv_msg.msg_namelen = sizeof(struct sockaddr_un);
+    loop->pending_head = loop->pending_count = 0;
+    armReceive(loop);
+    armEvent(loop);
+}
+
+
+/*
+ * Loop of an I/O thread using io_uring: a multishot receive stays armed
+ * on the server socket, and the replies collected in one iteration are
+ * submitted together with a single io_uring_enter, which also waits for
+ * the next completions.
+ * Input:
+ *  - arg: index of the I/O thread
+ */
+void *uringThread(void *arg) {
+    uring_loop *loop = malloc(sizeof(uring_loop));
+    io_thread *io;
+    message *m;
+    int wait;
+
+    if (loop == NULL) {
+        fprintf(stderr,"uringThread: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    loop->index = (int) (long) arg;
+    io = &io_threads[loop->index];
+    uringSetup(loop, io);
+
+    while (1) {
+        while ((m = queue_pop(&io->replies)) != NULL) {
+            if (m->length < 0)
+                queue_push(&free_messages, m);
+            else
+                prepareSend(loop, m);
+        }
+        queuePending(loop);
+        if (!loop->recv_armed && loop->pending_count < URING_BUFFERS)
+            armReceive(loop);
+
+        /* a worker that queues a reply after this store will wake us */
+        __atomic_store_n(&io->sleeping, 1, __ATOMIC_SEQ_CST);
+        wait = queue_depth(&io->replies) == 0;
+        /* messages freed by other I/O threads do not wake this one */
+        if (uringEnter(&loop->ring, wait, loop->pending_count > 0 ? 1000000 : 0) == FAIL)
+            fprintf(stderr,"uringThread: io_uring_enter error\n");
+        __atomic_store_n(&io->sleeping, 0, __ATOMIC_SEQ_CST);
+        reapCompletions(loop);
+    }
+    return NULL;
+}
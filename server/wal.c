@@ -0,0 +1,473 @@
+#define _GNU_SOURCE /* fdatasync, fallocate */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs/state.h"
+#include "wal.h"
+
+/*
+ * Mutations are appended to a buffer while they still hold the locks of
+ * the i-nodes they changed and rename_lock (see fs_mutation_begin), so two
+ * conflicting ones are logged in the order they were applied. The i-node
+ * locks alone would not do: a create holds only its parent, not the
+ * ancestor a concurrent move changes, so a replay could resolve its path
+ * after the move instead of before. The reply waits in wal_commit, after
+ * the locks are released: one committer writes (and fsyncs) everything
+ * appended so far while the next appends go to a second buffer, and the
+ * others wait for it.
+ * Offsets ("lsn") are positions in the file, which only grow: records
+ * already in a checkpoint are dropped by wal_discard without moving the
+ * others.
+ */
+static int wal_fd = -1;
+static unsigned long wal_start; /* first record kept */
+static wal_sync wal_policy;
+static int wal_replaying = 0;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_stopped = PTHREAD_COND_INITIALIZER;
+static char *wal_buffer, *wal_spare; /* appended, and being written */
+static size_t wal_used = 0, wal_capacity = 0, wal_spare_capacity = 0;
+static unsigned long wal_appended = 0, wal_written = 0, wal_synced = 0;
+static int wal_flushing = 0;
+static int wal_stop = 0;
+static pthread_t wal_thread;
+/* end of the last record appended by this thread */
+static __thread unsigned long wal_pending = 0;
+
+static uint32_t crc_table[256];
+
+
+/*
+ * Fills the CRC-32 (IEEE 802.3) table.
+ */
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+
+/*
+ * Continues a CRC-32 over more bytes.
+ * Input:
+ *  - crc: CRC of the previous bytes, 0 at the start
+ *  - data: the bytes
+ *  - len: number of bytes
+ * Returns: the CRC
+ */
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+/*
+ * Returns: the CRC of a record whose paths are in paths
+ */
+static uint32_t record_crc(const wal_record *record, const char *paths) {
+    uint32_t crc = crc_update(0, (const char *) record + sizeof(record->crc),
+                              sizeof(wal_record) - sizeof(record->crc));
+    return crc_update(crc, paths, record->path_len + record->path2_len);
+}
+
+
+/*
+ * Writes a whole buffer to the log.
+ * Exit: EXIT_FAILURE on error, as acknowledged mutations could be lost
+ */
+static void wal_write(const char *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(wal_fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wal: write");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Flushes the data of the log to the disk.
+ * Exit: EXIT_FAILURE on error
+ */
+static void wal_fsync() {
+    if (fdatasync(wal_fd) < 0) {
+        perror("wal: fdatasync");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Writes the log up to an offset, and fsyncs it if asked, with wal_lock
+ * held. If another thread is already writing, waits for it and writes
+ * what was appended meanwhile, with a single fsync.
+ * Input:
+ *  - lsn: offset that must be written
+ *  - sync: if set, the offset must also be fsync'ed
+ */
+static void wal_flush(unsigned long lsn, int sync) {
+    char *data;
+    size_t len, capacity;
+    unsigned long end;
+
+    while (wal_written < lsn || (sync && wal_synced < lsn)) {
+        if (wal_flushing) {
+            pthread_cond_wait(&wal_flushed, &wal_lock);
+            continue;
+        }
+        wal_flushing = 1;
+        data = wal_buffer;
+        len = wal_used;
+        capacity = wal_capacity;
+        end = wal_appended;
+        wal_buffer = wal_spare;
+        wal_capacity = wal_spare_capacity;
+        wal_used = 0;
+        pthread_mutex_unlock(&wal_lock);
+
+        wal_write(data, len);
+        if (sync)
+            wal_fsync();
+
+        pthread_mutex_lock(&wal_lock);
+        wal_spare = data;
+        wal_spare_capacity = capacity;
+        wal_written = end;
+        if (sync)
+            wal_synced = end;
+        wal_flushing = 0;
+        pthread_cond_broadcast(&wal_flushed);
+    }
+}
+
+
+/*
+ * Fsyncs the log every WAL_SYNC_INTERVAL_MS, for WAL_SYNC_INTERVAL.
+ */
+static void *wal_sync_thread() {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&wal_lock);
+    while (!wal_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_SYNC_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!wal_stop && pthread_cond_timedwait(&wal_stopped, &wal_lock, &deadline) != ETIMEDOUT);
+        wal_flush(wal_appended, 1);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+
+/*
+ * Appends a successful create, delete or move to the log, with the locks
+ * of the i-nodes it changed still held. Does nothing without a log or
+ * while replaying it.
+ * Input:
+ *  - request: the request executed
+ */
+void wal_append(const tfs_request *request) {
+    wal_record record;
+    size_t len = sizeof(record) + request->header.path_len + request->header.path2_len;
+
+    if (wal_fd < 0 || wal_replaying)
+        return;
+    record.opcode = request->header.opcode;
+    record.node_type = request->header.node_type;
+    record.path_len = request->header.path_len;
+    record.path2_len = request->header.path2_len;
+    record.pad = 0;
+
+    pthread_mutex_lock(&wal_lock);
+    if (wal_used + len > wal_capacity) {
+        size_t capacity = wal_capacity * 2 > wal_used + len ? wal_capacity * 2 : wal_used + len;
+        char *buffer = realloc(wal_buffer, capacity);
+        if (buffer == NULL) {
+            fprintf(stderr, "wal: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        wal_buffer = buffer;
+        wal_capacity = capacity;
+    }
+    memcpy(wal_buffer + wal_used + sizeof(record), request->path, record.path_len);
+    memcpy(wal_buffer + wal_used + sizeof(record) + record.path_len, request->path2, record.path2_len);
+    record.crc = record_crc(&record, wal_buffer + wal_used + sizeof(record));
+    memcpy(wal_buffer + wal_used, &record, sizeof(record));
+    wal_used += len;
+    wal_appended += len;
+    wal_pending = wal_appended;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/*
+ * Waits until the mutations appended by this thread are durable according
+ * to the fsync policy. Called before replying, without i-node locks.
+ */
+void wal_commit() {
+    if (wal_fd < 0 || wal_pending == 0)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    wal_flush(wal_pending, wal_policy == WAL_SYNC_GROUP);
+    pthread_mutex_unlock(&wal_lock);
+    wal_pending = 0;
+}
+
+
+/*
+ * Writes and fsyncs the log up to an offset, whatever the policy.
+ * Input:
+ *  - lsn: the offset
+ */
+void wal_sync_to(unsigned long lsn) {
+    if (wal_fd < 0)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    wal_flush(lsn, 1);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/*
+ * Reads up to len bytes of the log.
+ * Returns: number of bytes read, less than len only at the end of the file
+ * Exit: EXIT_FAILURE on error
+ */
+static size_t wal_read(char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = read(wal_fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wal: read");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+
+/*
+ * Executes the records of the log from the current offset.
+ * Input:
+ *  - offset: the current offset
+ *  - replay: function that executes a request
+ * Returns: offset of the end of the last complete record
+ */
+static off_t wal_replay(off_t offset, int (*replay)(tfs_request *request, int *value)) {
+    static char paths[2 * UINT16_MAX];
+    wal_record record;
+    tfs_request request;
+    int count = 0, value;
+
+    while (wal_read((char *) &record, sizeof(record)) == sizeof(record)) {
+        size_t len = record.path_len + record.path2_len;
+        if (wal_read(paths, len) != len || record_crc(&record, paths) != record.crc)
+            break;
+        memset(&request, 0, sizeof(request));
+        request.header.version = TFS_PROTOCOL_VERSION;
+        request.header.opcode = record.opcode;
+        request.header.node_type = record.node_type;
+        request.header.path_len = record.path_len;
+        request.header.path2_len = record.path2_len;
+        request.path = paths;
+        request.path2 = paths + record.path_len;
+        if (replay(&request, &value) != SUCCESS)
+            fprintf(stderr, "wal: record %d failed to replay\n", count);
+        offset += sizeof(record) + len;
+        count++;
+    }
+    printf("[WAL] replayed %d mutations\n", count);
+    return offset;
+}
+
+
+/*
+ * Fsyncs the directory holding a file, so that its creation is durable.
+ */
+static void wal_sync_dir(const char *path) {
+    char *copy = strdup(path);
+    int fd;
+
+    if (copy == NULL)
+        return;
+    if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+
+/*
+ * Opens the log, replaying the mutations it holds after a checkpoint, and
+ * starts logging. A torn record at its end, from a crash while writing,
+ * is discarded.
+ * Input:
+ *  - path: log file, created if missing
+ *  - policy: when commits are durable
+ *  - from: offset of the first mutation not in the checkpoint loaded, 0
+ *    without one
+ *  - replay: function that executes a request, e.g. applyCommands
+ * Returns: SUCCESS or FAIL if the file cannot be used as a log
+ */
+int wal_open(const char *path, wal_sync policy, unsigned long from, int (*replay)(tfs_request *request, int *value)) {
+    wal_header header;
+    off_t size, end;
+    size_t n;
+
+    crc_init();
+    if ((wal_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror("wal: open");
+        return FAIL;
+    }
+    if ((size = lseek(wal_fd, 0, SEEK_END)) < 0 || lseek(wal_fd, 0, SEEK_SET) < 0) {
+        perror("wal: lseek");
+        return FAIL;
+    }
+    if (from == 0)
+        from = sizeof(header);
+    n = wal_read((char *) &header, sizeof(header));
+    if (n == sizeof(header) && memcmp(header.magic, WAL_MAGIC, sizeof(header.magic)) == 0) {
+        if (from < header.start) {
+            fprintf(stderr, "wal: %s was compacted by a newer checkpoint than the one loaded\n", path);
+            return FAIL;
+        }
+        if ((off_t) from > size) {
+            fprintf(stderr, "wal: %s ends before the checkpoint loaded\n", path);
+            return FAIL;
+        }
+        wal_start = header.start;
+        wal_replaying = 1;
+        end = lseek(wal_fd, from, SEEK_SET) < 0 ? -1 : wal_replay(from, replay);
+        wal_replaying = 0;
+        if (end < 0 || ftruncate(wal_fd, end) < 0 || lseek(wal_fd, end, SEEK_SET) < 0) {
+            perror("wal: truncate");
+            return FAIL;
+        }
+    } else if (n < sizeof(header) && memcmp(header.magic, WAL_MAGIC, n < sizeof(header.magic) ? n : sizeof(header.magic)) == 0) {
+        /* new, or crashed while being created: it starts where the
+         * checkpoint ends, so offsets keep growing */
+        memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+        header.start = from;
+        end = from;
+        if (ftruncate(wal_fd, 0) < 0 || lseek(wal_fd, 0, SEEK_SET) < 0 || ftruncate(wal_fd, end) < 0) {
+            perror("wal: truncate");
+            return FAIL;
+        }
+        wal_write((char *) &header, sizeof(header));
+        if (lseek(wal_fd, end, SEEK_SET) < 0) {
+            perror("wal: lseek");
+            return FAIL;
+        }
+        wal_fsync();
+        wal_sync_dir(path);
+        wal_start = header.start;
+    } else {
+        fprintf(stderr, "wal: %s is not a log\n", path);
+        close(wal_fd);
+        wal_fd = -1;
+        return FAIL;
+    }
+
+    wal_policy = policy;
+    wal_appended = wal_written = wal_synced = end;
+    wal_capacity = wal_spare_capacity = WAL_BUFFER_SIZE;
+    if ((wal_buffer = malloc(wal_capacity)) == NULL || (wal_spare = malloc(wal_spare_capacity)) == NULL) {
+        fprintf(stderr, "wal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (policy == WAL_SYNC_INTERVAL && pthread_create(&wal_thread, NULL, wal_sync_thread, NULL) != 0) {
+        fprintf(stderr, "wal: unable to start the sync thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Returns: the offset after the last record appended, 0 without a log
+ */
+unsigned long wal_position() {
+    unsigned long lsn;
+
+    if (wal_fd < 0)
+        return 0;
+    pthread_mutex_lock(&wal_lock);
+    lsn = wal_appended;
+    pthread_mutex_unlock(&wal_lock);
+    return lsn;
+}
+
+
+/*
+ * Drops the records before an offset, once a checkpoint holding them is
+ * on disk: the header is moved past them and their blocks are freed.
+ * Input:
+ *  - lsn: offset of the first record to keep
+ */
+void wal_discard(unsigned long lsn) {
+    wal_header header;
+
+    if (wal_fd < 0 || lsn <= wal_start)
+        return;
+    memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+    header.start = lsn;
+    if (pwrite(wal_fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(wal_fd) < 0) {
+        perror("wal: discard");
+        return;
+    }
+    /* not supported by every file system, the log then keeps growing */
+    fallocate(wal_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, wal_start, lsn - wal_start);
+    wal_start = lsn;
+}
+
+
+/*
+ * Writes and fsyncs what is left in the log, and closes it.
+ */
+void wal_close() {
+    if (wal_fd < 0)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    wal_stop = 1;
+    pthread_cond_signal(&wal_stopped);
+    pthread_mutex_unlock(&wal_lock);
+    if (wal_policy == WAL_SYNC_INTERVAL)
+        pthread_join(wal_thread, NULL);
+
+    pthread_mutex_lock(&wal_lock);
+    wal_flush(wal_appended, 1);
+    pthread_mutex_unlock(&wal_lock);
+    close(wal_fd);
+    wal_fd = -1;
+    free(wal_buffer);
+    free(wal_spare);
+}
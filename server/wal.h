@@ -0,0 +1,54 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "tecnicofs-protocol.h"
+
+/* First bytes of a log file */
+#define WAL_MAGIC "TFSWAL1\n"
+/* Period of the background fsync with WAL_SYNC_INTERVAL, in milliseconds */
+#define WAL_SYNC_INTERVAL_MS 100
+/* Appended bytes that make the next commit write them, initial buffer size */
+#define WAL_BUFFER_SIZE (64 * 1024)
+
+/*
+ * When a mutation is durable once its reply is sent:
+ *  - WAL_SYNC_NONE: written to the log, which is never fsync'ed (survives
+ *    the server crashing, not the machine)
+ *  - WAL_SYNC_INTERVAL: written, and fsync'ed by a background thread every
+ *    WAL_SYNC_INTERVAL_MS
+ *  - WAL_SYNC_GROUP: written and fsync'ed, one fsync covering every
+ *    mutation waiting for it (group commit)
+ */
+typedef enum wal_sync {WAL_SYNC_NONE, WAL_SYNC_INTERVAL, WAL_SYNC_GROUP} wal_sync;
+
+/*
+ * Start of a log file. Offsets in the log ("lsn") are file offsets.
+ */
+typedef struct wal_header {
+    char magic[8]; /* WAL_MAGIC */
+    uint64_t start; /* offset of the first record kept, see wal_discard */
+} wal_header;
+
+/*
+ * Log record of a successful create, delete or move, followed by the
+ * path_len bytes of the path and the path2_len bytes of the second path.
+ */
+typedef struct wal_record {
+    uint32_t crc; /* CRC-32 of the rest of the record */
+    uint8_t opcode;
+    uint8_t node_type;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint16_t pad;
+} wal_record;
+
+int wal_open(const char *path, wal_sync policy, unsigned long from, int (*replay)(tfs_request *request, int *value));
+void wal_append(const tfs_request *request);
+void wal_commit();
+void wal_sync_to(unsigned long lsn);
+unsigned long wal_position();
+void wal_discard(unsigned long lsn);
+void wal_close();
+
+#endif /* WAL_H */
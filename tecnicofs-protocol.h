@@ -0,0 +1,358 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Binary framing spoken between tecnicofs-client-api and the server.
+ *
+ * A request is a tfs_request_header followed by path_len bytes of the
+ * first path and path2_len bytes of the second one, without a terminating
+ * '\0'. A reply is a tfs_reply_header followed by payload_len bytes.
+ * Client and server always run on the same machine (AF_UNIX), so fields
+ * are in host byte order.
+ *
+ * A batch is a tfs_batch_header followed by "count" requests back to back.
+ * It is answered by a single tfs_reply_header, whose value is "count" and
+ * whose payload holds one tfs_reply_header per request, in order.
+ *
+ * TFS_OP_STATS takes no path and is answered with a text payload of
+ * "name value" lines describing the server.
+ *
+ * TFS_OP_LOCKS takes as its path how many i-nodes to report, in decimal,
+ * and is answered with a text payload: a header line, then one line per
+ * i-node, the most contended first, with its lock counters and its path.
+ * It fails if the server does not profile its locks.
+ *
+ * TFS_OP_DUMP streams the whole tree, as one snapshot, in chunks the
+ * client pulls one at a time, which is its flow control. A request with
+ * an empty path opens a dump; the following chunks are asked for with a
+ * tfs_dump_cursor as the path (TFS_DUMP_CLOSE in flags ends it early).
+ * Each reply carries a tfs_dump_chunk and "count" records: a
+ * tfs_dump_record and name_len bytes of the name, depth first (every
+ * directory is followed by its subtree), starting with the root.
+ *
+ * On a stream socket every message is preceded by a tfs_frame_len with
+ * its size in bytes.
+ */
+
+#define TFS_PROTOCOL_VERSION 1
+
+/* Largest request or reply exchanged */
+#define TFS_MAX_MESSAGE 32768
+
+/* Opcodes, equal to the command letters of the text format */
+#define TFS_OP_CREATE 'c'
+#define TFS_OP_DELETE 'd'
+#define TFS_OP_LOOKUP 'l'
+#define TFS_OP_MOVE 'm'
+#define TFS_OP_PRINT 'p'
+#define TFS_OP_BATCH 'b'
+#define TFS_OP_STATS 's'
+#define TFS_OP_DUMP 't'
+#define TFS_OP_LOCKS 'k'
+
+/* Request flag of TFS_OP_DUMP, releases the dump instead of reading it */
+#define TFS_DUMP_CLOSE 1
+
+/* Most i-nodes a TFS_OP_LOCKS reply reports */
+#define TFS_MAX_LOCK_REPORT 64
+
+/* Most requests in a batch, so that its reply fits in a message */
+#define TFS_MAX_BATCH 1024
+
+/* Length prefix of a message on a stream socket */
+typedef uint32_t tfs_frame_len;
+
+typedef struct tfs_request_header {
+	uint8_t version; /* TFS_PROTOCOL_VERSION */
+	uint8_t opcode; /* TFS_OP_* */
+	uint8_t node_type; /* 'f' or 'd', for TFS_OP_CREATE */
+	uint8_t flags; /* TFS_DUMP_CLOSE for TFS_OP_DUMP, else 0 */
+	uint32_t request_id; /* echoed in the reply */
+	uint16_t path_len;
+	uint16_t path2_len;
+} tfs_request_header;
+
+typedef struct tfs_reply_header {
+	uint8_t version; /* TFS_PROTOCOL_VERSION */
+	uint8_t opcode; /* opcode of the request */
+	int16_t status; /* 0 or a TECNICOFS_ERROR_* code */
+	uint32_t request_id; /* request_id of the request */
+	int32_t value; /* result of the operation, e.g. i-number found by a lookup */
+	uint32_t payload_len; /* bytes following the header */
+} tfs_reply_header;
+
+typedef struct tfs_batch_header {
+	uint8_t version; /* TFS_PROTOCOL_VERSION */
+	uint8_t opcode; /* TFS_OP_BATCH */
+	uint16_t count; /* number of requests that follow */
+	uint32_t request_id; /* echoed in the reply */
+} tfs_batch_header;
+
+typedef struct tfs_dump_cursor {
+	uint32_t session; /* from the first chunk */
+	uint32_t seq; /* number of the chunk asked for */
+} tfs_dump_cursor;
+
+typedef struct tfs_dump_chunk {
+	uint32_t session; /* dump the chunk belongs to */
+	uint32_t seq; /* number of the chunk, from 0 */
+	uint16_t count; /* records that follow */
+	uint8_t last; /* set in the final chunk */
+	uint8_t pad;
+} tfs_dump_chunk;
+
+typedef struct tfs_dump_record {
+	uint8_t node_type; /* 'f' or 'd' */
+	uint8_t pad;
+	uint16_t name_len;
+	uint32_t depth; /* 0 for the root, whose name is empty */
+} tfs_dump_record;
+
+/*
+ * Request with its paths pointing into the buffer it was decoded from
+ * (not '\0' terminated).
+ */
+typedef struct tfs_request {
+	tfs_request_header header;
+	const char *path;
+	const char *path2;
+} tfs_request;
+
+/*
+ * Encodes a request.
+ * Input:
+ *  - buf: output buffer
+ *  - size: size of the buffer
+ *  - opcode: TFS_OP_*
+ *  - node_type: 'f' or 'd' for TFS_OP_CREATE, else 0
+ *  - request_id: identifier echoed by the reply
+ *  - path: first path
+ *  - path2: second path, or NULL
+ * Returns: number of bytes written, or -1 if it does not fit
+ */
+static inline int tfs_encode_request(char *buf, size_t size, uint8_t opcode, uint8_t node_type,
+                                     uint32_t request_id, const char *path, const char *path2) {
+	tfs_request_header header;
+	size_t len = strlen(path), len2 = path2 ? strlen(path2) : 0;
+
+	if (len > UINT16_MAX || len2 > UINT16_MAX || sizeof(header) + len + len2 > size)
+		return -1;
+	header.version = TFS_PROTOCOL_VERSION;
+	header.opcode = opcode;
+	header.node_type = node_type;
+	header.flags = 0;
+	header.request_id = request_id;
+	header.path_len = len;
+	header.path2_len = len2;
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), path, len);
+	if (len2)
+		memcpy(buf + sizeof(header) + len, path2, len2);
+	return sizeof(header) + len + len2;
+}
+
+/*
+ * Decodes a request.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes
+ *  - request: where to store the request
+ * Returns: number of bytes consumed, or -1 if malformed
+ */
+static inline int tfs_decode_request(const char *buf, size_t size, tfs_request *request) {
+	size_t len;
+
+	if (size < sizeof(tfs_request_header))
+		return -1;
+	memcpy(&request->header, buf, sizeof(tfs_request_header));
+	len = sizeof(tfs_request_header) + request->header.path_len + request->header.path2_len;
+	if (request->header.version != TFS_PROTOCOL_VERSION || len > size)
+		return -1;
+	request->path = buf + sizeof(tfs_request_header);
+	request->path2 = request->path + request->header.path_len;
+	return len;
+}
+
+/*
+ * Reads the opcode of a message without decoding it.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes
+ * Returns: the opcode, or -1 if the message is too short
+ */
+static inline int tfs_peek_opcode(const char *buf, size_t size) {
+	if (size < 2)
+		return -1;
+	return (uint8_t) buf[1];
+}
+
+/*
+ * Encodes the header of a batch, the requests are appended after it.
+ * Input:
+ *  - buf: output buffer, with room for a tfs_batch_header
+ *  - request_id: identifier echoed by the reply
+ *  - count: number of requests in the batch
+ * Returns: number of bytes written
+ */
+static inline int tfs_encode_batch(char *buf, uint32_t request_id, uint16_t count) {
+	tfs_batch_header header;
+
+	header.version = TFS_PROTOCOL_VERSION;
+	header.opcode = TFS_OP_BATCH;
+	header.count = count;
+	header.request_id = request_id;
+	memcpy(buf, &header, sizeof(header));
+	return sizeof(header);
+}
+
+/*
+ * Decodes the header of a batch.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes
+ *  - header: where to store the header
+ * Returns: number of bytes consumed, or -1 if malformed
+ */
+static inline int tfs_decode_batch(const char *buf, size_t size, tfs_batch_header *header) {
+	if (size < sizeof(tfs_batch_header))
+		return -1;
+	memcpy(header, buf, sizeof(tfs_batch_header));
+	if (header->version != TFS_PROTOCOL_VERSION || header->opcode != TFS_OP_BATCH ||
+	    header->count > TFS_MAX_BATCH)
+		return -1;
+	return sizeof(tfs_batch_header);
+}
+
+/*
+ * Encodes a reply header, the payload (if any) is written by the caller
+ * right after it.
+ * Input:
+ *  - buf: output buffer, with room for a tfs_reply_header
+ *  - request: header of the request being answered
+ *  - status: 0 or a TECNICOFS_ERROR_* code
+ *  - value: result of the operation
+ *  - payload_len: bytes that follow the header
+ * Returns: number of bytes written
+ */
+static inline int tfs_encode_reply(char *buf, const tfs_request_header *request, int status,
+                                   int value, uint32_t payload_len) {
+	tfs_reply_header reply;
+
+	reply.version = TFS_PROTOCOL_VERSION;
+	reply.opcode = request->opcode;
+	reply.status = status;
+	reply.request_id = request->request_id;
+	reply.value = value;
+	reply.payload_len = payload_len;
+	memcpy(buf, &reply, sizeof(reply));
+	return sizeof(reply);
+}
+
+/*
+ * Decodes a reply header.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes
+ *  - reply: where to store the header
+ * Returns: number of bytes of the header and payload, or -1 if malformed
+ */
+static inline int tfs_decode_reply(const char *buf, size_t size, tfs_reply_header *reply) {
+	if (size < sizeof(tfs_reply_header))
+		return -1;
+	memcpy(reply, buf, sizeof(tfs_reply_header));
+	if (reply->version != TFS_PROTOCOL_VERSION || sizeof(tfs_reply_header) + reply->payload_len > size)
+		return -1;
+	return sizeof(tfs_reply_header) + reply->payload_len;
+}
+
+/*
+ * Reads the length of the first message framed in a stream buffer.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes
+ * Returns: size of the message without its prefix, or -1 if the prefix
+ *  is not complete yet
+ */
+static inline long tfs_decode_frame(const char *buf, size_t size) {
+	tfs_frame_len len;
+
+	if (size < sizeof(len))
+		return -1;
+	memcpy(&len, buf, sizeof(len));
+	return len;
+}
+
+/*
+ * Encodes a TFS_OP_DUMP request.
+ * Input:
+ *  - buf: output buffer, with room for a header and a cursor
+ *  - request_id: identifier echoed by the reply
+ *  - cursor: chunk asked for, or NULL to open a dump
+ *  - flags: 0 or TFS_DUMP_CLOSE
+ * Returns: number of bytes written
+ */
+static inline int tfs_encode_dump_request(char *buf, uint32_t request_id,
+                                          const tfs_dump_cursor *cursor, uint8_t flags) {
+	tfs_request_header header;
+
+	header.version = TFS_PROTOCOL_VERSION;
+	header.opcode = TFS_OP_DUMP;
+	header.node_type = 0;
+	header.flags = flags;
+	header.request_id = request_id;
+	header.path_len = cursor ? sizeof(*cursor) : 0;
+	header.path2_len = 0;
+	memcpy(buf, &header, sizeof(header));
+	if (cursor)
+		memcpy(buf + sizeof(header), cursor, sizeof(*cursor));
+	return sizeof(header) + header.path_len;
+}
+
+/*
+ * Encodes a node of a dump.
+ * Input:
+ *  - buf: output buffer
+ *  - size: room left in the buffer
+ *  - node_type: 'f' or 'd'
+ *  - depth: depth of the node
+ *  - name: name of the node
+ * Returns: number of bytes written, or -1 if it does not fit
+ */
+static inline int tfs_encode_dump_record(char *buf, size_t size, uint8_t node_type,
+                                         uint32_t depth, const char *name) {
+	tfs_dump_record record;
+	size_t len = strlen(name);
+
+	if (len > UINT16_MAX || sizeof(record) + len > size)
+		return -1;
+	record.node_type = node_type;
+	record.pad = 0;
+	record.name_len = len;
+	record.depth = depth;
+	memcpy(buf, &record, sizeof(record));
+	memcpy(buf + sizeof(record), name, len);
+	return sizeof(record) + len;
+}
+
+/*
+ * Decodes a node of a dump.
+ * Input:
+ *  - buf: received bytes
+ *  - size: number of received bytes left
+ *  - record: where to store the record, its name is at buf + sizeof(*record)
+ * Returns: number of bytes consumed, or -1 if malformed
+ */
+static inline int tfs_decode_dump_record(const char *buf, size_t size, tfs_dump_record *record) {
+	if (size < sizeof(tfs_dump_record))
+		return -1;
+	memcpy(record, buf, sizeof(tfs_dump_record));
+	if (sizeof(tfs_dump_record) + record->name_len > size)
+		return -1;
+	return sizeof(tfs_dump_record) + record->name_len;
+}
+
+#endif /* TECNICOFS_PROTOCOL_H */